@@ -0,0 +1,97 @@
+/*      assets.c      lookup in the generated table of static files
+ *
+ *      See assets.h for the table layout and host/mkassets.c for the
+ *      generator.
+*/
+
+#include <avr/pgmspace.h>
+#include "http.h"
+#include "assets.h"
+
+/*
+ *  Byte idx of the path of entry i of asset_by_path.  Every path in an
+ *  ASSET_MATCH range is at least idx bytes long, so this is at most its NUL.
+ */
+static unsigned char path_byte(unsigned char i, unsigned char idx)
+{
+	const char *path;
+
+	path = pgm_read_ptr(&asset_table[pgm_read_byte(&asset_by_path[i])].path);
+	return pgm_read_byte(&path[idx]);
+}
+
+/*
+ *  asset_match_init      start matching a new request path
+ */
+void asset_match_init(ASSET_MATCH *m)
+{
+	m->lo = 0;
+	m->hi = pgm_read_word(&asset_count);
+}
+
+/*
+ *  asset_match_byte      narrow the match by byte idx of the request path
+ *
+ *  Feed every path byte, in order, as it arrives.  The paths in the range
+ *  all share the bytes before idx and are sorted, so the ones whose byte
+ *  idx is c lie together; the range closes in on them from both ends.
+ *  All in all that costs about one flash lookup per path byte and per
+ *  entry it drops.
+ */
+void asset_match_byte(ASSET_MATCH *m, unsigned char idx, unsigned char c)
+{
+	if (c == 0) {
+		m->hi = m->lo;	// would match the NUL; no path has one
+		return;
+	}
+	while (m->lo < m->hi && path_byte(m->lo, idx) < c)
+		m->lo++;
+	while (m->hi > m->lo && path_byte(m->hi - 1, idx) > c)
+		m->hi--;
+}
+
+/*
+ *  asset_find      look up a request path
+ *
+ *  Argument req is the parsed request and m the match fed its path.  On a
+ *  hit the table entry is copied to *asset and 1 is returned; otherwise 0.
+ *  Costs one displacement read and one entry read from flash whatever the
+ *  size of the table, and a read of asset_by_path once the hash and length
+ *  match.
+ */
+unsigned char asset_find(const HTTP_REQ *req, const ASSET_MATCH *m, ASSET *asset)
+{
+	unsigned long hash;
+
+	unsigned int count;
+	unsigned int bucket;
+	unsigned int slot;
+
+	hash = req->path_hash;
+	count = pgm_read_word(&asset_count);
+	if (count == 0)
+		return 0;
+	bucket = (unsigned int)hash & (pgm_read_word(&asset_buckets) - 1);
+	slot = ((unsigned int)(hash >> 16) % count + pgm_read_word(&asset_disp[bucket])) % count;
+
+	memcpy_P(asset, &asset_table[slot], sizeof(*asset));
+	return asset->hash == hash && asset->path_len == req->path_len
+	    && m->lo < m->hi && pgm_read_byte(&asset_by_path[m->lo]) == slot;	// the shortest path in the range is first
+}
+
+/*
+ *  asset_etag_hash      HTTP_HASH of a copy's entity tag
+ *
+ *  Argument data_P is the asset's data or gz_data.  The result compares
+ *  with the If-None-Match hash from the HTTP parser.
+ */
+unsigned long asset_etag_hash(const unsigned char *data_P)
+{
+	unsigned long h;
+	unsigned char i;
+
+	h = HTTP_HASH_INIT;
+	for (i = 6; i < ASSET_ETAG_LEN - 2; i++)	// between "ETag: " and the CRLF
+		h = HTTP_HASH(h, pgm_read_byte(&data_P[i]));
+	return h;
+}
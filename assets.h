@@ -0,0 +1,73 @@
+#ifndef ASSETSH
+#define ASSETSH
+
+#include "http.h"
+
+/*
+ *  Static files served from flash.  The table itself (assetdata.c) is
+ *  generated at build time by host/mkassets from the files under www/.
+ *
+ *  Each asset's data is its header lines (Content-Type, Content-Length),
+ *  the blank line, then the body, all in flash.  The status line is not
+ *  included, so the server can choose it.  Compressible files may also
+ *  have a gzip copy, with its own headers (Content-Encoding: gzip), that
+ *  the server sends instead when the client accepts it.
+ *
+ *  The first header line of every copy is its strong ETag, computed from
+ *  its bytes at build time.  Copies of a file that has a gzip copy have a
+ *  Vary line second.  A 304 repeats just these lines (asset_cond_len()).
+ *
+ *  Paths are found through a minimal perfect hash over HTTP_HASH of the
+ *  path:
+ *
+ *      slot = ((hash >> 16) % count + disp[hash & (buckets - 1)]) % count
+ *
+ *  and the entry in that slot is checked against the full hash and the
+ *  path length.  A different path that happens to share the hash must not
+ *  be served the asset, but the request path is not kept anywhere, so it
+ *  is compared as it streams in instead: asset_by_path lists the slots in
+ *  order of their paths (strcmp order), and an ASSET_MATCH narrows a range
+ *  of that list, one path byte at a time, to the paths that begin with
+ *  the bytes seen.  The path is an asset's exactly when that asset's entry
+ *  opens the range and is no longer than the path.  That costs two bytes
+ *  per connection and a few flash reads per path byte.
+ */
+
+typedef struct asset_t {
+	unsigned long hash;	/* HTTP_HASH of the path */
+	unsigned char path_len;	/* length of the path */
+	const char *path;	/* the path (flash), NUL-terminated, for ASSET_MATCH */
+	const unsigned char *data;	/* headers and body (flash) */
+	unsigned int hdr_len;	/* header bytes, including the blank line */
+	unsigned int len;	/* header and body bytes */
+	const unsigned char *gz_data;	/* gzip copy (flash), 0 if none */
+	unsigned int gz_hdr_len;
+	unsigned int gz_len;
+} ASSET;
+
+typedef struct asset_match_t {
+	unsigned char lo;	/* first asset_by_path entry whose path begins with the bytes seen */
+	unsigned char hi;	/* one past the last */
+} ASSET_MATCH;
+
+#define ASSET_MAX       255	/* most entries an ASSET_MATCH can range over */
+#define ASSET_PATH_MAX  254	/* longest path; HTTP_REQ.path_len saturates at 255 */
+
+#define ASSET_ETAG_LEN  18	/* ETag: "xxxxxxxx"\r\n */
+#define ASSET_VARY_LEN  23	/* Vary: Accept-Encoding\r\n */
+
+#define asset_cond_len(a)       (ASSET_ETAG_LEN + ((a)->gz_data ? ASSET_VARY_LEN : 0))
+
+/* generated tables, all in flash */
+extern const ASSET asset_table[];
+extern const unsigned int asset_disp[];
+extern const unsigned int asset_count;
+extern const unsigned int asset_buckets;	/* a power of two */
+extern const unsigned char asset_by_path[];	/* slots, in order of their paths */
+
+void asset_match_init(ASSET_MATCH  *m);
+void asset_match_byte(ASSET_MATCH  *m, unsigned char  idx, unsigned char  c);
+unsigned char asset_find(const HTTP_REQ  *req, const ASSET_MATCH  *m, ASSET  *asset);
+unsigned long asset_etag_hash(const unsigned char  *data_P);
+
+#endif
@@ -2,17 +2,19 @@
 */
 
 #include <avr/io.h>
-#include <util/delay.h>
+#include <avr/interrupt.h>
+#include <avr/sleep.h>
 #include <stdio.h>
-#include <avr/pgmspace.h>
 #include "w5100.h"
 #include "avrethernet.h"
+#include "clock.h"
+#include "scheduler.h"
+#include "httpd.h"
+#include "upstream.h"
+#include "stats.h"
+#include "trace.h"
 #include "uart.h"
 
-#define MAX_BUF         256	/* largest buffer we can read from chip */
-
-#define HTTP_PORT       80	/* TCP port for HTTP */
-
 /*
  *  Ethernet setup
  *
@@ -24,9 +26,21 @@ W5100_CFG my_cfg = {
 	{0xDE, 0xAD, 0xBE, 0xEF, 0xFE, 0xED},	// MAC address
 	{192, 168, 1, 177},			// IP address
 	{255, 255, 255, 0},			// Subnet mask
-	{192, 168, 1, 1}                         // Gateway
+	{192, 168, 1, 1},                        // Gateway
+	{2, 2, 2, 2},				// RX buffer Kbytes per socket
+	{2, 2, 2, 2}				// TX buffer Kbytes per socket
 };
 
+#if UPSTREAM_SOCKETS > 0
+/*
+ *  Collector the upstream pool keeps connections open to, and how often a
+ *  report is pushed to it.
+ */
+static const unsigned char collector_ip[4] = {192, 168, 1, 10};
+#define COLLECTOR_PORT	9000
+#define REPORT_MS	1000
+#endif
+
 /*
  *  Callback function block
  *
@@ -38,146 +52,6 @@ W5100_CFG my_cfg = {
  */
 W5100_CALLBACKS my_callbacks;
 
-unsigned char buf[MAX_BUF];
-
-unsigned char OpenSocket(unsigned char sock, unsigned char eth_protocol,
-			 unsigned int tcp_port)
-{
-	unsigned char retval;
-	unsigned int sockaddr;
-
-	retval = W5100_FAIL;	// assume this doesn't work
-	if (sock >= W5100_NUM_SOCKETS)
-		return retval;	// illegal socket value is bad!
-
-	sockaddr = W5100_SKT_BASE(sock);	// calc base addr for this socket
-
-	if (W51_read(sockaddr + W5100_SR_OFFSET) == W5100_SKT_SR_CLOSED)	// Make sure we close the socket first
-	{
-		CloseSocket(sock);
-	}
-
-	W51_write(sockaddr + W5100_MR_OFFSET, eth_protocol);	// set protocol for this socket
-	W51_write(sockaddr + W5100_PORT_OFFSET, ((tcp_port & 0xFF00) >> 8));	// set port for this socket (MSB)
-	W51_write(sockaddr + W5100_PORT_OFFSET + 1, (tcp_port & 0x00FF));	// set port for this socket (LSB)
-	W51_write(sockaddr + W5100_CR_OFFSET, W5100_SKT_CR_OPEN);	// open the socket
-
-	while (W51_read(sockaddr + W5100_CR_OFFSET)) ;	// loop until device reports socket is open (blocks!!)
-
-	if (W51_read(sockaddr + W5100_SR_OFFSET) == W5100_SKT_SR_INIT)
-		retval = sock;	// if success, return socket number
-	else
-		CloseSocket(sock);	// if failed, close socket immediately
-
-	return retval;
-}
-
-void CloseSocket(unsigned char sock)
-{
-	unsigned int sockaddr;
-
-	if (sock > W5100_NUM_SOCKETS)
-		return;		// if illegal socket number, ignore request
-	sockaddr = W5100_SKT_BASE(sock);	// calc base addr for this socket
-
-	W51_write(sockaddr + W5100_CR_OFFSET, W5100_SKT_CR_CLOSE);	// tell chip to close the socket
-	while (W51_read(sockaddr + W5100_CR_OFFSET)) ;	// loop until socket is closed (blocks!!)
-}
-
-void DisconnectSocket(unsigned char sock)
-{
-	unsigned int sockaddr;
-
-	if (sock > W5100_NUM_SOCKETS)
-		return;		// if illegal socket number, ignore request
-	sockaddr = W5100_SKT_BASE(sock);	// calc base addr for this socket
-
-	W51_write(sockaddr + W5100_CR_OFFSET, W5100_SKT_CR_DISCON);	// disconnect the socket
-	while (W51_read(sockaddr + W5100_CR_OFFSET)) ;	// loop until socket is closed (blocks!!)
-}
-
-unsigned char Listen(unsigned char sock)
-{
-	unsigned char retval;
-	unsigned int sockaddr;
-
-	retval = W5100_FAIL;	// assume this fails
-	if (sock > W5100_NUM_SOCKETS)
-		return retval;	// if illegal socket number, ignore request
-
-	sockaddr = W5100_SKT_BASE(sock);	// calc base addr for this socket
-	if (W51_read(sockaddr + W5100_SR_OFFSET) == W5100_SKT_SR_INIT)	// if socket is in initialized state...
-	{
-		W51_write(sockaddr + W5100_CR_OFFSET, W5100_SKT_CR_LISTEN);	// put socket in listen state
-		while (W51_read(sockaddr + W5100_CR_OFFSET)) ;	// block until command is accepted
-
-		if (W51_read(sockaddr + W5100_SR_OFFSET) == W5100_SKT_SR_LISTEN)
-			retval = W5100_OK;	// if socket state changed, show success
-		else
-			CloseSocket(sock);	// not in listen mode, close and show an error occurred
-	}
-	return retval;
-}
-
-unsigned char Send(unsigned char sock, const unsigned char *buf,
-		   unsigned int buflen)
-{
-	unsigned int ptr;
-	unsigned int offaddr;
-	unsigned int realaddr;
-	unsigned int txsize;
-	unsigned int timeout;
-	unsigned int sockaddr;
-
-	if (buflen == 0 || sock >= W5100_NUM_SOCKETS)
-		return W5100_FAIL;	// ignore illegal requests
-	sockaddr = W5100_SKT_BASE(sock);	// calc base addr for this socket
-	// Make sure the TX Free Size Register is available
-	txsize = W51_read(sockaddr + W5100_TX_FSR_OFFSET);	// make sure the TX free-size reg is available
-	txsize =
-	    (((txsize & 0x00FF) << 8) +
-	     W51_read(sockaddr + W5100_TX_FSR_OFFSET + 1));
-
-	timeout = 0;
-	while (txsize < buflen) {
-		_delay_ms(1);
-
-		txsize = W51_read(sockaddr + W5100_TX_FSR_OFFSET);	// make sure the TX free-size reg is available
-		txsize =
-		    (((txsize & 0x00FF) << 8) +
-		     W51_read(sockaddr + W5100_TX_FSR_OFFSET + 1));
-
-		if (timeout++ > 1000)	// if max delay has passed...
-		{
-			DisconnectSocket(sock);	// can't connect, close it down
-			return W5100_FAIL;	// show failure
-		}
-	}
-
-	// Read the Tx Write Pointer
-	ptr = W51_read(sockaddr + W5100_TX_WR_OFFSET);
-	offaddr =
-	    (((ptr & 0x00FF) << 8) +
-	     W51_read(sockaddr + W5100_TX_WR_OFFSET + 1));
-
-	while (buflen) {
-		buflen--;
-		realaddr = (W5100_TXBUFADDR + (0x0800 * sock)) + (offaddr & W5100_TX_BUF_MASK);	// calc W5100 physical buffer addr for this socket
-
-		W51_write(realaddr, *buf);	// send a byte of application data to TX buffer
-		offaddr++;	// next TX buffer addr
-		buf++;		// next input buffer addr
-	}
-
-	W51_write(sockaddr + W5100_TX_WR_OFFSET, (offaddr & 0xFF00) >> 8);	// send MSB of new write-pointer addr
-	W51_write(sockaddr + W5100_TX_WR_OFFSET + 1, (offaddr & 0x00FF));	// send LSB
-
-	W51_write(sockaddr + W5100_CR_OFFSET, W5100_SKT_CR_SEND);	// start the send on its way
-	while (W51_read(sockaddr + W5100_CR_OFFSET)) ;	// loop until socket starts the send (blocks!!)
-
-	return W5100_OK;
-}
-
 /*
  *  Define the SPI port, used to exchange data with a W5100 chip.
  */
@@ -192,65 +66,17 @@ unsigned char Send(unsigned char sock, const unsigned char *buf,
 #define RESET_PORT      PORTD	/* target-specific port used for reset */
 #define RESET_BIT       3	/* target-specific port line used as reset */
 
+#define INT_DDR         DDRD	/* target-specific DDR for the W5100 INT line */
+#define INT_PORT        PORTD	/* target-specific port for the W5100 INT line */
+#define INT_PIN         PIND	/* target-specific input register for the W5100 INT line */
+#define INT_BIT         2	/* INT0; Arduino digital pin 2 */
+
 /*
  *  Define macros for selecting and deselecting the W5100 device.
  */
 #define W51_ENABLE      CS_PORT&=~(1<<CS_BIT)
 #define W51_DISABLE     CS_PORT|=(1<<CS_BIT)
 
-unsigned int Receive(unsigned char sock, unsigned char *buf,
-		     unsigned int buflen)
-{
-	unsigned int ptr;
-	unsigned int offaddr;
-	unsigned int realaddr;
-	unsigned int sockaddr;
-
-	if (buflen == 0 || sock >= W5100_NUM_SOCKETS)
-		return W5100_FAIL;	// ignore illegal conditions
-
-	if (buflen > (MAX_BUF - 2))
-		buflen = MAX_BUF - 2;	// requests that exceed the max are truncated
-
-	sockaddr = W5100_SKT_BASE(sock);	// calc base addr for this socket
-	ptr = W51_read(sockaddr + W5100_RX_RD_OFFSET);	// get the RX read pointer (MSB)
-	offaddr = (((ptr & 0x00FF) << 8) + W51_read(sockaddr + W5100_RX_RD_OFFSET + 1));	// get LSB and calc offset addr
-
-	while (buflen) {
-		buflen--;
-		realaddr =
-		    (W5100_RXBUFADDR + (0x0800 * sock)) +
-		    (offaddr & W5100_RX_BUF_MASK);
-		*buf = W51_read(realaddr);
-		offaddr++;
-		buf++;
-	}
-	*buf = '\0';		// buffer read is complete, terminate the str
-
-	// Increase the S0_RX_RD value, so it point to the next receive
-	W51_write(sockaddr + W5100_RX_RD_OFFSET, (offaddr & 0xFF00) >> 8);	// update RX read offset (MSB)
-	W51_write(sockaddr + W5100_RX_RD_OFFSET + 1, (offaddr & 0x00FF));	// update LSB
-
-	// Now Send the RECV command
-	W51_write(sockaddr + W5100_CR_OFFSET, W5100_SKT_CR_RECV);	// issue the receive command
-	_delay_us(5);		// wait for receive to start
-
-	return W5100_OK;
-}
-
-unsigned int ReceivedSize(unsigned char sock)
-{
-	unsigned int val;
-	unsigned int sockaddr;
-
-	if (sock >= W5100_NUM_SOCKETS)
-		return 0;
-	sockaddr = W5100_SKT_BASE(sock);	// calc base addr for this socket
-	val = W51_read(sockaddr + W5100_RX_RSR_OFFSET) & 0xff;
-	val = (val << 8) + W51_read(sockaddr + W5100_RX_RSR_OFFSET + 1);
-	return val;
-}
-
 /*
  *  Simple wrapper function for selecting the W5100 device.  This function
  *  allows the library code to invoke a target-specific function for enabling
@@ -289,27 +115,112 @@ void my_reset(void)
 	RESET_PORT |= (1 << RESET_BIT);	// pull reset line high
 	RESET_DDR |= (1 << RESET_BIT);	// now make it an output
 	RESET_PORT &= ~(1 << RESET_BIT);	// pull the line low
-	_delay_ms(5);		// let the device reset
+	clock_wait_ms(5);	// let the device reset
 	RESET_PORT |= (1 << RESET_BIT);	// done with reset, pull the line high
-	_delay_ms(10);		// let the chip wake up
+	clock_wait_ms(10);	// let the chip wake up
 }
 
+#ifdef W5100_USE_IRQ
+static volatile unsigned char w51_irq;	// set by the INT0 handler
+
+/*
+ *  INT0 fires on the falling edge of the W5100 INT line.  The handler only
+ *  flags the event; the main loop does the SPI work.
+ */
+ISR(INT0_vect)
+{
+	w51_irq = 1;
+}
+#endif
+
 // Assign I/O stream to UART
 static FILE uart_stdout = FDEV_SETUP_STREAM(uart_putchar, NULL, _FDEV_SETUP_WRITE);
 
-int main(void)
+/*
+ *  Scheduler tasks (scheduler.h).  Each returns nonzero if it found work, so
+ *  the main loop only sleeps when none did.
+ */
+
+/*
+ *  serve      run the web server
+ */
+static unsigned char serve(void)
 {
-	unsigned int sockaddr;
-	unsigned char mysocket;
-	unsigned int rsize;
+#ifdef W5100_USE_IRQ
+	unsigned char busy;
 
-	/* Initialize the UART for ATmega168 96008N1    */
+	busy = 0;
+	if (w51_irq || !(INT_PIN & (1 << INT_BIT)))	// new edge, or INT still held low
+	{
+		w51_irq = 0;
+		httpd_interrupt();	// only sockets with events cost SPI traffic
+		busy = 1;
+	}
+	httpd_expire();
+	return busy;
+#else
+	return httpd_poll();
+#endif
+}
+
+#ifdef W5100_USE_STATS
+/*
+ *  keyboard      any key dumps the counters
+ */
+static unsigned char keyboard(void)
+{
+	if (!uart_kbhit())
+		return 0;
+	uart_getchar(stdout);
+	uart_tx_policy(UART_TX_BLOCK);	// asked for, so print all of it
+	stats_print();
+	uart_tx_policy(UART_TX_DROP);
+	return 1;
+}
+#endif
+
+#ifdef W5100_USE_TRACE
+/*
+ *  trace_out      as many trace frames as the UART ring has room for
+ */
+static unsigned char trace_out(void)
+{
+	return trace_flush(uart_write);
+}
+#endif
+
+#if UPSTREAM_SOCKETS > 0
+/*
+ *  upstream      keep the collector connections up
+ */
+static unsigned char upstream(void)
+{
+	upstream_poll();
+	return 0;
+}
+
+/*
+ *  report      push a report to the collector
+ */
+static unsigned char report(void)
+{
+	static char text[24];
+
+	upstream_send((unsigned char *)text,
+		      sprintf(text, "uptime %u\r\n", clock_ms()));	// dropped if no connection is up
+	return 0;
+}
+#endif
+
+int main(void)
+{
+	/* Initialize the UART for ATmega168, UART_BAUD 8N1    */
 	uart_init();
 
 	stdout = &uart_stdout;	//Required for printf init
 
-	mysocket = 0;		// magic number! declare the socket number we will us
-	sockaddr = W5100_SKT_BASE(mysocket);	// calc address of W5100 register set for this socket
+	clock_init();		// millisecond clock; the W5100 reset and the socket deadlines run on it
+	sei();			// clock_ms() and the UART run from here on
 
 	puts("AVR Ethernet\r\n");
 /*
@@ -343,53 +254,39 @@ int main(void)
 	puts("Debug: AVR Ethernet after W5100 config\r\n");
 
 /*
- *  The main loop.  Control stays in this loop forever, processing any received packets
- *  and sending any requested data.
+ *  The main loop.  Control stays in this loop forever, running the scheduler
+ *  tasks: processing any received packets and sending any requested data.
  */
+#ifdef W5100_USE_TRACE
+	trace_init();		// before the sockets open, so their first commands are recorded
+#endif
+	httpd_init();		// open the server sockets
+	sched_add(serve, 0);
+#if UPSTREAM_SOCKETS > 0
+	upstream_init(collector_ip, COLLECTOR_PORT);	// and start connecting to the collector
+	sched_add(upstream, UPSTREAM_POLL_MS);
+	sched_add(report, REPORT_MS);
+#endif
+#ifdef W5100_USE_STATS
+	sched_add(keyboard, 0);
+#endif
+#ifdef W5100_USE_TRACE
+	sched_add(trace_out, 0);
+#endif
+
+#ifdef W5100_USE_IRQ
+	INT_DDR &= ~(1 << INT_BIT);	// INT line is an input...
+	INT_PORT |= (1 << INT_BIT);	// ...with pull-up
+	EICRA = (1 << ISC01);	// INT0 on falling edge
+	EIFR = (1 << INTF0);	// drop any edge seen before now
+	EIMSK = (1 << INT0);	// enable INT0
+#endif
+	uart_tx_policy(UART_TX_DROP);	// from here on a full UART ring must not stall the server
+	set_sleep_mode(SLEEP_MODE_IDLE);	// timers, UART and INT0 keep running
+
 	while (1) {
-		switch (W51_read(sockaddr + W5100_SR_OFFSET))	// based on current status of socket...
-		{
-		case W5100_SKT_SR_CLOSED:	// if socket is closed...
-			if (OpenSocket(mysocket, W5100_SKT_MR_TCP, HTTP_PORT) == mysocket)	// if successful opening a socket...
-			{
-				Listen(mysocket);
-				_delay_ms(1);
-			}
-			break;
-
-		case W5100_SKT_SR_ESTABLISHED:	// if socket connection is established...
-			rsize = ReceivedSize(mysocket);	// find out how many bytes
-			if (rsize > 0) {
-				if (Receive(mysocket, buf, rsize) != W5100_OK)
-					break;	// if we had problems, all done
-/*
- *  Add code here to process the payload from the packet.
- *
- *  For now, we just ignore the payload and send a canned HTML page so the client at least
- *  knows we are alive.
- */
-				strcpy_P((char *)buf,PSTR("HTTP/1.0 200 OK\r\nContent-Type: text/html\r\nPragma: no-cache\r\n\r\n"));
-				strcat_P((char *)buf,PSTR("<html>\r\n<body>\r\n"));
-				strcat_P((char *)buf,PSTR("<title>Title</title>\r\n"));
-				strcat_P((char *)buf,PSTR("<p>Hello world</p>\r\n"));
-				strcat_P((char *)buf,PSTR("</body>\r\n</html>\r\n"));
-				if (Send(mysocket, buf, strlen((char *)buf)) == W5100_FAIL) break;	// just throw out the packet for now
-
-				DisconnectSocket(mysocket);
-			} else	// no data yet...
-			{
-				_delay_us(10);
-			}
-			break;
-
-		case W5100_SKT_SR_FIN_WAIT:
-		case W5100_SKT_SR_CLOSING:
-		case W5100_SKT_SR_TIME_WAIT:
-		case W5100_SKT_SR_CLOSE_WAIT:
-		case W5100_SKT_SR_LAST_ACK:
-			CloseSocket(mysocket);
-			break;
-		}
+		if (!sched_run())
+			sleep_mode();	// nothing to do: sleep until the next interrupt, 1 ms at most
 	}
 
 	return 0;
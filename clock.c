@@ -0,0 +1,83 @@
+/*      clock.c      millisecond clock on Timer0
+ *
+ *      Timer0 runs in CTC mode with a /64 prescaler and interrupts once a
+ *      millisecond.  The counter is 16 bits, so it wraps every 65.5 s.
+ *      Interrupts must be enabled (sei) for the clock to run.
+ *
+ *      With W5100_STATS_CYCLES, Timer1 also runs free at clk/8 as the cycle
+ *      counter behind clock_cycles().
+*/
+
+#include <avr/io.h>
+#include <avr/interrupt.h>
+#include "clock.h"
+
+static volatile unsigned int ms;
+
+ISR(TIMER0_COMPA_vect)
+{
+	ms++;
+}
+
+void clock_init(void)
+{
+	TCCR0A = (1 << WGM01);	// CTC, top is OCR0A
+	TCCR0B = (1 << CS01) | (1 << CS00);	// clk/64
+	OCR0A = CLOCK_TICKS_PER_MS - 1;
+	TIMSK0 = (1 << OCIE0A);
+#ifdef W5100_STATS_CYCLES
+	TCCR1A = 0;		// normal mode, counts 0..0xffff
+	TCCR1B = (1 << CS11);	// clk/8
+#endif
+}
+
+unsigned int clock_ms(void)
+{
+	unsigned int t;
+	unsigned char sreg;
+
+	sreg = SREG;
+	cli();			// the ISR may change ms between the two byte reads
+	t = ms;
+	SREG = sreg;
+	return t;
+}
+
+unsigned int clock_ms_tick(unsigned char *tick)
+{
+	unsigned int t;
+	unsigned char sreg;
+
+	sreg = SREG;
+	cli();
+	t = ms;
+	*tick = TCNT0;
+	if ((TIFR0 & (1 << OCF0A)) && *tick < CLOCK_TICKS_PER_MS / 2)
+		t++;		// Timer0 wrapped but the ISR has not counted it yet
+	SREG = sreg;
+	return t;
+}
+
+unsigned int clock_us(void)
+{
+	unsigned int t;
+	unsigned char tick;
+
+	t = clock_ms_tick(&tick);
+	return t * 1000 + (unsigned int)tick * (1000 / CLOCK_TICKS_PER_MS);
+}
+
+void clock_wait_ms(unsigned int ms)
+{
+	unsigned int t;
+
+	t = clock_ms();
+	while ((unsigned int)(clock_ms() - t) <= ms) ;	// the first tick may come at once
+}
+
+#ifdef W5100_STATS_CYCLES
+unsigned int clock_cycles(void)
+{
+	return TCNT1;		// the 16-bit read goes through TEMP, no ISR touches Timer1
+}
+#endif
@@ -0,0 +1,42 @@
+#ifndef CLOCK_H
+#define CLOCK_H
+
+/*
+ *  Millisecond clock.  clock_ms() wraps around, so compare times only by
+ *  subtracting them: (unsigned int)(clock_ms() - then) >= timeout.
+ */
+
+void clock_init(void);
+unsigned int clock_ms(void);
+
+/*
+ *  clock_ms() and how far into that millisecond the clock is, in
+ *  CLOCK_TICKS_PER_MS ticks (Timer0 at clk/64: 4 us at 16 MHz), read
+ *  together.  For time stamps finer than a millisecond.
+ */
+#define CLOCK_TICKS_PER_MS	(F_CPU / 64 / 1000)	/* 250 at 16 MHz */
+
+unsigned int clock_ms_tick(unsigned char  *tick);
+
+/*
+ *  Microsecond clock built from the same timer, to the tick (4 us at
+ *  16 MHz).  It wraps every 65.5 ms; only for timing short intervals.
+ */
+unsigned int clock_us(void);
+
+/*
+ *  Wait at least ms milliseconds by the clock.  Only for start-up, before
+ *  there is anything else to do; the main loop uses deadlines (scheduler.h).
+ */
+void clock_wait_ms(unsigned int  ms);
+
+/*
+ *  Cycle counter for timing short stretches of code, only in builds with
+ *  W5100_STATS_CYCLES (Timer1, free running at clk/8).  It counts in
+ *  CLOCK_CYCLES_PER_TICK CPU cycles and wraps every 32.8 ms at 16 MHz.
+ */
+#define CLOCK_CYCLES_PER_TICK	8
+
+unsigned int clock_cycles(void);
+
+#endif
@@ -0,0 +1,30 @@
+/*
+ *  avr/pgmspace.h      host stand-in for the avr-libc flash access routines
+ *
+ *  The host has a single address space, so flash data is ordinary const
+ *  data and the _P routines are their RAM counterparts.
+ */
+#ifndef  AVR_PGMSPACE_H
+#define  AVR_PGMSPACE_H
+
+#include <stdint.h>
+#include <string.h>
+
+#define  PROGMEM
+#define  PGM_P                          const char *
+#define  PSTR(s)                        (s)
+
+#define  pgm_read_byte(addr)            (*(const unsigned char *)(addr))
+/* an unsigned int is 16 bits on the AVR but not here, so read the object itself */
+#define  pgm_read_word(addr)            ((unsigned short)*(addr))
+#define  pgm_read_dword(addr)           (*(const uint32_t *)(addr))
+#define  pgm_read_ptr(addr)             (*(void * const *)(addr))
+
+#define  memcpy_P                       memcpy
+#define  strcpy_P                       strcpy
+#define  strcat_P                       strcat
+#define  strcmp_P                       strcmp
+#define  strlen_P                       strlen
+#define  snprintf_P                     snprintf
+
+#endif
@@ -0,0 +1,905 @@
+/*      hostcheck.c      functional checks of the firmware against the W5100 emulator
+ *
+ *      usage: hostcheck [-b port_base] [check ...]
+ *
+ *      Runs the W5100 library, socket layer and web server in-process
+ *      against the emulator, as avrethernet-host does, and plays the peer
+ *      from the same loop through ordinary host sockets on the loopback
+ *      interface.  W5100 port N is 127.0.0.1:(port_base + N), 18000 by
+ *      default so a running avrethernet-host is not in the way.  With no
+ *      names every check runs.  Prints one line per check and exits
+ *      nonzero if any failed; a check that cannot run here is reported
+ *      as skipped.
+ *
+ *      halfclose       clients that send GETs and then shut down their
+ *                      write side get every response, polled and
+ *                      interrupt-driven
+ *      relisten        interrupt-driven, server sockets that were left
+ *                      closed without an interrupt listen again within
+ *                      HTTPD_RELISTEN_MS
+ *      stall           a client that stops halfway through a request
+ *                      and one that stops reading its responses are
+ *                      both dropped after HTTPD_IDLE_MS
+ *      paths           every asset path is served and nothing else is:
+ *                      not its prefixes, extensions, or paths that share
+ *                      its hash and length
+ *      etag            a 304 for any entity tag in an If-None-Match list,
+ *                      weak or strong, over several header lines, for the
+ *                      plain and the gzip copy
+ *      udp             SendTo echoes what ReceiveFrom got back to the
+ *                      sender, up to UDP_MAX bytes; a short ReceiveFrom
+ *                      drops only the rest of its own datagram
+ *      multicast       a member of the group opened by OpenMulticast gets
+ *                      what the firmware Publishes, the firmware gets what
+ *                      is sent to the group, and not its own Publish
+ *      macraw          socket 0 in MACRAW mode echoes raw frames up to
+ *                      MACRAW_MAX bytes, and its MAC filter drops frames
+ *                      for other stations; skipped without CAP_NET_RAW
+*/
+
+#define _GNU_SOURCE
+
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <unistd.h>
+#include <poll.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <sys/socket.h>
+#include <net/if.h>
+#include <net/ethernet.h>
+#include <linux/if_packet.h>
+#include "w5100.h"
+#include "socket.h"
+#include "httpd.h"
+#include "w5100emu.h"
+
+#define CHECK_MS	2000	/* longest a check waits for the peer or the firmware */
+#define CHECK_SOCKET	1	/* firmware socket for the UDP checks */
+#define UDP_PORT	7	/* W5100 port of the UDP echo */
+#define GROUP_PORT	5000	/* W5100 port of the multicast group */
+#define CHECK_TYPE	0x88B5	/* EtherType of the MACRAW check frames (local experimental) */
+
+#define SKIPPED		1	/* check result: could not run here, see why */
+
+W5100_CFG my_cfg = {
+	{0xDE, 0xAD, 0xBE, 0xEF, 0xFE, 0xED},	// MAC address
+	{192, 168, 1, 177},			// IP address
+	{255, 255, 255, 0},			// Subnet mask
+	{192, 168, 1, 1},			// Gateway
+	{2, 2, 2, 2},				// RX buffer Kbytes per socket
+	{2, 2, 2, 2}				// TX buffer Kbytes per socket
+};
+
+W5100_CALLBACKS my_callbacks;
+
+static unsigned int base = 18000;
+static char why[160];	/* reason the running check failed */
+
+static double now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/*
+ *  Record why the running check failed; returns -1 for the check to return.
+ */
+static int fail(const char *fmt, ...)
+{
+	va_list ap;
+
+	va_start(ap, fmt);
+	vsnprintf(why, sizeof(why), fmt, ap);
+	va_end(ap);
+	return -1;
+}
+
+/*
+ *  Record why the running check could not run; returns SKIPPED.
+ */
+static int skip(const char *fmt, ...)
+{
+	va_list ap;
+
+	va_start(ap, fmt);
+	vsnprintf(why, sizeof(why), fmt, ap);
+	va_end(ap);
+	return SKIPPED;
+}
+
+/*
+ *  Close every socket on the chip, so each check starts from scratch.
+ */
+static void close_all(void)
+{
+	unsigned char sock;
+
+	for (sock = 0; sock < W5100_NUM_SOCKETS; sock++)
+		CloseSocket(sock);
+	for (sock = 0; sock < W5100_NUM_SOCKETS; sock++)
+		CommandWait(sock);
+}
+
+/*
+ *  One pass of the web server, polled or from the emulated INT line.
+ */
+static void serve(int irq)
+{
+	if (!irq) {
+		httpd_poll();
+		return;
+	}
+	if (w5100emu_int_asserted())
+		httpd_interrupt();
+	else
+		w5100emu_wait(1);
+	httpd_expire();
+}
+
+/*
+ *  Check that buf holds exactly n complete 200 responses, each framed by
+ *  its Content-Length.
+ */
+static int check_responses(char *buf, size_t len, int n)
+{
+	char *p;
+	char *eoh;
+	char *cl;
+	long body;
+	int got;
+
+	buf[len] = '\0';
+	p = buf;
+	for (got = 0; p < buf + len; got++) {
+		if (strncmp(p, "HTTP/1.1 200 ", 13) != 0)
+			return fail("response %d is not a 200", got + 1);
+		eoh = strstr(p, "\r\n\r\n");
+		if (eoh == NULL)
+			return fail("response %d has no end of headers", got + 1);
+		*eoh = '\0';
+		cl = strcasestr(p, "\r\nContent-Length:");
+		body = cl ? atol(cl + 17) : -1;
+		*eoh = '\r';
+		if (body < 0)
+			return fail("response %d has no Content-Length", got + 1);
+		p = eoh + 4 + body;
+	}
+	if (p != buf + len)
+		return fail("last response cut short (%u bytes)", (unsigned int)len);
+	if (got != n)
+		return fail("%d responses for %d requests", got, n);
+	return 0;
+}
+
+/*
+ *  Send req on a new connection, shut down the write side and read into
+ *  buf until the server closes.  Returns the length read, or -1.
+ */
+static int exchange(const char *req, char *buf, size_t size, int irq)
+{
+	struct sockaddr_in sa;
+	size_t have;
+	ssize_t r;
+	double start;
+	int fd;
+
+	fd = socket(AF_INET, SOCK_STREAM, 0);
+	memset(&sa, 0, sizeof(sa));
+	sa.sin_family = AF_INET;
+	sa.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+	sa.sin_port = htons(base + HTTP_PORT);
+	if (fd < 0 || connect(fd, (struct sockaddr *)&sa, sizeof(sa)) < 0)
+		return fail("connect: %s", strerror(errno));
+	send(fd, req, strlen(req), 0);
+	shutdown(fd, SHUT_WR);
+
+	have = 0;
+	start = now();
+	for (;;) {
+		serve(irq);
+		r = recv(fd, buf + have, size - 1 - have, MSG_DONTWAIT);
+		if (r == 0)
+			break;	// server closed
+		if (r > 0)
+			have += r;
+		else if (errno != EAGAIN)
+			break;
+		if (now() - start > CHECK_MS / 1000.0) {
+			close(fd);
+			return fail("no close after %u bytes", (unsigned int)have);
+		}
+	}
+	close(fd);
+	buf[have] = '\0';
+	return have;
+}
+
+/*
+ *  Send n pipelined GETs for / on a new connection, shut down the write
+ *  side and read until the server closes.
+ */
+static int halfclose(int n, int irq)
+{
+	static char req[31 * 5 + 1];
+	static char buf[16384];
+	int len;
+	int i;
+
+	req[0] = '\0';
+	for (i = 0; i < n; i++)
+		strcat(req, "GET / HTTP/1.1\r\nHost: check\r\n\r\n");
+	len = exchange(req, buf, sizeof(buf), irq);
+	if (len < 0)
+		return -1;
+	return check_responses(buf, len, n);
+}
+
+static int check_halfclose(void)
+{
+	int irq;
+
+	httpd_init();
+	for (irq = 0; irq <= 1; irq++) {
+		if (halfclose(1, irq) < 0 || halfclose(5, irq) < 0) {
+			strcat(why, irq ? " (interrupt)" : " (polled)");
+			return -1;
+		}
+	}
+	return 0;
+}
+
+static int check_relisten(void)
+{
+	unsigned char sock;
+	double start;
+
+	httpd_init();
+	for (sock = 0; sock < HTTPD_NUM_SOCKETS; sock++)
+		CloseSocket(sock);	// as if LISTEN had failed; a CLOSE raises no interrupt
+	start = now();
+	while (now() - start < (HTTPD_RELISTEN_MS + 200) / 1000.0)
+		serve(1);
+	if (halfclose(1, 1) < 0) {
+		strcat(why, " after the listeners were closed");
+		return -1;
+	}
+	return 0;
+}
+
+/*
+ *  A new connection to the web server, with a receive buffer of rcvbuf
+ *  bytes if that is not 0.
+ */
+static int http_connect(int rcvbuf)
+{
+	struct sockaddr_in sa;
+	int fd;
+
+	fd = socket(AF_INET, SOCK_STREAM, 0);
+	if (fd >= 0 && rcvbuf)
+		setsockopt(fd, SOL_SOCKET, SO_RCVBUF, &rcvbuf, sizeof(rcvbuf));
+	memset(&sa, 0, sizeof(sa));
+	sa.sin_family = AF_INET;
+	sa.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+	sa.sin_port = htons(base + HTTP_PORT);
+	if (fd < 0 || connect(fd, (struct sockaddr *)&sa, sizeof(sa)) < 0)
+		return fail("connect: %s", strerror(errno));
+	return fd;
+}
+
+/*
+ *  Number of server sockets not listening.
+ */
+static int busy_sockets(void)
+{
+	unsigned char sock;
+	int n;
+
+	n = 0;
+	for (sock = 0; sock < HTTPD_NUM_SOCKETS; sock++)
+		if (W51_read(W5100_SKT_BASE(sock) + W5100_SR_OFFSET) != W5100_SKT_SR_LISTEN)
+			n++;
+	return n;
+}
+
+static int check_stall(void)
+{
+	static const char get[] = "GET / HTTP/1.1\r\nHost: check\r\n\r\n";
+	double start;
+	int half, deaf;
+	int i;
+
+	httpd_init();
+	half = http_connect(0);	// stops halfway through the request line
+	if (half < 0)
+		return -1;
+	send(half, get, 8, 0);
+	deaf = http_connect(1024);	// never reads its responses
+	if (deaf < 0) {
+		close(half);
+		return -1;
+	}
+	for (i = 0; i < HTTPD_MAX_REQUESTS - 1; i++)
+		send(deaf, get, sizeof(get) - 1, 0);
+
+	start = now();
+	while (now() - start < HTTPD_IDLE_MS / 2000.0)
+		serve(0);
+	if (busy_sockets() != 2) {
+		fail("%d sockets busy halfway to HTTPD_IDLE_MS, not 2", busy_sockets());
+		goto bad;
+	}
+	while (now() - start < (HTTPD_IDLE_MS + 500) / 1000.0)
+		serve(0);
+	if (busy_sockets() != 0) {
+		fail("%d sockets still busy after HTTPD_IDLE_MS", busy_sockets());
+		goto bad;
+	}
+	close(half);
+	close(deaf);
+	return halfclose(1, 0);
+
+bad:
+	close(half);
+	close(deaf);
+	return -1;
+}
+
+/*
+ *  GET path with the extra header lines hdrs and return the status code,
+ *  copying the ETag value (quotes included) to etag if etag is not NULL.
+ */
+static int get_status(const char *path, const char *hdrs, char *etag)
+{
+	static char req[512];
+	static char buf[16384];
+	char *p;
+	int len;
+
+	snprintf(req, sizeof(req), "GET %s HTTP/1.1\r\nHost: check\r\n%s\r\n", path, hdrs);
+	len = exchange(req, buf, sizeof(buf), 0);
+	if (len < 0)
+		return -1;
+	if (len < 13 || strncmp(buf, "HTTP/1.1 ", 9) != 0)
+		return fail("no status line for %s", path);
+	if (etag) {
+		p = strcasestr(buf, "\r\nETag: ");
+		if (p == NULL)
+			return fail("no ETag for %s", path);
+		sscanf(p + 8, "%63s", etag);
+	}
+	return atoi(buf + 9);
+}
+
+/*
+ *  Expect status for GET / with If-None-Match: inm (and the extra header
+ *  lines hdrs).
+ */
+static int expect_inm(const char *hdrs, const char *inm, int status)
+{
+	char line[256];
+	int got;
+
+	snprintf(line, sizeof(line), "%sIf-None-Match: %s\r\n", hdrs, inm);
+	got = get_status("/", line, NULL);
+	if (got < 0)
+		return -1;
+	if (got != status)
+		return fail("%d, not %d, for If-None-Match: %s", got, status, inm);
+	return 0;
+}
+
+static int check_etag(void)
+{
+	static const char *encodings[] = { "", "Accept-Encoding: gzip\r\n" };
+	char etag[64];
+	char inm[256];
+	unsigned int i;
+
+	httpd_init();
+	for (i = 0; i < 2; i++) {
+		if (get_status("/", encodings[i], etag) != 200)
+			return *why ? -1 : fail("GET / is not a 200");
+		if (expect_inm(encodings[i], etag, 304) < 0
+		    || expect_inm(encodings[i], "\"x\"", 200) < 0
+		    || expect_inm(encodings[i], "*", 304) < 0)
+			return -1;
+		snprintf(inm, sizeof(inm), "\"x\", %s", etag);
+		if (expect_inm(encodings[i], inm, 304) < 0)
+			return -1;
+		snprintf(inm, sizeof(inm), "\"a,b\",W/\"y\" , W/%s", etag);
+		if (expect_inm(encodings[i], inm, 304) < 0)
+			return -1;
+		snprintf(inm, sizeof(inm), "\"x\"\r\nIf-None-Match: %s", etag);
+		if (expect_inm(encodings[i], inm, 304) < 0)
+			return -1;
+	}
+	return 0;
+}
+
+/*
+ *  Wait until fd is readable, moving the emulator along meanwhile.
+ */
+static int wait_readable(int fd)
+{
+	struct pollfd pfd;
+	double start;
+
+	pfd.fd = fd;
+	pfd.events = POLLIN;
+	start = now();
+	while (poll(&pfd, 1, 1) == 0) {
+		w5100emu_poll();
+		if (now() - start > CHECK_MS / 1000.0)
+			return fail("peer got nothing");
+	}
+	return 0;
+}
+
+/*
+ *  A host UDP socket bound to 127.0.0.1, any port.
+ */
+static int udp_peer(void)
+{
+	struct sockaddr_in sa;
+	int fd;
+
+	fd = socket(AF_INET, SOCK_DGRAM, 0);
+	memset(&sa, 0, sizeof(sa));
+	sa.sin_family = AF_INET;
+	sa.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+	if (fd < 0 || bind(fd, (struct sockaddr *)&sa, sizeof(sa)) < 0)
+		return fail("udp socket: %s", strerror(errno));
+	return fd;
+}
+
+/*
+ *  Fill buf with len bytes that differ from one datagram to the next.
+ */
+static void pattern(unsigned char *buf, unsigned int len, unsigned int seed)
+{
+	unsigned int i;
+
+	for (i = 0; i < len; i++)
+		buf[i] = (unsigned char)(seed * 31 + i * 7);
+}
+
+/*
+ *  Firmware side: ReceiveFrom on sock into buf (at most buflen bytes)
+ *  until a datagram comes in.  Returns its length, or -1.
+ */
+static int fw_receive(unsigned char sock, unsigned char *buf, unsigned int buflen,
+		      unsigned char *addr, unsigned int *port)
+{
+	double start;
+	unsigned int n;
+
+	start = now();
+	while ((n = ReceiveFrom(sock, buf, buflen, addr, port)) == 0) {
+		if (now() - start > CHECK_MS / 1000.0)
+			return fail("firmware got nothing");
+		w5100emu_wait(1);
+	}
+	return n;
+}
+
+/*
+ *  Firmware side: SendTo, retried while the previous datagram is still
+ *  going out.
+ */
+static int fw_send_to(unsigned char sock, const unsigned char *buf, unsigned int len,
+		      const unsigned char *addr, unsigned int port)
+{
+	double start;
+
+	start = now();
+	while (SendTo(sock, buf, len, addr, port) != len) {
+		if (now() - start > CHECK_MS / 1000.0)
+			return fail("SendTo of %u bytes not taken", len);
+		w5100emu_wait(1);
+	}
+	return 0;
+}
+
+static int check_udp(void)
+{
+	static const unsigned int sizes[] = { 1, 100, 1000, UDP_MAX };
+	static unsigned char out[UDP_MAX], fw[UDP_MAX], in[UDP_MAX + 1];
+	struct sockaddr_in sa, from;
+	socklen_t fromlen;
+	unsigned char addr[4];
+	unsigned int port;
+	unsigned int i;
+	int fd;
+	int n;
+
+	if (OpenSocket(CHECK_SOCKET, W5100_SKT_MR_UDP, UDP_PORT) != CHECK_SOCKET)
+		return fail("OpenSocket in UDP mode failed");
+	fd = udp_peer();
+	if (fd < 0)
+		return -1;
+	memset(&sa, 0, sizeof(sa));
+	sa.sin_family = AF_INET;
+	sa.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+	sa.sin_port = htons(base + UDP_PORT);
+
+	for (i = 0; i < sizeof(sizes) / sizeof(sizes[0]); i++) {
+		pattern(out, sizes[i], i);
+		sendto(fd, out, sizes[i], 0, (struct sockaddr *)&sa, sizeof(sa));
+		n = fw_receive(CHECK_SOCKET, fw, sizeof(fw), addr, &port);
+		if (n < 0)
+			goto bad;
+		if ((unsigned int)n != sizes[i] || memcmp(fw, out, n) != 0) {
+			fail("firmware got %d bytes of a %u-byte datagram", n, sizes[i]);
+			goto bad;
+		}
+		if (memcmp(addr, "\x7f\0\0\x01", 4) != 0) {
+			fail("sender %u.%u.%u.%u, not 127.0.0.1", addr[0], addr[1], addr[2], addr[3]);
+			goto bad;
+		}
+		if (fw_send_to(CHECK_SOCKET, fw, n, addr, port) < 0 || wait_readable(fd) < 0)
+			goto bad;
+		fromlen = sizeof(from);
+		n = recvfrom(fd, in, sizeof(in), 0, (struct sockaddr *)&from, &fromlen);
+		if (n != (int)sizes[i] || memcmp(in, out, n) != 0) {
+			fail("echo of a %u-byte datagram came back as %d bytes", sizes[i], n);
+			goto bad;
+		}
+		if (ntohs(from.sin_port) != base + UDP_PORT) {
+			fail("echo came from port %u", ntohs(from.sin_port));
+			goto bad;
+		}
+	}
+
+	// a short read drops the rest of its datagram, not the next one
+	pattern(out, 300, 9);
+	sendto(fd, out, 300, 0, (struct sockaddr *)&sa, sizeof(sa));
+	sendto(fd, out, 20, 0, (struct sockaddr *)&sa, sizeof(sa));
+	if (fw_receive(CHECK_SOCKET, fw, 100, addr, &port) != 100
+	    || fw_receive(CHECK_SOCKET, fw, sizeof(fw), addr, &port) != 20
+	    || memcmp(fw, out, 20) != 0) {
+		if (!*why)
+			fail("short ReceiveFrom lost the next datagram");
+		goto bad;
+	}
+	close(fd);
+	return 0;
+
+bad:
+	close(fd);
+	return -1;
+}
+
+/*
+ *  Firmware side: Publish, retried while the previous datagram is still
+ *  going out.
+ */
+static int fw_publish(unsigned char sock, const unsigned char *buf, unsigned int len)
+{
+	double start;
+
+	start = now();
+	while (Publish(sock, buf, len) != len) {
+		if (now() - start > CHECK_MS / 1000.0)
+			return fail("Publish of %u bytes not taken", len);
+		w5100emu_wait(1);
+	}
+	return 0;
+}
+
+static int check_multicast(void)
+{
+	static const unsigned char group[4] = { 239, 1, 2, 3 };
+	static unsigned char out[512], fw[512], in[513];
+	struct sockaddr_in sa, from;
+	struct ip_mreq mreq;
+	struct in_addr lo;
+	socklen_t fromlen;
+	unsigned char addr[4];
+	unsigned int port;
+	unsigned int i;
+	double start;
+	int member, sender;
+	int one;
+	int n;
+
+	if (OpenMulticast(CHECK_SOCKET, group, GROUP_PORT) != CHECK_SOCKET)
+		return fail("OpenMulticast failed");
+
+	// a member of the group on this host, and a sender that is not one
+	lo.s_addr = htonl(INADDR_LOOPBACK);
+	memset(&sa, 0, sizeof(sa));
+	sa.sin_family = AF_INET;
+	sa.sin_addr.s_addr = htonl(INADDR_ANY);
+	sa.sin_port = htons(base + GROUP_PORT);
+	member = socket(AF_INET, SOCK_DGRAM, 0);
+	one = 1;
+	setsockopt(member, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+	memcpy(&mreq.imr_multiaddr.s_addr, group, 4);
+	mreq.imr_interface = lo;
+	if (member < 0 || bind(member, (struct sockaddr *)&sa, sizeof(sa)) < 0
+	    || setsockopt(member, IPPROTO_IP, IP_ADD_MEMBERSHIP, &mreq, sizeof(mreq)) < 0) {
+		close(member);
+		return fail("group member: %s", strerror(errno));
+	}
+	sender = udp_peer();
+	if (sender < 0) {
+		close(member);
+		return -1;
+	}
+	setsockopt(sender, IPPROTO_IP, IP_MULTICAST_IF, &lo, sizeof(lo));
+	memcpy(&sa.sin_addr.s_addr, group, 4);
+
+	for (i = 0; i < 3; i++) {
+		n = 10 + i * 200;
+		pattern(out, n, i);
+		sendto(sender, out, n, 0, (struct sockaddr *)&sa, sizeof(sa));
+		if (fw_receive(CHECK_SOCKET, fw, sizeof(fw), addr, &port) != n
+		    || memcmp(fw, out, n) != 0) {
+			if (!*why)
+				fail("firmware did not get the %d-byte group datagram", n);
+			goto bad;
+		}
+
+		fw[0] ^= 0xFF;	// not the datagram the member already has
+		if (fw_publish(CHECK_SOCKET, fw, n) < 0)
+			goto bad;
+		do {	// the member hears the sender too
+			if (wait_readable(member) < 0)
+				goto bad;
+			fromlen = sizeof(from);
+			recvfrom(member, in, sizeof(in), 0, (struct sockaddr *)&from, &fromlen);
+		} while (ntohs(from.sin_port) != base + GROUP_PORT);
+		if (memcmp(in, fw, n) != 0) {
+			fail("member got something else for the %d-byte Publish", n);
+			goto bad;
+		}
+	}
+
+	// the chip does not hear its own Publish
+	start = now();
+	while (now() - start < 0.05)
+		if (ReceiveFrom(CHECK_SOCKET, fw, sizeof(fw), addr, &port)) {
+			fail("firmware got its own Publish back");
+			goto bad;
+		}
+	close(member);
+	close(sender);
+	return 0;
+
+bad:
+	close(member);
+	close(sender);
+	return -1;
+}
+
+/*
+ *  Firmware side: ReceiveFrame until a frame of CHECK_TYPE comes in.
+ *  Returns its length, or -1.
+ */
+static int fw_receive_frame(unsigned char *buf, unsigned int buflen)
+{
+	double start;
+	unsigned int n;
+
+	start = now();
+	for (;;) {
+		n = ReceiveFrame(buf, buflen);
+		if (n >= MACRAW_HDR_LEN && buf[12] == (CHECK_TYPE >> 8) && buf[13] == (CHECK_TYPE & 0xFF))
+			return n;
+		if (now() - start > CHECK_MS / 1000.0)
+			return fail("firmware got no frame");
+		if (n == 0)
+			w5100emu_wait(1);
+	}
+}
+
+/*
+ *  Firmware side: SendFrame, retried while the previous frame is still
+ *  going out.
+ */
+static int fw_send_frame(const unsigned char *frame, unsigned int len)
+{
+	double start;
+
+	start = now();
+	while (SendFrame(frame, len) != len) {
+		if (now() - start > CHECK_MS / 1000.0)
+			return fail("SendFrame of %u bytes not taken", len);
+		w5100emu_wait(1);
+	}
+	return 0;
+}
+
+static int check_macraw(void)
+{
+	static const unsigned int sizes[] = { 60, 500, MACRAW_MAX };
+	static const unsigned char peer_mac[6] = { 0x02, 0, 0, 0, 0, 0x01 };
+	static const unsigned char other_mac[6] = { 0x02, 0, 0, 0, 0, 0x02 };
+	static unsigned char out[MACRAW_MAX], fw[MACRAW_MAX], in[MACRAW_MAX + 1];
+	struct sockaddr_ll sll;
+	unsigned int i;
+	int fd;
+	int n;
+
+	// the peer plays another station on loopback, the emulator needs the same
+	fd = socket(AF_PACKET, SOCK_RAW, htons(CHECK_TYPE));
+	if (fd < 0 && (errno == EPERM || errno == EACCES))
+		return skip("needs CAP_NET_RAW");
+	memset(&sll, 0, sizeof(sll));
+	sll.sll_family = AF_PACKET;
+	sll.sll_protocol = htons(CHECK_TYPE);
+	sll.sll_ifindex = if_nametoindex("lo");
+	if (fd < 0 || bind(fd, (struct sockaddr *)&sll, sizeof(sll)) < 0) {
+		n = errno;
+		if (fd >= 0)
+			close(fd);
+		return fail("packet socket: %s", strerror(n));
+	}
+	if (OpenMacRaw(1) != MACRAW_SOCKET) {
+		close(fd);
+		return fail("OpenMacRaw failed");
+	}
+
+	for (i = 0; i < sizeof(sizes) / sizeof(sizes[0]); i++) {
+		pattern(out, sizes[i], i);
+		out[12] = CHECK_TYPE >> 8;
+		out[13] = CHECK_TYPE & 0xFF;
+		memcpy(out + 6, peer_mac, 6);
+		memcpy(out, other_mac, 6);	// the MAC filter drops this one
+		send(fd, out, sizes[i], 0);
+		memcpy(out, my_cfg.mac_addr, 6);
+		send(fd, out, sizes[i], 0);
+		n = fw_receive_frame(fw, sizeof(fw));
+		if (n < 0)
+			goto bad;
+		if (memcmp(fw, out, 6) != 0) {
+			fail("MAC filter let a frame for another station through");
+			goto bad;
+		}
+		if ((unsigned int)n != sizes[i] || memcmp(fw, out, n) != 0) {
+			fail("firmware got %d bytes of a %u-byte frame", n, sizes[i]);
+			goto bad;
+		}
+
+		memcpy(fw, out + 6, 6);	// back to the sender
+		memcpy(fw + 6, my_cfg.mac_addr, 6);
+		if (fw_send_frame(fw, n) < 0)
+			goto bad;
+		do {	// loopback shows the peer its own frames too
+			if (wait_readable(fd) < 0)
+				goto bad;
+			n = recv(fd, in, sizeof(in), 0);
+		} while (n >= 12 && memcmp(in + 6, my_cfg.mac_addr, 6) != 0);
+		if (n != (int)sizes[i] || memcmp(in, fw, n) != 0) {
+			fail("echo of a %u-byte frame came back as %d bytes", sizes[i], n);
+			goto bad;
+		}
+	}
+	close(fd);
+	return 0;
+
+bad:
+	close(fd);
+	return -1;
+}
+
+static int check_paths(void)
+{
+	static const struct {
+		const char *path;
+		int status;
+	} paths[] = {
+		{ "/", 200 }, { "/index.html", 200 }, { "/app.js", 200 },
+		{ "/img/dot.gif", 200 }, { "/style.css", 200 }, { "/status.json", 200 },
+		{ "/app.js?v=2", 200 },
+		{ "/app(,s", 404 }, { "/img/dot.e(E", 404 },	// same hash and length as an asset
+		{ "/app", 404 }, { "/app.jsx", 404 }, { "/index.html/", 404 },
+		{ "/img", 404 }, { "/img/", 404 },
+#ifdef W5100_USE_STATS
+		{ "/stats", 200 },
+#else
+		{ "/stats", 404 },
+#endif
+		{ "/stat", 404 }, { "/stats/", 404 },
+	};
+	char path[300];
+	unsigned int i;
+	int got;
+
+	httpd_init();
+	for (i = 0; i < sizeof(paths) / sizeof(paths[0]); i++) {
+		got = get_status(paths[i].path, "", NULL);
+		if (got < 0)
+			return -1;
+		if (got != paths[i].status)
+			return fail("%d, not %d, for \"%s\"", got, paths[i].status, paths[i].path);
+	}
+	memset(path, 'x', sizeof(path) - 1);	// longer than path_len counts
+	path[0] = '/';
+	path[sizeof(path) - 1] = '\0';
+	if ((got = get_status(path, "", NULL)) != 404)
+		return got < 0 ? -1 : fail("%d, not 404, for a %u-byte path", got, (unsigned int)strlen(path));
+	return 0;
+}
+
+static const struct {
+	const char *name;
+	int (*run)(void);
+} checks[] = {
+	{ "halfclose", check_halfclose },
+	{ "relisten", check_relisten },
+	{ "stall", check_stall },
+	{ "paths", check_paths },
+	{ "etag", check_etag },
+	{ "udp", check_udp },
+	{ "multicast", check_multicast },
+	{ "macraw", check_macraw },
+};
+#define NCHECKS	(sizeof(checks) / sizeof(checks[0]))
+
+int main(int argc, char **argv)
+{
+	unsigned int i;
+	int failed;
+	int opt;
+	int j;
+
+	while ((opt = getopt(argc, argv, "b:")) != -1) {
+		switch (opt) {
+		case 'b':
+			base = atoi(optarg);
+			break;
+		default:
+			fprintf(stderr, "usage: %s [-b port_base] [check ...]\n", argv[0]);
+			return 1;
+		}
+	}
+	for (j = optind; j < argc; j++) {
+		for (i = 0; i < NCHECKS && strcmp(argv[j], checks[i].name) != 0; i++)
+			;
+		if (i == NCHECKS) {
+			fprintf(stderr, "%s: no check named %s\n", argv[0], argv[j]);
+			return 1;
+		}
+	}
+
+	w5100emu_set_port_base(base);
+	my_callbacks._select = &w5100emu_select;
+	my_callbacks._xchg = &w5100emu_xchg;
+	my_callbacks._deselect = &w5100emu_deselect;
+	my_callbacks._reset = &w5100emu_reset;
+	W51_register(&my_callbacks);
+	W51_init();
+	W51_config(&my_cfg);
+
+	failed = 0;
+	for (i = 0; i < NCHECKS; i++) {
+		for (j = optind; j < argc && strcmp(argv[j], checks[i].name) != 0; j++)
+			;
+		if (optind < argc && j == argc)
+			continue;	// not asked for
+		why[0] = '\0';
+		switch (checks[i].run()) {
+		case 0:
+			printf("%-12s ok\n", checks[i].name);
+			break;
+		case SKIPPED:
+			printf("%-12s skipped: %s\n", checks[i].name, why);
+			break;
+		default:
+			printf("%-12s FAIL: %s\n", checks[i].name, why);
+			failed++;
+			break;
+		}
+		close_all();
+	}
+	return failed ? 1 : 0;
+}
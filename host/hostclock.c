@@ -0,0 +1,60 @@
+/*      hostclock.c      clock.h for the host build
+ *
+ *      Uses the host's monotonic clock.  The emulator's own time runs
+ *      faster than the wall clock, and timeouts are about real peers on
+ *      the loopback interface, so wall-clock time is what they need.
+*/
+
+#include <time.h>
+#include "clock.h"
+
+void clock_init(void)
+{
+}
+
+unsigned int clock_ms(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+unsigned int clock_ms_tick(unsigned char *tick)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	*tick = (ts.tv_nsec % 1000000) * CLOCK_TICKS_PER_MS / 1000000;
+	return ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+unsigned int clock_us(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+void clock_wait_ms(unsigned int ms)
+{
+	struct timespec ts;
+
+	ts.tv_sec = ms / 1000;
+	ts.tv_nsec = (ms % 1000) * 1000000L;
+	nanosleep(&ts, NULL);
+}
+
+/*
+ *  Host time in units of CLOCK_CYCLES_PER_TICK cycles at F_CPU.
+ */
+unsigned int clock_cycles(void)
+{
+	struct timespec ts;
+	unsigned long long ns;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	ns = ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+	return ns * (F_CPU / CLOCK_CYCLES_PER_TICK / 1000) / 1000000;
+}
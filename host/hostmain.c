@@ -0,0 +1,249 @@
+/*      hostmain.c      runs the web server on Linux against the W5100 emulator
+ *
+ *      usage: avrethernet-host [-b port_base] [-t seconds] [-i] [-d reads] [-u port [-r ms]] [-T file]
+ *
+ *      W5100 port N is served on 127.0.0.1:(port_base + N), so with the
+ *      default base of 8000 the web server answers on port 8080.  With -t the
+ *      server stops after the given number of seconds; either way the SPI and
+ *      socket statistics are printed on exit, and in a build with STATS the
+ *      firmware's own counters (the /stats page) as well.  With -i the server runs in
+ *      interrupt mode: it sleeps until the emulated INT line is asserted
+ *      and then services only the sockets with events.  -d makes the chip
+ *      take each socket command only after that many reads of CR, to
+ *      exercise the command deadlines in socket.c.  With -u (in a build
+ *      with UPSTREAM_SOCKETS) the upstream pool connects to a collector on
+ *      127.0.0.1:port and pushes a report every -r milliseconds (default
+ *      1000); the number of reports sent and dropped is printed on exit.
+ *      With -T (in a build with TRACE) the trace frames are written to the
+ *      file, where the board would send them over the UART; host/tracedump
+ *      decodes them.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <signal.h>
+#include <time.h>
+#include <unistd.h>
+#include "w5100.h"
+#include "clock.h"
+#include "scheduler.h"
+#include "httpd.h"
+#include "upstream.h"
+#include "stats.h"
+#include "trace.h"
+#include "w5100emu.h"
+
+W5100_CFG my_cfg = {
+	{0xDE, 0xAD, 0xBE, 0xEF, 0xFE, 0xED},	// MAC address
+	{192, 168, 1, 177},			// IP address
+	{255, 255, 255, 0},			// Subnet mask
+	{192, 168, 1, 1},			// Gateway
+	{2, 2, 2, 2},				// RX buffer Kbytes per socket
+	{2, 2, 2, 2}				// TX buffer Kbytes per socket
+};
+
+W5100_CALLBACKS my_callbacks;
+
+static volatile sig_atomic_t stop;
+static int irq;
+static unsigned long loops;
+
+static void on_signal(int sig)
+{
+	stop = 1;
+}
+
+/*
+ *  Scheduler tasks (scheduler.h), as on the board.
+ */
+
+/*
+ *  Run the web server, polled or (with -i) from the emulated INT line.
+ */
+static unsigned char serve(void)
+{
+	if (!irq)
+		return httpd_poll();
+	if (w5100emu_int_asserted()) {
+		httpd_interrupt();
+		return 1;
+	}
+	w5100emu_wait(10);	// sleep until INT
+	httpd_expire();
+	loops |= 0x3ff;		// and check the time on the way out
+	return 0;
+}
+
+#if UPSTREAM_SOCKETS > 0
+static const unsigned char collector_ip[4] = {127, 0, 0, 1};
+static unsigned int report_ms = 1000;
+static unsigned long reports, dropped;
+
+static unsigned char upstream(void)
+{
+	upstream_poll();
+	return 0;
+}
+
+/*
+ *  Push a report; runs every report_ms.
+ */
+static unsigned char report(void)
+{
+	char text[32];
+
+	if (upstream_send((unsigned char *)text,
+			  sprintf(text, "report %lu\r\n", reports + dropped)))
+		reports++;
+	else
+		dropped++;	// no connection up, or its TX buffer full
+	return 0;
+}
+#endif
+
+#ifdef W5100_USE_TRACE
+static FILE *trace_file;
+
+/*
+ *  trace_flush() sink: the file takes every frame.
+ */
+static unsigned char trace_write(const unsigned char *frame, unsigned char len)
+{
+	fwrite(frame, 1, len, trace_file);
+	return 1;
+}
+
+static unsigned char trace_out(void)
+{
+	return trace_flush(trace_write);
+}
+#endif
+
+static double now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+int main(int argc, char **argv)
+{
+	unsigned int base;
+	double seconds;
+	double start;
+	int opt;
+	unsigned int collector_port;
+	const char *trace_name;
+
+	base = 8000;
+	seconds = 0;
+	irq = 0;
+	collector_port = 0;
+	trace_name = NULL;
+	while ((opt = getopt(argc, argv, "b:t:id:u:r:T:")) != -1) {
+		switch (opt) {
+		case 'b':
+			base = atoi(optarg);
+			break;
+		case 't':
+			seconds = atof(optarg);
+			break;
+		case 'i':
+			irq = 1;
+			break;
+		case 'd':
+			w5100emu_set_cmd_delay(strtoul(optarg, NULL, 0));
+			break;
+		case 'u':
+			collector_port = atoi(optarg);
+			break;
+#if UPSTREAM_SOCKETS > 0
+		case 'r':
+			report_ms = atoi(optarg);
+			break;
+#endif
+		case 'T':
+			trace_name = optarg;
+			break;
+		default:
+			fprintf(stderr, "usage: %s [-b port_base] [-t seconds] [-i] [-d reads] [-u port [-r ms]] [-T file]\n", argv[0]);
+			return 1;
+		}
+	}
+	signal(SIGINT, on_signal);
+	signal(SIGTERM, on_signal);
+
+	w5100emu_set_port_base(base);
+
+	my_callbacks._select = &w5100emu_select;
+	my_callbacks._xchg = &w5100emu_xchg;
+	my_callbacks._deselect = &w5100emu_deselect;
+	my_callbacks._reset = &w5100emu_reset;
+
+	if (trace_name) {
+#ifdef W5100_USE_TRACE
+		trace_file = fopen(trace_name, "wb");
+		if (trace_file == NULL) {
+			perror(trace_name);
+			return 1;
+		}
+		trace_init();
+#else
+		fprintf(stderr, "-T needs a build with TRACE\n");
+		return 1;
+#endif
+	}
+
+	W51_register(&my_callbacks);
+	W51_init();
+	W51_config(&my_cfg);
+	httpd_init();
+	sched_add(serve, 0);
+	if (collector_port) {
+#if UPSTREAM_SOCKETS > 0
+		upstream_init(collector_ip, collector_port);
+		sched_add(upstream, UPSTREAM_POLL_MS);
+		sched_add(report, report_ms);
+#else
+		fprintf(stderr, "-u needs a build with UPSTREAM_SOCKETS\n");
+		return 1;
+#endif
+	}
+#ifdef W5100_USE_TRACE
+	if (trace_file)
+		sched_add(trace_out, 0);
+#endif
+
+	printf("W5100 emulator: http on 127.0.0.1:%u\n", base + HTTP_PORT);
+	fflush(stdout);
+
+	w5100emu_clear_stats();
+#ifdef W5100_USE_STATS
+	W51_clear_stats();
+#endif
+	start = now();
+	loops = 0;
+	while (!stop) {
+		sched_run();
+		if (seconds > 0 && (++loops & 0x3ff) == 0 && now() - start >= seconds)
+			break;
+	}
+
+	printf("wall time:     %.3f s\n", now() - start);
+#if UPSTREAM_SOCKETS > 0
+	if (collector_port)
+		printf("reports:       %lu sent, %lu dropped\n", reports, dropped);
+#endif
+#ifdef W5100_USE_TRACE
+	if (trace_file) {
+		trace_flush(trace_write);
+		fclose(trace_file);
+	}
+#endif
+	w5100emu_print_stats(stdout);
+#ifdef W5100_USE_STATS
+	stats_print();
+#endif
+	return 0;
+}
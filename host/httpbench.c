@@ -0,0 +1,218 @@
+/*      httpbench.c      HTTP load generator for the host build
+ *
+ *      usage: httpbench [-c clients] [-t seconds] [-p port] [-k] [-H header] [path]
+ *
+ *      Starts the given number of client threads against 127.0.0.1:port.
+ *      Each client sends a GET, reads the response and repeats until the
+ *      time is up.  Without -k every request uses a new connection
+ *      (HTTP/1.0, server closes); with -k each client keeps one HTTP/1.1
+ *      connection open and reuses it, reconnecting only if the server
+ *      closes it.  -H adds a header line to every request, e.g.
+ *      -H 'If-None-Match: "39d0a133"'.  Prints completed requests,
+ *      connections and errors per second.
+*/
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <sys/socket.h>
+
+struct client {
+	pthread_t thread;
+	unsigned long requests;	/* complete responses received */
+	unsigned long connects;	/* connections that got at least one response */
+	unsigned long errors;	/* refused/reset connections, short responses */
+};
+
+static unsigned int port = 8080;
+static int keepalive;
+static const char *path = "/";
+static const char *header;	/* -H, NULL if none */
+static volatile int running = 1;
+
+static int connect_server(void)
+{
+	struct sockaddr_in sa;
+	int fd;
+
+	fd = socket(AF_INET, SOCK_STREAM, 0);
+	if (fd < 0)
+		return -1;
+	memset(&sa, 0, sizeof(sa));
+	sa.sin_family = AF_INET;
+	sa.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+	sa.sin_port = htons(port);
+	if (connect(fd, (struct sockaddr *)&sa, sizeof(sa)) < 0) {
+		close(fd);
+		return -1;
+	}
+	return fd;
+}
+
+/*
+ *  Read one response.  Returns 1 if a complete response arrived and the
+ *  connection can be reused, 0 if it arrived and the server closed the
+ *  connection, -1 on error.  Framing: none for a 304, else Content-Length
+ *  if present, else read to EOF.  A response the server will close after is read to EOF
+ *  as well, so the next connect does not race the server's close.
+ */
+static int read_response(int fd)
+{
+	char buf[4096];
+	size_t have;
+	ssize_t n;
+	char *eoh;
+	char *cl;
+	long body;
+	size_t hdrlen;
+	int reuse;
+
+	have = 0;
+	eoh = NULL;
+	while (!eoh) {
+		n = recv(fd, buf + have, sizeof(buf) - 1 - have, 0);
+		if (n <= 0)
+			return -1;
+		have += n;
+		buf[have] = '\0';
+		eoh = strstr(buf, "\r\n\r\n");
+		if (!eoh && have == sizeof(buf) - 1)
+			return -1;
+	}
+	hdrlen = eoh + 4 - buf;
+	*eoh = '\0';
+	cl = strcasestr(buf, "\r\nContent-Length:");
+	if (strncmp(buf + 8, " 304", 4) == 0)
+		cl = NULL;
+	else if (!cl) {
+		while ((n = recv(fd, buf, sizeof(buf), 0)) > 0)
+			;
+		return n == 0 ? 0 : -1;
+	}
+	reuse = strncmp(buf, "HTTP/1.1", 8) == 0
+	    && !strcasestr(buf, "\r\nConnection: close");
+	body = (cl ? atol(cl + 17) : 0) - (long)(have - hdrlen);
+	while (body > 0) {
+		n = recv(fd, buf, sizeof(buf), 0);
+		if (n <= 0)
+			return -1;
+		body -= n;
+	}
+	if (!reuse) {
+		while ((n = recv(fd, buf, sizeof(buf), 0)) > 0)
+			;
+		return n == 0 ? 0 : -1;
+	}
+	return 1;
+}
+
+static void *client_main(void *arg)
+{
+	struct client *c = arg;
+	char req[256];
+	int reqlen;
+	int fd;
+	int fresh;
+	int rc;
+
+	reqlen = snprintf(req, sizeof(req), "GET %s HTTP/1.%c\r\nHost: bench\r\n%s%s\r\n",
+			  path, keepalive ? '1' : '0',
+			  header ? header : "", header ? "\r\n" : "");
+	fd = -1;
+	while (running) {
+		if (fd < 0) {
+			fd = connect_server();
+			if (fd < 0) {
+				c->errors++;
+				usleep(1000);	// back off like a real client
+				continue;
+			}
+			fresh = 1;
+		}
+		if (send(fd, req, reqlen, MSG_NOSIGNAL) != reqlen)
+			rc = -1;
+		else
+			rc = read_response(fd);
+		if (rc < 0) {
+			c->errors++;
+			usleep(1000);
+		} else {
+			c->requests++;
+			c->connects += fresh;
+			fresh = 0;
+		}
+		if (rc <= 0 || !keepalive) {
+			close(fd);
+			fd = -1;
+		}
+	}
+	if (fd >= 0)
+		close(fd);
+	return NULL;
+}
+
+int main(int argc, char **argv)
+{
+	struct client *clients;
+	struct client total;
+	double seconds;
+	int nclients;
+	int opt;
+	int i;
+
+	nclients = 1;
+	seconds = 5;
+	while ((opt = getopt(argc, argv, "c:t:p:kH:")) != -1) {
+		switch (opt) {
+		case 'c':
+			nclients = atoi(optarg);
+			break;
+		case 't':
+			seconds = atof(optarg);
+			break;
+		case 'p':
+			port = atoi(optarg);
+			break;
+		case 'k':
+			keepalive = 1;
+			break;
+		case 'H':
+			header = optarg;
+			break;
+		default:
+			fprintf(stderr, "usage: %s [-c clients] [-t seconds] [-p port] [-k] [-H header] [path]\n", argv[0]);
+			return 1;
+		}
+	}
+	if (optind < argc)
+		path = argv[optind];
+	if (nclients < 1)
+		nclients = 1;
+
+	clients = calloc(nclients, sizeof(*clients));
+	for (i = 0; i < nclients; i++)
+		pthread_create(&clients[i].thread, NULL, client_main, &clients[i]);
+	usleep((useconds_t)(seconds * 1e6));
+	running = 0;
+
+	memset(&total, 0, sizeof(total));
+	for (i = 0; i < nclients; i++) {
+		pthread_join(clients[i].thread, NULL);
+		total.requests += clients[i].requests;
+		total.connects += clients[i].connects;
+		total.errors += clients[i].errors;
+	}
+	printf("clients %d: %.1f req/s, %.1f conn/s, %.1f errors/s\n", nclients,
+	       total.requests / seconds, total.connects / seconds,
+	       total.errors / seconds);
+	free(clients);
+	return 0;
+}
@@ -0,0 +1,524 @@
+/*      mkassets.c      turn a directory of files into the flash asset table
+ *
+ *      usage: mkassets [-z] [-o output.c] dir
+ *
+ *      Every file under dir becomes an asset served at its path relative
+ *      to dir; an index.html is also served at its directory's path.  The
+ *      output (assetdata.c by default) holds each file's header lines and
+ *      body in PROGMEM, the ASSET table, a minimal perfect hash over
+ *      the path hashes and the slots in path order, as described in
+ *      assets.h.  Runs on the build host.
+ *
+ *      With -z, text files also get a gzip copy (made with the host's
+ *      gzip) if it is smaller than the file, headers included.  Each copy
+ *      has a strong ETag computed from its bytes.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <sys/stat.h>
+#include "http.h"
+#include "assets.h"
+
+#define MAX_LEN         0xFFFF	/* ASSET.len is 16 bits on the AVR */
+
+struct file {
+	char *src;	/* file name on the host */
+	unsigned char *data;	/* header lines, blank line, body */
+	size_t hdr_len;
+	size_t len;
+	unsigned char *gz_data;	/* the same for the gzip copy, NULL if none */
+	size_t gz_hdr_len;
+	size_t gz_len;
+};
+
+struct entry {
+	char *path;	/* URL path */
+	unsigned long hash;
+	unsigned int file;	/* index into files[] */
+	unsigned int slot;	/* position in the table */
+};
+
+static struct file *files;
+static unsigned int nfiles;
+static struct entry *entries;
+static unsigned int nentries;
+static int gzip_text;	/* -z */
+
+static const struct {
+	const char *ext;
+	const char *type;
+	int text;	/* worth compressing */
+} types[] = {
+	{ "html", "text/html", 1 },
+	{ "htm", "text/html", 1 },
+	{ "css", "text/css", 1 },
+	{ "js", "application/javascript", 1 },
+	{ "json", "application/json", 1 },
+	{ "txt", "text/plain", 1 },
+	{ "xml", "text/xml", 1 },
+	{ "svg", "image/svg+xml", 1 },
+	{ "gif", "image/gif", 0 },
+	{ "png", "image/png", 0 },
+	{ "jpg", "image/jpeg", 0 },
+	{ "jpeg", "image/jpeg", 0 },
+	{ "ico", "image/x-icon", 0 },
+};
+
+static void die(const char *msg, const char *arg)
+{
+	fprintf(stderr, "mkassets: %s%s%s\n", msg, arg ? ": " : "", arg ? arg : "");
+	exit(1);
+}
+
+static void *xrealloc(void *p, size_t size)
+{
+	p = realloc(p, size);
+	if (!p)
+		die("out of memory", NULL);
+	return p;
+}
+
+static const char *content_type(const char *name, int *text)
+{
+	const char *dot;
+	unsigned int i;
+
+	dot = strrchr(name, '.');
+	if (dot)
+		for (i = 0; i < sizeof(types) / sizeof(types[0]); i++)
+			if (strcasecmp(dot + 1, types[i].ext) == 0) {
+				*text = types[i].text;
+				return types[i].type;
+			}
+	*text = 0;
+	return "application/octet-stream";
+}
+
+/*
+ *  Compress a file with the host's gzip.  Returns the compressed size and
+ *  sets *out, or returns 0 if gzip fails.  -n leaves the name and time out
+ *  of the gzip header, so the output only depends on the contents.
+ */
+static size_t gzip_file(const char *src, unsigned char **out)
+{
+	char cmd[8192];
+	unsigned char *buf;
+	size_t len, n;
+	FILE *fp;
+	int i;
+
+	strcpy(cmd, "gzip -9 -n -c < '");
+	n = strlen(cmd);
+	for (i = 0; src[i] && n < sizeof(cmd) - 8; i++) {
+		if (src[i] == '\'')
+			n += sprintf(cmd + n, "'\\''");
+		else
+			cmd[n++] = src[i];
+	}
+	strcpy(cmd + n, "'");
+
+	fp = popen(cmd, "r");
+	if (!fp)
+		return 0;
+	buf = NULL;
+	len = 0;
+	do {
+		buf = xrealloc(buf, len + 4096);
+		n = fread(buf + len, 1, 4096, fp);
+		len += n;
+	} while (n > 0);
+	if (pclose(fp) != 0 || len == 0) {
+		free(buf);
+		return 0;
+	}
+	*out = buf;
+	return len;
+}
+
+static unsigned long path_hash(const char *path)
+{
+	unsigned long h;
+
+	h = HTTP_HASH_INIT;
+	while (*path)
+		h = HTTP_HASH(h, *path++);
+	return h;
+}
+
+static void add_entry(const char *path, unsigned int file)
+{
+	struct entry *e;
+
+	if (strlen(path) > ASSET_PATH_MAX)
+		die("path longer than ASSET_PATH_MAX", path);
+	if (nentries == ASSET_MAX)
+		die("more than ASSET_MAX paths at", path);
+	entries = xrealloc(entries, (nentries + 1) * sizeof(*entries));
+	e = &entries[nentries++];
+	e->path = strdup(path);
+	e->hash = path_hash(path);
+	e->file = file;
+}
+
+/*
+ *  Strong entity tag of a body: HTTP_HASH of its bytes, in hex.
+ */
+static unsigned long body_tag(const unsigned char *p, size_t len)
+{
+	unsigned long h;
+
+	h = HTTP_HASH_INIT;
+	while (len--)
+		h = HTTP_HASH(h, *p++);
+	return h;
+}
+
+/*
+ *  Read a file and build its header lines and body, and those of its gzip
+ *  copy if it gets one.  The ETag line comes first and the Vary line, if
+ *  any, second; see ASSET_ETAG_LEN in assets.h.
+ */
+static void add_file(const char *src, const char *path)
+{
+	struct file *f;
+	const char *type;
+	const char *vary;
+	unsigned char *body;
+	unsigned char *gz;
+	size_t gz_size;
+	size_t plain;
+	char hdr[256];
+	FILE *fp;
+	long size;
+	int text;
+	int n;
+
+	fp = fopen(src, "rb");
+	if (!fp)
+		die("cannot open", src);
+	fseek(fp, 0, SEEK_END);
+	size = ftell(fp);
+	rewind(fp);
+	body = xrealloc(NULL, size + 1);
+	if (fread(body, 1, size, fp) != (size_t)size)
+		die("cannot read", src);
+	fclose(fp);
+
+	files = xrealloc(files, (nfiles + 1) * sizeof(*files));
+	f = &files[nfiles];
+	memset(f, 0, sizeof(*f));
+	f->src = strdup(src);
+	type = content_type(src, &text);
+
+	n = snprintf(hdr, sizeof(hdr), "ETag: \"%08lx\"\r\nContent-Type: %s\r\nContent-Length: %ld\r\n\r\n",
+		     body_tag(body, size), type, size);
+	gz_size = 0;
+	if (gzip_text && text && size > 0)
+		gz_size = gzip_file(src, &gz);
+	if (gz_size) {
+		plain = n + size;
+		n = snprintf(hdr, sizeof(hdr), "ETag: \"%08lx\"\r\nVary: Accept-Encoding\r\n"
+			     "Content-Type: %s\r\nContent-Encoding: gzip\r\nContent-Length: %lu\r\n\r\n",
+			     body_tag(gz, gz_size), type, (unsigned long)gz_size);
+		if (n + gz_size < plain) {	// only if it saves bytes, headers and all
+			f->gz_hdr_len = n;
+			f->gz_len = n + gz_size;
+			f->gz_data = xrealloc(NULL, f->gz_len);
+			memcpy(f->gz_data, hdr, n);
+			memcpy(f->gz_data + n, gz, gz_size);
+		}
+		free(gz);
+	}
+
+	vary = f->gz_data ? "Vary: Accept-Encoding\r\n" : "";
+	n = snprintf(hdr, sizeof(hdr), "ETag: \"%08lx\"\r\n%sContent-Type: %s\r\nContent-Length: %ld\r\n\r\n",
+		     body_tag(body, size), vary, type, size);
+	if (n + size > MAX_LEN)
+		die("file too large", src);
+
+	f->hdr_len = n;
+	f->len = n + size;
+	f->data = xrealloc(NULL, f->len + 1);
+	memcpy(f->data, hdr, n);
+	memcpy(f->data + n, body, size);
+	free(body);
+
+	add_entry(path, nfiles);
+	nfiles++;
+}
+
+/*
+ *  Add every file under dir; path is the URL path of dir, ending in '/'.
+ */
+static void scan(const char *dir, const char *path)
+{
+	struct dirent **names;
+	struct stat st;
+	char src[4096];
+	char url[4096];
+	int n;
+	int i;
+
+	n = scandir(dir, &names, NULL, alphasort);
+	if (n < 0)
+		die("cannot read directory", dir);
+	for (i = 0; i < n; i++) {
+		if (names[i]->d_name[0] == '.') {
+			free(names[i]);
+			continue;	// hidden files, . and ..
+		}
+		snprintf(src, sizeof(src), "%s/%s", dir, names[i]->d_name);
+		snprintf(url, sizeof(url), "%s%s", path, names[i]->d_name);
+		if (stat(src, &st) < 0)
+			die("cannot stat", src);
+		if (S_ISDIR(st.st_mode)) {
+			strcat(url, "/");
+			scan(src, url);
+		} else if (S_ISREG(st.st_mode)) {
+			add_file(src, url);
+			if (strcmp(names[i]->d_name, "index.html") == 0)
+				add_entry(path, nfiles - 1);
+		}
+		free(names[i]);
+	}
+	free(names);
+}
+
+/*
+ *  Try to place every entry with the given number of buckets.  Buckets are
+ *  placed largest first; each gets the smallest displacement that puts all
+ *  of its entries in free, distinct slots.  Returns 0 if some bucket has no
+ *  such displacement.
+ */
+static int place(unsigned int buckets, unsigned int *disp)
+{
+	unsigned int *order;
+	unsigned int *size;
+	unsigned char *used;
+	unsigned int b, d, i, j, k;
+	unsigned int slot;
+	int ok;
+
+	order = xrealloc(NULL, buckets * sizeof(*order));
+	size = calloc(buckets, sizeof(*size));
+	used = calloc(nentries, 1);
+	for (i = 0; i < nentries; i++)
+		size[entries[i].hash & (buckets - 1)]++;
+	for (b = 0; b < buckets; b++)
+		order[b] = b;
+	for (i = 1; i < buckets; i++)	// insertion sort, largest bucket first
+		for (j = i; j > 0 && size[order[j]] > size[order[j - 1]]; j--) {
+			k = order[j];
+			order[j] = order[j - 1];
+			order[j - 1] = k;
+		}
+
+	ok = 1;
+	for (b = 0; ok && b < buckets && size[order[b]]; b++) {
+		ok = 0;
+		for (d = 0; !ok && d < nentries; d++) {
+			ok = 1;
+			for (i = 0; ok && i < nentries; i++) {
+				if ((entries[i].hash & (buckets - 1)) != order[b])
+					continue;
+				slot = ((entries[i].hash >> 16) % nentries + d) % nentries;
+				if (used[slot])
+					ok = 0;
+				else
+					used[slot] = 2;	// tentatively taken by this bucket
+				entries[i].slot = slot;
+			}
+			for (i = 0; i < nentries; i++)
+				if (used[i] == 2)
+					used[i] = ok;	// keep on success, free on failure
+			if (ok)
+				disp[order[b]] = d;
+		}
+	}
+	free(order);
+	free(size);
+	free(used);
+	return ok;
+}
+
+static void write_bytes(FILE *out, const unsigned char *p, size_t len)
+{
+	size_t i;
+
+	for (i = 0; i < len; i++)
+		fprintf(out, "%s0x%02x,", i % 12 ? " " : "\n\t", p[i]);
+	fprintf(out, "\n");
+}
+
+/*
+ *  Write s as a C string literal.
+ */
+static void write_string(FILE *out, const char *s)
+{
+	fputc('"', out);
+	for (; *s; s++) {
+		if (*s == '"' || *s == '\\')
+			fprintf(out, "\\%c", *s);
+		else if (*s < ' ' || *s > '~')
+			fprintf(out, "\\%03o", (unsigned char)*s);
+		else
+			fputc(*s, out);
+	}
+	fputc('"', out);
+}
+
+/*
+ *  qsort comparison for asset_by_path: strcmp order, as the server's
+ *  ASSET_MATCH compares bytes unsigned.
+ */
+static int by_path(const void *a, const void *b)
+{
+	return strcmp((*(struct entry * const *)a)->path, (*(struct entry * const *)b)->path);
+}
+
+static void write_table(FILE *out, const char *dir, unsigned int buckets, const unsigned int *disp)
+{
+	struct entry *e;
+	struct entry **byp;
+	unsigned int i, j;
+
+	fprintf(out, "/*      assetdata.c      generated by host/mkassets from %s; do not edit */\n\n", dir);
+	fprintf(out, "#include <avr/pgmspace.h>\n#include \"assets.h\"\n");
+
+	for (i = 0; i < nfiles; i++) {
+		fprintf(out, "\n/* %s */\nstatic const unsigned char file%u_P[] PROGMEM = {", files[i].src, i);
+		write_bytes(out, files[i].data, files[i].len);
+		fprintf(out, "};\n");
+		if (files[i].gz_data) {
+			fprintf(out, "static const unsigned char file%u_gz_P[] PROGMEM = {", i);
+			write_bytes(out, files[i].gz_data, files[i].gz_len);
+			fprintf(out, "};\n");
+		}
+	}
+
+	fprintf(out, "\n");
+	for (i = 0; i < nentries; i++) {
+		fprintf(out, "static const char path%u_P[] PROGMEM = ", i);
+		write_string(out, entries[i].path);
+		fprintf(out, ";\n");
+	}
+
+	fprintf(out, "\nconst ASSET asset_table[] PROGMEM = {\n");
+	for (i = 0; i < nentries; i++) {
+		for (j = 0; j < nentries && entries[j].slot != i; j++)
+			;
+		e = &entries[j];
+		fprintf(out, "\t{ 0x%08lxUL, %u, path%u_P, file%u_P, %u, %u, ",
+			e->hash, (unsigned int)strlen(e->path), j, e->file,
+			(unsigned int)files[e->file].hdr_len, (unsigned int)files[e->file].len);
+		if (files[e->file].gz_data)
+			fprintf(out, "file%u_gz_P, %u, %u },", e->file,
+				(unsigned int)files[e->file].gz_hdr_len, (unsigned int)files[e->file].gz_len);
+		else
+			fprintf(out, "0, 0, 0 },");
+		fprintf(out, "\t/* %s */\n", e->path);
+	}
+	if (nentries == 0)
+		fprintf(out, "\t{ 0, 0, 0, 0, 0, 0, 0, 0, 0 }\n");
+	fprintf(out, "};\n\nconst unsigned int asset_disp[] PROGMEM = {");
+	for (i = 0; i < buckets; i++)
+		fprintf(out, "%s%u,", i % 16 ? " " : "\n\t", disp[i]);
+	fprintf(out, "\n};\n\n");
+	fprintf(out, "const unsigned int asset_count PROGMEM = %u;\n", nentries);
+	fprintf(out, "const unsigned int asset_buckets PROGMEM = %u;\n", buckets);
+
+	byp = xrealloc(NULL, (nentries + 1) * sizeof(*byp));
+	for (i = 0; i < nentries; i++)
+		byp[i] = &entries[i];
+	qsort(byp, nentries, sizeof(*byp), by_path);
+	fprintf(out, "\nconst unsigned char asset_by_path[] PROGMEM = {");
+	for (i = 0; i < nentries; i++)
+		fprintf(out, "%s%u,", i % 16 ? " " : "\n\t", byp[i]->slot);
+	fprintf(out, "%s\n};\n", nentries ? "" : "\n\t0");
+	free(byp);
+}
+
+int main(int argc, char **argv)
+{
+	const char *output;
+	const char *dir;
+	unsigned int *disp;
+	unsigned int buckets;
+	unsigned int i, j;
+	unsigned int gz_files;
+	size_t gz_flash;
+	size_t gz_saved;
+	FILE *out;
+	int opt;
+
+	output = "assetdata.c";
+	while ((opt = getopt(argc, argv, "zo:")) != -1) {
+		switch (opt) {
+		case 'z':
+			gzip_text = 1;
+			break;
+		case 'o':
+			output = optarg;
+			break;
+		default:
+			goto usage;
+		}
+	}
+	if (optind != argc - 1)
+		goto usage;
+	dir = argv[optind];
+
+	scan(dir, "/");
+	for (i = 0; i < nentries; i++)
+		for (j = i + 1; j < nentries; j++)
+			if (entries[i].hash == entries[j].hash)
+				die("path hashes collide, rename one of", entries[i].path);
+
+	for (buckets = 1; buckets < nentries / 2; buckets <<= 1)
+		;
+	disp = NULL;
+	for (;;) {
+		disp = xrealloc(disp, buckets * sizeof(*disp));
+		memset(disp, 0, buckets * sizeof(*disp));
+		if (place(buckets, disp))
+			break;
+		if (buckets >= 0x8000)
+			die("cannot build the path hash", NULL);
+		buckets <<= 1;
+	}
+
+	out = fopen(output, "w");
+	if (!out)
+		die("cannot create", output);
+	write_table(out, dir, buckets, disp);
+	if (fclose(out) != 0) {
+		remove(output);
+		die("cannot write", output);
+	}
+	fprintf(stderr, "mkassets: %u files, %u paths, %u buckets\n", nfiles, nentries, buckets);
+
+	gz_files = 0;
+	gz_flash = 0;
+	gz_saved = 0;
+	for (i = 0; i < nfiles; i++) {
+		if (!files[i].gz_data)
+			continue;
+		gz_files++;
+		gz_flash += files[i].gz_len;
+		gz_saved += files[i].len - files[i].gz_len;
+	}
+	if (gzip_text)
+		fprintf(stderr, "mkassets: gzip copies of %u files, %lu bytes of flash, "
+			"%lu bytes less to send for one request of each file\n",
+			gz_files, (unsigned long)gz_flash, (unsigned long)gz_saved);
+	return 0;
+
+usage:
+	fprintf(stderr, "usage: %s [-z] [-o output.c] dir\n", argv[0]);
+	return 1;
+}
@@ -0,0 +1,115 @@
+/*      parsebench.c      throughput of the HTTP request parser on the host
+ *
+ *      usage: parsebench [-t seconds]
+ *
+ *      Feeds a few typical requests (a bare curl request, a browser request
+ *      with a dozen headers, a conditional GET and a small POST) through
+ *      http_parse() one byte at a time, the way httpd feeds it from the RX
+ *      buffer, and prints requests and bytes parsed per second for each.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include "http.h"
+
+static const struct sample {
+	const char *name;
+	const char *text;
+} samples[] = {
+	{ "curl",
+	  "GET / HTTP/1.1\r\nHost: 127.0.0.1:8080\r\nUser-Agent: curl/8.5.0\r\n"
+	  "Accept: */*\r\n\r\n" },
+	{ "browser",
+	  "GET /status/index.html?refresh=1 HTTP/1.1\r\n"
+	  "Host: 192.168.1.177\r\n"
+	  "Connection: keep-alive\r\n"
+	  "Cache-Control: max-age=0\r\n"
+	  "Upgrade-Insecure-Requests: 1\r\n"
+	  "User-Agent: Mozilla/5.0 (X11; Linux x86_64) AppleWebKit/537.36 "
+	  "(KHTML, like Gecko) Chrome/120.0.0.0 Safari/537.36\r\n"
+	  "Accept: text/html,application/xhtml+xml,application/xml;q=0.9,"
+	  "image/avif,image/webp,*/*;q=0.8\r\n"
+	  "Referer: http://192.168.1.177/\r\n"
+	  "Accept-Encoding: gzip, deflate\r\n"
+	  "Accept-Language: en-US,en;q=0.9\r\n"
+	  "Cookie: session=0123456789abcdef\r\n\r\n" },
+	{ "conditional",
+	  "GET /app.js HTTP/1.1\r\nHost: dev\r\nIf-None-Match: \"5d2c7a10\"\r\n"
+	  "Connection: close\r\n\r\n" },
+	{ "post",
+	  "POST /api/config HTTP/1.0\r\nHost: dev\r\nContent-Type: application/json\r\n"
+	  "Content-Length: 27\r\n\r\n" },
+};
+
+static double now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static unsigned char parse(HTTP_REQ *req, const char *text, size_t len)
+{
+	unsigned char rc;
+	size_t i;
+
+	http_init(req);
+	rc = HTTP_MORE;
+	for (i = 0; i < len && rc == HTTP_MORE; i++)
+		rc = http_parse(req, text[i]);
+	return rc;
+}
+
+int main(int argc, char **argv)
+{
+	const struct sample *s;
+	HTTP_REQ req;
+	double seconds;
+	double start;
+	double elapsed;
+	unsigned long n;
+	size_t len;
+	unsigned int i;
+	unsigned int j;
+	int opt;
+
+	seconds = 1;
+	while ((opt = getopt(argc, argv, "t:")) != -1) {
+		switch (opt) {
+		case 't':
+			seconds = atof(optarg);
+			break;
+		default:
+			fprintf(stderr, "usage: %s [-t seconds]\n", argv[0]);
+			return 1;
+		}
+	}
+
+	printf("sizeof(HTTP_REQ) = %u bytes on this host\n", (unsigned int)sizeof(HTTP_REQ));
+	for (i = 0; i < sizeof(samples) / sizeof(samples[0]); i++) {
+		s = &samples[i];
+		len = strlen(s->text);
+		if (parse(&req, s->text, len) != HTTP_DONE) {
+			printf("%-12s parse failed\n", s->name);
+			return 1;
+		}
+		printf("%-12s %4u bytes: method %u, path len %u, flags 0x%02x, content length %lu\n",
+		       s->name, (unsigned int)len, req.method, req.path_len, req.flags,
+		       req.content_length);
+
+		n = 0;
+		start = now();
+		do {
+			for (j = 0; j < 1000; j++)
+				parse(&req, s->text, len);
+			n += 1000;
+			elapsed = now() - start;
+		} while (elapsed < seconds);
+		printf("%-12s %.0f req/s, %.1f MB/s\n", "", n / elapsed, n * len / elapsed / 1e6);
+	}
+	return 0;
+}
@@ -0,0 +1,264 @@
+/*      tracedump.c      decode the binary trace (trace.c) into a timeline
+ *
+ *      usage: tracedump [-q] [file]
+ *
+ *      Reads trace frames from the file, or stdin, e.g. a capture of the
+ *      board's UART or the file written by avrethernet-host -T.  Bytes
+ *      that are not part of a good frame (text printed by the firmware,
+ *      line noise) are skipped.  Prints one line per event: time since the
+ *      first event in ms, socket, event.  A command's completion shows how
+ *      long after it was written CR was seen clear; that is when the
+ *      firmware looked, so it is an upper bound on the chip's time.  Each
+ *      TCP connection gets a summary line when it leaves ESTABLISHED, and
+ *      the command latencies are summed up at the end.  -q prints only the
+ *      summaries.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include "trace.h"
+
+#define SOCKETS		4
+#define SR_ESTABLISHED	0x17
+
+static const struct {
+	unsigned char code;
+	const char *name;
+} cmds[] = {
+	{ 0x01, "OPEN" }, { 0x02, "LISTEN" }, { 0x04, "CONNECT" },
+	{ 0x08, "DISCON" }, { 0x10, "CLOSE" }, { 0x20, "SEND" },
+	{ 0x21, "SEND_MAC" }, { 0x22, "SEND_KEEP" }, { 0x40, "RECV" },
+};
+#define NCMDS	(sizeof(cmds) / sizeof(cmds[0]))
+
+static const struct {
+	unsigned char code;
+	const char *name;
+} states[] = {
+	{ 0x00, "CLOSED" }, { 0x13, "INIT" }, { 0x14, "LISTEN" },
+	{ 0x15, "SYNSENT" }, { 0x16, "SYNRECV" }, { 0x17, "ESTABLISHED" },
+	{ 0x18, "FIN_WAIT" }, { 0x1A, "CLOSING" }, { 0x1B, "TIME_WAIT" },
+	{ 0x1C, "CLOSE_WAIT" }, { 0x1D, "LAST_ACK" }, { 0x22, "UDP" },
+	{ 0x32, "IPRAW" }, { 0x42, "MACRAW" },
+};
+
+static struct sock_state {
+	double cmd_at;		/* when the pending command was written, < 0 if none */
+	int cmd;		/* index into cmds[], -1 if unknown */
+	double up_at;		/* when ESTABLISHED was seen, < 0 if not up */
+	double rx_at;		/* first RX of the connection, < 0 if none yet */
+	double tx_at;		/* first TX of the connection, < 0 if none yet */
+	unsigned long rx, tx;
+} sk[SOCKETS];
+
+static struct {
+	unsigned long n;
+	double sum, max;
+} lat[NCMDS];
+
+static unsigned long events, lost, timeouts, skipped, conns;
+static int quiet;
+
+static int cmd_index(unsigned int code)
+{
+	unsigned int i;
+
+	for (i = 0; i < NCMDS; i++)
+		if (cmds[i].code == code)
+			return i;
+	return -1;
+}
+
+static const char *cmd_name(int i)
+{
+	return i < 0 ? "?" : cmds[i].name;
+}
+
+static const char *state_name(unsigned int code)
+{
+	unsigned int i;
+
+	for (i = 0; i < sizeof(states) / sizeof(states[0]); i++)
+		if (states[i].code == code)
+			return states[i].name;
+	return "?";
+}
+
+/*
+ *  Summary line for a connection that has just left ESTABLISHED.
+ */
+static void conn_end(unsigned int s, double t)
+{
+	struct sock_state *k = &sk[s];
+
+	conns++;
+	printf("%12.3f  s%u  connection %.3f ms", t, s, t - k->up_at);
+	if (k->rx_at >= 0)
+		printf(", first rx +%.3f", k->rx_at - k->up_at);
+	if (k->tx_at >= 0)
+		printf(", first tx +%.3f", k->tx_at - k->up_at);
+	printf(", rx %lu tx %lu bytes\n", k->rx, k->tx);
+	k->up_at = -1;
+}
+
+static void event(double t, unsigned int type, unsigned int s, unsigned int arg)
+{
+	struct sock_state *k = &sk[s];
+	double d;
+
+	events++;
+	switch (type) {
+	case TRACE_START:
+		if (!quiet)
+			printf("%12.3f      start\n", t);
+		break;
+	case TRACE_LOST:
+		lost += arg;
+		if (!quiet)
+			printf("%12.3f      %u events lost\n", t, arg);
+		break;
+	case TRACE_SR:
+		if (!quiet)
+			printf("%12.3f  s%u  %s\n", t, s, state_name(arg));
+		if (arg == SR_ESTABLISHED && k->up_at < 0) {
+			k->up_at = t;
+			k->rx_at = k->tx_at = -1;
+			k->rx = k->tx = 0;
+		} else if (arg != SR_ESTABLISHED && k->up_at >= 0)
+			conn_end(s, t);
+		break;
+	case TRACE_CMD:
+		k->cmd_at = t;
+		k->cmd = cmd_index(arg);
+		if (!quiet)
+			printf("%12.3f  s%u  %s\n", t, s, cmd_name(k->cmd));
+		break;
+	case TRACE_CMD_DONE:
+	case TRACE_CMD_TIMEOUT:
+		if (type == TRACE_CMD_TIMEOUT)
+			timeouts++;
+		if (k->cmd_at < 0) {
+			if (!quiet)
+				printf("%12.3f  s%u  %s\n", t, s, type == TRACE_CMD_DONE ? "done" : "timeout");
+			break;
+		}
+		d = t - k->cmd_at;
+		if (!quiet)
+			printf("%12.3f  s%u  %s %s after %.3f ms\n", t, s, cmd_name(k->cmd),
+			       type == TRACE_CMD_DONE ? "done" : "timed out", d);
+		if (type == TRACE_CMD_DONE && k->cmd >= 0) {
+			lat[k->cmd].n++;
+			lat[k->cmd].sum += d;
+			if (d > lat[k->cmd].max)
+				lat[k->cmd].max = d;
+		}
+		k->cmd_at = -1;
+		break;
+	case TRACE_RX:
+	case TRACE_TX:
+		if (k->up_at >= 0) {
+			if (type == TRACE_RX) {
+				if (k->rx_at < 0)
+					k->rx_at = t;
+				k->rx += arg;
+			} else {
+				if (k->tx_at < 0)
+					k->tx_at = t;
+				k->tx += arg;
+			}
+		}
+		if (!quiet)
+			printf("%12.3f  s%u  %s %u\n", t, s, type == TRACE_RX ? "rx" : "tx", arg);
+		break;
+	default:
+		if (!quiet)
+			printf("%12.3f  s%u  event %u arg %u\n", t, s, type, arg);
+	}
+}
+
+int main(int argc, char **argv)
+{
+	unsigned char f[TRACE_FRAME_LEN];
+	unsigned int have;
+	unsigned int i;
+	unsigned char sum;
+	unsigned int ms, last_ms;
+	unsigned long long full_ms;
+	unsigned int ticks_per_ms;
+	double t0, t;
+	int started;
+	int opt;
+	int c;
+	FILE *in;
+
+	while ((opt = getopt(argc, argv, "q")) != -1) {
+		switch (opt) {
+		case 'q':
+			quiet = 1;
+			break;
+		default:
+			fprintf(stderr, "usage: %s [-q] [file]\n", argv[0]);
+			return 1;
+		}
+	}
+	in = stdin;
+	if (optind < argc && (in = fopen(argv[optind], "rb")) == NULL) {
+		perror(argv[optind]);
+		return 1;
+	}
+	for (i = 0; i < SOCKETS; i++) {
+		sk[i].cmd_at = -1;
+		sk[i].up_at = -1;
+	}
+
+	ticks_per_ms = 250;	// until a TRACE_START says otherwise
+	started = 0;
+	full_ms = 0;
+	last_ms = 0;
+	t0 = 0;
+	have = 0;
+	while ((c = getc(in)) != EOF) {
+		f[have++] = c;
+		if (f[0] != TRACE_SYNC) {
+			have = 0;	// not the start of a frame
+			skipped++;
+			continue;
+		}
+		if (have < TRACE_FRAME_LEN)
+			continue;
+		for (sum = 0, i = 1; i < TRACE_FRAME_LEN - 1; i++)
+			sum += f[i];
+		if (sum != f[TRACE_FRAME_LEN - 1]) {	// bad frame: resync on the next sync byte
+			for (i = 1; i < have && f[i] != TRACE_SYNC; i++) ;
+			skipped += i;
+			memmove(f, f + i, have - i);
+			have -= i;
+			continue;
+		}
+		have = 0;
+
+		ms = f[1] | f[2] << 8;
+		if (f[4] >> 2 == TRACE_START && f[5] | f[6] << 8)
+			ticks_per_ms = f[5] | f[6] << 8;
+		if (!started) {
+			full_ms = ms;
+			started = 1;
+		} else
+			full_ms += (unsigned short)(ms - last_ms);	// clock_ms() wraps every 65.5 s
+		last_ms = ms;
+		t = full_ms + (double)f[3] / ticks_per_ms;
+		if (events == 0)
+			t0 = t;
+		event(t - t0, f[4] >> 2, f[4] & 3, f[5] | f[6] << 8);
+	}
+
+	printf("%lu events, %lu lost, %lu bytes skipped, %lu connections, %lu command timeouts\n",
+	       events, lost, skipped, conns, timeouts);
+	for (i = 0; i < NCMDS; i++)
+		if (lat[i].n)
+			printf("%-10s %8lu  avg %.3f ms  max %.3f ms\n", cmds[i].name,
+			       lat[i].n, lat[i].sum / lat[i].n, lat[i].max);
+	return 0;
+}
@@ -0,0 +1,999 @@
+/*      w5100emu.c      W5100 emulator for host (Linux) builds
+ *
+ *      Emulates the W5100 SPI interface, the common and socket register
+ *      maps, the 8 KB TX and RX buffers and the TCP socket state machine.
+ *      TCP sockets are bridged to real sockets on the loopback interface so
+ *      ordinary clients (curl, a browser, the bench tools) can connect.
+ *      CONNECT opens a host TCP connection to DIPR:DPORT as it stands.
+ *      UDP sockets are bridged to host UDP sockets the same way; datagrams
+ *      go out to the destination in DIPR/DPORT as it stands, except that a
+ *      multicast group's port is mapped like a W5100 port.  Socket 0 in
+ *      MACRAW mode is bridged to a packet socket on the loopback interface
+ *      (this needs CAP_NET_RAW).
+ *
+ *      The emulator is single-threaded: the network side only moves when
+ *      the firmware reads a status register, which is when the real
+ *      chip's progress would become visible anyway.
+*/
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <poll.h>
+#include <time.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+#include <net/if.h>
+#include <linux/if_packet.h>
+#include <net/ethernet.h>
+#include <sys/socket.h>
+#include "w5100.h"
+#include "w5100emu.h"
+
+#define EMU_MEM_SIZE	0x8000	/* W5100 address space */
+#define EMU_BUF_TOTAL	0x2000	/* 8 KB each of TX and RX memory */
+#define EMU_MAX_LISTEN	8	/* distinct TCP ports that can be listened on */
+
+#define SKT_REG(s, off)	(W5100_SKT_BASE(s) + (off))
+
+struct emu_socket {
+	int fd;			/* host socket bridged to this W5100 socket, or -1 */
+	unsigned int rx_wr;	/* chip-side RX write pointer */
+	unsigned int tx_end;	/* TX_WR value latched by the last SEND */
+	unsigned char sending;	/* SEND issued, SEND_OK not raised yet */
+	unsigned char discon;	/* DISCON issued, waiting for TX to drain */
+	unsigned int cmd_reads;	/* CR reads left before the command in CR is taken */
+};
+
+struct emu_listener {
+	unsigned int port;	/* W5100 port number */
+	int fd;
+};
+
+static unsigned char mem[EMU_MEM_SIZE];
+static struct emu_socket skt[W5100_NUM_SOCKETS] = {
+	{.fd = -1}, {.fd = -1}, {.fd = -1}, {.fd = -1}
+};
+static struct emu_listener listeners[EMU_MAX_LISTEN];
+static int nlisteners;
+
+static unsigned int port_base = 8000;
+static unsigned int cmd_delay;	/* CR reads a command stays in CR for; 0 takes it at once */
+static unsigned long frame_ns = 32UL * 1000000000UL / (F_CPU / 2);
+
+static unsigned char frame[4];
+static unsigned char frame_len;
+static unsigned char selected;
+
+static W5100EMU_STATS stats;
+
+static unsigned int reg16(unsigned int addr)
+{
+	return (mem[addr] << 8) | mem[addr + 1];
+}
+
+static void set_reg16(unsigned int addr, unsigned int val)
+{
+	mem[addr] = (val >> 8) & 0xff;
+	mem[addr + 1] = val & 0xff;
+}
+
+/*
+ *  Work out where a socket's buffer lives from RMSR/TMSR.  The chip hands
+ *  out memory to sockets 0..3 in order; once the 8 KB is used up the
+ *  remaining sockets get nothing.
+ */
+static void buf_geometry(unsigned char sock, int tx, unsigned int *base,
+			 unsigned int *size)
+{
+	unsigned char msr;
+	unsigned int total;
+	unsigned int sz;
+	unsigned char i;
+
+	msr = mem[tx ? W5100_TMSR : W5100_RMSR];
+	*base = tx ? W5100_TXBUFADDR : W5100_RXBUFADDR;
+	*size = 0;
+	total = 0;
+	for (i = 0; i <= sock; i++) {
+		sz = 1024u << ((msr >> (2 * i)) & 0x03);
+		if (total + sz > EMU_BUF_TOTAL)
+			sz = EMU_BUF_TOTAL - total;
+		if (i == sock) {
+			*base = (tx ? W5100_TXBUFADDR : W5100_RXBUFADDR) + total;
+			*size = sz;
+		}
+		total += sz;
+	}
+}
+
+static unsigned int tx_pending(unsigned char s)
+{
+	return (skt[s].tx_end - reg16(SKT_REG(s, W5100_TX_RR_OFFSET))) & 0xffff;
+}
+
+static unsigned int tx_free(unsigned char s)
+{
+	unsigned int base, size;
+
+	buf_geometry(s, 1, &base, &size);
+	return size - tx_pending(s);
+}
+
+static unsigned int rx_used(unsigned char s)
+{
+	return (skt[s].rx_wr - reg16(SKT_REG(s, W5100_RX_RD_OFFSET))) & 0xffff;
+}
+
+static void raise_ir(unsigned char s, unsigned char bits)
+{
+	mem[SKT_REG(s, W5100_IR_OFFSET)] |= bits;
+	mem[W5100_IR] |= W5100_IR_SKT_INT(s);
+}
+
+static void clear_ir(unsigned char s, unsigned char bits)
+{
+	mem[SKT_REG(s, W5100_IR_OFFSET)] &= ~bits;
+	if (mem[SKT_REG(s, W5100_IR_OFFSET)] == 0)
+		mem[W5100_IR] &= ~W5100_IR_SKT_INT(s);
+}
+
+static void skt_close(unsigned char s)
+{
+	if (skt[s].fd >= 0)
+		close(skt[s].fd);
+	skt[s].fd = -1;
+	skt[s].sending = 0;
+	skt[s].discon = 0;
+	mem[SKT_REG(s, W5100_SR_OFFSET)] = W5100_SKT_SR_CLOSED;
+}
+
+/*
+ *  Peer went away underneath us (reset, or FIN after our own FIN).
+ */
+static void skt_drop(unsigned char s)
+{
+	skt_close(s);
+	raise_ir(s, W5100_SKT_IR_DISCON);
+}
+
+static int listener_get(unsigned int port)
+{
+	struct sockaddr_in sa;
+	int fd;
+	int one;
+	int i;
+
+	for (i = 0; i < nlisteners; i++)
+		if (listeners[i].port == port)
+			return listeners[i].fd;
+	if (nlisteners >= EMU_MAX_LISTEN)
+		return -1;
+
+	fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK, 0);
+	if (fd < 0)
+		return -1;
+	one = 1;
+	setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+	memset(&sa, 0, sizeof(sa));
+	sa.sin_family = AF_INET;
+	sa.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+	sa.sin_port = htons(port_base + port);
+	if (bind(fd, (struct sockaddr *)&sa, sizeof(sa)) < 0
+	    || listen(fd, 64) < 0) {
+		perror("w5100emu: listen");
+		close(fd);
+		return -1;
+	}
+	listeners[nlisteners].port = port;
+	listeners[nlisteners].fd = fd;
+	nlisteners++;
+	return fd;
+}
+
+/*
+ *  Push as much pending TX data to the host socket as it will take.
+ */
+static void tx_flush(unsigned char s)
+{
+	struct emu_socket *p = &skt[s];
+	unsigned int base, size;
+	unsigned int rr;
+	unsigned int off;
+	unsigned int len;
+	ssize_t n;
+
+	if (p->fd < 0)
+		return;
+	buf_geometry(s, 1, &base, &size);
+	while ((len = tx_pending(s)) > 0) {
+		rr = reg16(SKT_REG(s, W5100_TX_RR_OFFSET));
+		off = rr & (size - 1);
+		if (len > size - off)
+			len = size - off;
+		n = send(p->fd, &mem[base + off], len, MSG_DONTWAIT | MSG_NOSIGNAL);
+		if (n < 0) {
+			if (errno != EAGAIN && errno != EWOULDBLOCK)
+				skt_drop(s);
+			return;
+		}
+		set_reg16(SKT_REG(s, W5100_TX_RR_OFFSET), (rr + n) & 0xffff);
+		stats.bytes_tx += n;
+	}
+
+	if (p->sending) {
+		p->sending = 0;
+		raise_ir(s, W5100_SKT_IR_SEND_OK);
+	}
+	if (p->discon) {
+		p->discon = 0;
+		if (mem[SKT_REG(s, W5100_SR_OFFSET)] == W5100_SKT_SR_CLOSE_WAIT) {
+			skt_drop(s);	// both sides have closed
+		} else {
+			shutdown(p->fd, SHUT_WR);
+			mem[SKT_REG(s, W5100_SR_OFFSET)] = W5100_SKT_SR_FIN_WAIT;
+		}
+	}
+}
+
+/*
+ *  Copy bytes into a socket's RX buffer at the chip-side write pointer.
+ */
+static void rx_put(unsigned char s, const unsigned char *p, unsigned int len)
+{
+	unsigned int base, size;
+	unsigned int off;
+
+	buf_geometry(s, 0, &base, &size);
+	while (len--) {
+		off = skt[s].rx_wr & (size - 1);
+		mem[base + off] = *p++;
+		skt[s].rx_wr = (skt[s].rx_wr + 1) & 0xffff;
+	}
+}
+
+/*
+ *  Move waiting datagrams into the RX buffer, each behind the chip's
+ *  8-byte header (peer IP, peer port, length).  A datagram that does not
+ *  fit waits in the host socket, as it would in the chip's receive queue.
+ *  The chip never hears its own group datagrams, which loopback hands
+ *  back; those are dropped.
+ */
+static void udp_fill(unsigned char s)
+{
+	static unsigned char dgram[65536];
+	struct emu_socket *p = &skt[s];
+	struct sockaddr_in sa;
+	socklen_t salen;
+	unsigned char hdr[8];
+	unsigned int base, size;
+	ssize_t n;
+
+	buf_geometry(s, 0, &base, &size);
+	while (p->fd >= 0) {
+		n = recv(p->fd, dgram, 0, MSG_PEEK | MSG_TRUNC | MSG_DONTWAIT);
+		if (n < 0 || n + sizeof(hdr) > size - rx_used(s))
+			return;	// nothing waiting, or no room yet
+		salen = sizeof(sa);
+		n = recvfrom(p->fd, dgram, sizeof(dgram), MSG_DONTWAIT,
+			     (struct sockaddr *)&sa, &salen);
+		if (n < 0)
+			return;
+		if ((mem[SKT_REG(s, W5100_MR_OFFSET)] & W5100_SKT_MR_MULTI)
+		    && sa.sin_addr.s_addr == htonl(INADDR_LOOPBACK)
+		    && ntohs(sa.sin_port) == port_base + reg16(SKT_REG(s, W5100_PORT_OFFSET)))
+			continue;	// our own Publish
+		memcpy(hdr, &sa.sin_addr.s_addr, 4);
+		hdr[4] = ntohs(sa.sin_port) >> 8;
+		hdr[5] = ntohs(sa.sin_port) & 0xff;
+		hdr[6] = n >> 8;
+		hdr[7] = n & 0xff;
+		rx_put(s, hdr, sizeof(hdr));
+		rx_put(s, dgram, n);
+		stats.bytes_rx += n;
+		stats.dgrams_rx++;
+		raise_ir(s, W5100_SKT_IR_RECV);
+	}
+}
+
+/*
+ *  SEND on a UDP or MACRAW socket: everything between TX_RR and TX_WR is
+ *  one datagram or frame.  Copies it out of the TX buffer and moves TX_RR
+ *  past it.  Returns its length.
+ */
+static unsigned int tx_take(unsigned char s, unsigned char *out)
+{
+	unsigned int base, size;
+	unsigned int rr;
+	unsigned int len;
+	unsigned int i;
+
+	buf_geometry(s, 1, &base, &size);
+	rr = reg16(SKT_REG(s, W5100_TX_RR_OFFSET));
+	skt[s].tx_end = reg16(SKT_REG(s, W5100_TX_WR_OFFSET));
+	len = tx_pending(s);
+	for (i = 0; i < len; i++)
+		out[i] = mem[base + ((rr + i) & (size - 1))];
+	set_reg16(SKT_REG(s, W5100_TX_RR_OFFSET), (rr + len) & 0xffff);
+	return len;
+}
+
+/*
+ *  SEND on a UDP socket, to DIPR:DPORT.  A group's members on this side
+ *  listen on (port_base + port), as every W5100 port does, so a multicast
+ *  destination port is mapped the same way.
+ */
+static void udp_send(unsigned char s)
+{
+	static unsigned char dgram[EMU_BUF_TOTAL];
+	struct sockaddr_in sa;
+	unsigned int port;
+	unsigned int len;
+
+	len = tx_take(s, dgram);
+	memset(&sa, 0, sizeof(sa));
+	sa.sin_family = AF_INET;
+	memcpy(&sa.sin_addr.s_addr, &mem[SKT_REG(s, W5100_DIPR_OFFSET)], 4);
+	port = reg16(SKT_REG(s, W5100_DPORT_OFFSET));
+	if ((mem[SKT_REG(s, W5100_DIPR_OFFSET)] & 0xf0) == 0xe0)
+		port += port_base;
+	sa.sin_port = htons(port);
+	if (sendto(skt[s].fd, dgram, len, MSG_DONTWAIT, (struct sockaddr *)&sa, sizeof(sa)) < 0) {
+		raise_ir(s, W5100_SKT_IR_TIMEOUT);	// like an ARP timeout
+	} else {
+		stats.bytes_tx += len;
+		stats.dgrams_tx++;
+		raise_ir(s, W5100_SKT_IR_SEND_OK);
+	}
+}
+
+/*
+ *  Move waiting frames into socket 0's RX buffer, each behind the chip's
+ *  2-byte length (which counts itself).  Frames this end sent itself are
+ *  dropped, as is anything bigger than the whole RX buffer (loopback's MTU
+ *  is far above Ethernet's), and with MF set anything not for SHAR,
+ *  broadcast or multicast.  A frame that does not fit yet waits in the
+ *  host socket.
+ */
+static void macraw_fill(unsigned char s)
+{
+	static unsigned char frame[65536];
+	struct emu_socket *p = &skt[s];
+	struct sockaddr_ll sll;
+	socklen_t slen;
+	unsigned char info[2];
+	unsigned int base, size;
+	ssize_t n;
+
+	buf_geometry(s, 0, &base, &size);
+	while (p->fd >= 0) {
+		slen = sizeof(sll);
+		n = recvfrom(p->fd, frame, ETH_HLEN, MSG_PEEK | MSG_TRUNC | MSG_DONTWAIT,
+			     (struct sockaddr *)&sll, &slen);
+		if (n < 0)
+			return;	// nothing waiting
+		if (sll.sll_pkttype == PACKET_OUTGOING	// loopback shows every frame going out as well
+		    || n < ETH_HLEN || n + sizeof(info) > size
+		    || ((mem[SKT_REG(s, W5100_MR_OFFSET)] & W5100_SKT_MR_MF)
+			&& !(frame[0] & 0x01) && memcmp(frame, &mem[W5100_SHAR], 6) != 0)) {
+			recv(p->fd, frame, 0, MSG_DONTWAIT);
+			continue;
+		}
+		if (n + sizeof(info) > size - rx_used(s))
+			return;	// no room yet
+		n = recv(p->fd, frame, sizeof(frame), MSG_DONTWAIT);
+		if (n < 0)
+			return;
+		info[0] = (n + sizeof(info)) >> 8;
+		info[1] = (n + sizeof(info)) & 0xff;
+		rx_put(s, info, sizeof(info));
+		rx_put(s, frame, n);
+		stats.bytes_rx += n;
+		stats.frames_rx++;
+		raise_ir(s, W5100_SKT_IR_RECV);
+	}
+}
+
+/*
+ *  SEND on socket 0 in MACRAW mode: the TX data is the whole frame.
+ */
+static void macraw_send(unsigned char s)
+{
+	static unsigned char frame[EMU_BUF_TOTAL];
+	unsigned int len;
+
+	len = tx_take(s, frame);
+	if (send(skt[s].fd, frame, len, MSG_DONTWAIT) < 0) {
+		raise_ir(s, W5100_SKT_IR_TIMEOUT);
+	} else {
+		stats.bytes_tx += len;
+		stats.frames_tx++;
+		raise_ir(s, W5100_SKT_IR_SEND_OK);
+	}
+}
+
+static void macraw_open(unsigned char s)
+{
+	struct sockaddr_ll sll;
+	int fd;
+
+	if (s != 0)
+		return;	// only socket 0 does MACRAW
+	fd = socket(AF_PACKET, SOCK_RAW | SOCK_NONBLOCK, htons(ETH_P_ALL));
+	if (fd < 0) {
+		perror("w5100emu: macraw");
+		return;
+	}
+	memset(&sll, 0, sizeof(sll));
+	sll.sll_family = AF_PACKET;
+	sll.sll_protocol = htons(ETH_P_ALL);
+	sll.sll_ifindex = if_nametoindex("lo");
+	if (bind(fd, (struct sockaddr *)&sll, sizeof(sll)) < 0) {
+		perror("w5100emu: macraw bind");
+		close(fd);
+		return;
+	}
+	skt[s].fd = fd;
+	mem[SKT_REG(s, W5100_SR_OFFSET)] = W5100_SKT_SR_MACRAW;
+}
+
+/*
+ *  OPEN in UDP mode.  With MULTI set, the host socket joins the group in
+ *  DIPR on the loopback interface, where the chip would send an IGMP join,
+ *  and sends to groups through loopback too.
+ */
+static void udp_open(unsigned char s)
+{
+	struct sockaddr_in sa;
+	struct ip_mreq mreq;
+	struct in_addr lo;
+	int multi;
+	int one;
+	int fd;
+
+	fd = socket(AF_INET, SOCK_DGRAM | SOCK_NONBLOCK, 0);
+	if (fd < 0)
+		return;
+	multi = mem[SKT_REG(s, W5100_MR_OFFSET)] & W5100_SKT_MR_MULTI;
+	lo.s_addr = htonl(INADDR_LOOPBACK);
+	memset(&sa, 0, sizeof(sa));
+	sa.sin_family = AF_INET;
+	sa.sin_addr.s_addr = multi ? htonl(INADDR_ANY) : lo.s_addr;	// group traffic is not addressed to 127.0.0.1
+	sa.sin_port = htons(port_base + reg16(SKT_REG(s, W5100_PORT_OFFSET)));
+	if (multi) {
+		one = 1;
+		setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));	// other members on this host
+	}
+	if (bind(fd, (struct sockaddr *)&sa, sizeof(sa)) < 0) {
+		perror("w5100emu: udp bind");
+		close(fd);
+		return;
+	}
+	if (multi) {
+		memcpy(&mreq.imr_multiaddr.s_addr, &mem[SKT_REG(s, W5100_DIPR_OFFSET)], 4);
+		mreq.imr_interface = lo;
+		if (setsockopt(fd, IPPROTO_IP, IP_ADD_MEMBERSHIP, &mreq, sizeof(mreq)) < 0) {
+			perror("w5100emu: join group");
+			close(fd);
+			return;
+		}
+		setsockopt(fd, IPPROTO_IP, IP_MULTICAST_IF, &lo, sizeof(lo));
+	}
+	skt[s].fd = fd;
+	mem[SKT_REG(s, W5100_SR_OFFSET)] = W5100_SKT_SR_UDP;
+}
+
+/*
+ *  Pull whatever the host socket has into free RX buffer space.
+ */
+static void rx_fill(unsigned char s)
+{
+	struct emu_socket *p = &skt[s];
+	unsigned int base, size;
+	unsigned int off;
+	unsigned int len;
+	unsigned char sr;
+	ssize_t n;
+
+	if (mem[SKT_REG(s, W5100_SR_OFFSET)] == W5100_SKT_SR_UDP) {
+		udp_fill(s);
+		return;
+	}
+	if (mem[SKT_REG(s, W5100_SR_OFFSET)] == W5100_SKT_SR_MACRAW) {
+		macraw_fill(s);
+		return;
+	}
+	buf_geometry(s, 0, &base, &size);
+	while (p->fd >= 0) {
+		sr = mem[SKT_REG(s, W5100_SR_OFFSET)];
+		if (sr != W5100_SKT_SR_ESTABLISHED && sr != W5100_SKT_SR_FIN_WAIT)
+			return;
+		len = size - rx_used(s);
+		if (len == 0)
+			return;
+		off = p->rx_wr & (size - 1);
+		if (len > size - off)
+			len = size - off;
+		n = recv(p->fd, &mem[base + off], len, MSG_DONTWAIT);
+		if (n == 0) {	// peer sent FIN
+			if (sr == W5100_SKT_SR_FIN_WAIT) {
+				skt_drop(s);
+			} else {
+				mem[SKT_REG(s, W5100_SR_OFFSET)] = W5100_SKT_SR_CLOSE_WAIT;
+				raise_ir(s, W5100_SKT_IR_DISCON);
+			}
+			return;
+		}
+		if (n < 0) {
+			if (errno != EAGAIN && errno != EWOULDBLOCK)
+				skt_drop(s);
+			return;
+		}
+		p->rx_wr = (p->rx_wr + n) & 0xffff;
+		stats.bytes_rx += n;
+		raise_ir(s, W5100_SKT_IR_RECV);
+	}
+}
+
+/*
+ *  CONNECT: start a non-blocking host connection to DIPR:DPORT.  The
+ *  socket sits in SYNSENT until emu_poll() sees the outcome.
+ */
+static void tcp_connect(unsigned char s)
+{
+	struct sockaddr_in sa;
+	int one = 1;
+	int fd;
+
+	fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK, 0);
+	if (fd < 0) {
+		raise_ir(s, W5100_SKT_IR_TIMEOUT);
+		skt_close(s);
+		return;
+	}
+	setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));	// the chip sends on SEND, no Nagle
+	memset(&sa, 0, sizeof(sa));
+	sa.sin_family = AF_INET;
+	memcpy(&sa.sin_addr.s_addr, &mem[SKT_REG(s, W5100_DIPR_OFFSET)], 4);
+	sa.sin_port = htons(reg16(SKT_REG(s, W5100_DPORT_OFFSET)));
+	skt[s].fd = fd;
+	mem[SKT_REG(s, W5100_SR_OFFSET)] = W5100_SKT_SR_SYNSENT;
+	if (connect(fd, (struct sockaddr *)&sa, sizeof(sa)) == 0 || errno == EINPROGRESS)
+		return;
+	stats.connect_fails++;
+	raise_ir(s, W5100_SKT_IR_TIMEOUT);	// what the chip reports when the SYN goes unanswered
+	skt_close(s);
+}
+
+/*
+ *  A SYNSENT socket's host connection has finished, one way or the other.
+ */
+static void tcp_connected(unsigned char s)
+{
+	socklen_t len;
+	int err;
+
+	len = sizeof(err);
+	if (getsockopt(skt[s].fd, SOL_SOCKET, SO_ERROR, &err, &len) < 0 || err != 0) {
+		stats.connect_fails++;
+		raise_ir(s, W5100_SKT_IR_TIMEOUT);
+		skt_close(s);
+		return;
+	}
+	mem[SKT_REG(s, W5100_SR_OFFSET)] = W5100_SKT_SR_ESTABLISHED;
+	raise_ir(s, W5100_SKT_IR_CON);
+	stats.connects++;
+}
+
+/*
+ *  Hand new connections on a host listener to a W5100 socket listening on
+ *  that port.  Like the real chip, a SYN that finds no listening socket is
+ *  answered with a reset.
+ */
+static void accept_all(struct emu_listener *l)
+{
+	struct sockaddr_in sa;
+	socklen_t salen;
+	struct linger lg;
+	unsigned char s;
+	int sndbuf = 2048;
+	int one = 1;
+	int fd;
+
+	for (;;) {
+		salen = sizeof(sa);
+		fd = accept4(l->fd, (struct sockaddr *)&sa, &salen, SOCK_NONBLOCK);
+		if (fd < 0)
+			return;
+
+		for (s = 0; s < W5100_NUM_SOCKETS; s++)
+			if (mem[SKT_REG(s, W5100_SR_OFFSET)] == W5100_SKT_SR_LISTEN
+			    && reg16(SKT_REG(s, W5100_PORT_OFFSET)) == l->port)
+				break;
+		if (s == W5100_NUM_SOCKETS) {
+			lg.l_onoff = 1;
+			lg.l_linger = 0;
+			setsockopt(fd, SOL_SOCKET, SO_LINGER, &lg, sizeof(lg));
+			close(fd);
+			stats.refused++;
+			continue;
+		}
+
+		setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));	// the chip sends on SEND, no Nagle
+		setsockopt(fd, SOL_SOCKET, SO_SNDBUF, &sndbuf, sizeof(sndbuf));	// TX memory frees as the client reads
+		skt[s].fd = fd;
+		mem[SKT_REG(s, W5100_SR_OFFSET)] = W5100_SKT_SR_ESTABLISHED;
+		memcpy(&mem[SKT_REG(s, W5100_DIPR_OFFSET)], &sa.sin_addr.s_addr, 4);
+		set_reg16(SKT_REG(s, W5100_DPORT_OFFSET), ntohs(sa.sin_port));
+		raise_ir(s, W5100_SKT_IR_CON);
+		stats.accepts++;
+	}
+}
+
+/*
+ *  Move data between the host sockets and the emulated chip, waiting up to
+ *  timeout milliseconds for something to happen.
+ */
+static void emu_poll(int timeout)
+{
+	struct pollfd pfd[EMU_MAX_LISTEN + W5100_NUM_SOCKETS];
+	unsigned char owner[W5100_NUM_SOCKETS];
+	int nfd;
+	int i;
+	unsigned char s;
+
+	nfd = 0;
+	for (i = 0; i < nlisteners; i++) {
+		pfd[nfd].fd = listeners[i].fd;
+		pfd[nfd].events = POLLIN;
+		nfd++;
+	}
+	for (s = 0; s < W5100_NUM_SOCKETS; s++) {
+		if (skt[s].fd < 0)
+			continue;
+		owner[nfd - nlisteners] = s;
+		pfd[nfd].fd = skt[s].fd;
+		pfd[nfd].events = POLLIN;
+		if (tx_pending(s) || mem[SKT_REG(s, W5100_SR_OFFSET)] == W5100_SKT_SR_SYNSENT)
+			pfd[nfd].events |= POLLOUT;
+		nfd++;
+	}
+	if (poll(pfd, nfd, timeout) <= 0)
+		return;
+
+	for (i = 0; i < nfd; i++) {
+		if (!pfd[i].revents)
+			continue;
+		if (i < nlisteners) {
+			accept_all(&listeners[i]);
+			continue;
+		}
+		s = owner[i - nlisteners];
+		if (skt[s].fd != pfd[i].fd)
+			continue;	// socket was closed or reused meanwhile
+		if (mem[SKT_REG(s, W5100_SR_OFFSET)] == W5100_SKT_SR_SYNSENT) {
+			tcp_connected(s);
+			continue;
+		}
+		tx_flush(s);
+		rx_fill(s);
+	}
+}
+
+void w5100emu_poll(void)
+{
+	emu_poll(0);
+}
+
+/*
+ *  The W5100 holds its INT line low while any enabled bit in IR is set.
+ */
+unsigned char w5100emu_int_asserted(void)
+{
+	return (mem[W5100_IR] & mem[W5100_IMR]) != 0;
+}
+
+/*
+ *  Stand-in for sleeping until the INT line is asserted: block until the
+ *  network side has something for the chip or timeout_ms passes.  The time
+ *  spent here is counted as idle time.
+ */
+void w5100emu_wait(unsigned int timeout_ms)
+{
+	struct timespec t0, t1;
+
+	if (w5100emu_int_asserted())
+		return;
+	clock_gettime(CLOCK_MONOTONIC, &t0);
+	emu_poll(timeout_ms);
+	clock_gettime(CLOCK_MONOTONIC, &t1);
+	stats.idle_ns += (t1.tv_sec - t0.tv_sec) * 1000000000ULL + t1.tv_nsec - t0.tv_nsec;
+}
+
+static void command(unsigned char s, unsigned char cmd)
+{
+	unsigned char sr;
+
+	sr = mem[SKT_REG(s, W5100_SR_OFFSET)];
+	switch (cmd) {
+	case W5100_SKT_CR_OPEN:
+		skt_close(s);
+		skt[s].rx_wr = 0;
+		skt[s].tx_end = 0;
+		set_reg16(SKT_REG(s, W5100_TX_RR_OFFSET), 0);
+		set_reg16(SKT_REG(s, W5100_TX_WR_OFFSET), 0);
+		set_reg16(SKT_REG(s, W5100_RX_RD_OFFSET), 0);
+		clear_ir(s, 0xff);
+		if ((mem[SKT_REG(s, W5100_MR_OFFSET)] & 0x0f) == W5100_SKT_MR_TCP)
+			mem[SKT_REG(s, W5100_SR_OFFSET)] = W5100_SKT_SR_INIT;
+		else if ((mem[SKT_REG(s, W5100_MR_OFFSET)] & 0x0f) == W5100_SKT_MR_UDP)
+			udp_open(s);
+		else if ((mem[SKT_REG(s, W5100_MR_OFFSET)] & 0x0f) == W5100_SKT_MR_MACRAW)
+			macraw_open(s);
+		break;
+
+	case W5100_SKT_CR_LISTEN:
+		if (sr != W5100_SKT_SR_INIT)
+			break;
+		if (listener_get(reg16(SKT_REG(s, W5100_PORT_OFFSET))) < 0)
+			skt_close(s);
+		else
+			mem[SKT_REG(s, W5100_SR_OFFSET)] = W5100_SKT_SR_LISTEN;
+		break;
+
+	case W5100_SKT_CR_CONNECT:
+		if (sr == W5100_SKT_SR_INIT)
+			tcp_connect(s);
+		break;
+
+	case W5100_SKT_CR_DISCON:
+		if (sr == W5100_SKT_SR_ESTABLISHED || sr == W5100_SKT_SR_CLOSE_WAIT) {
+			skt[s].discon = 1;
+			tx_flush(s);
+		} else {
+			skt_close(s);
+		}
+		break;
+
+	case W5100_SKT_CR_CLOSE:
+		skt_close(s);
+		break;
+
+	case W5100_SKT_CR_SEND_MAC:
+		if (sr == W5100_SKT_SR_UDP)
+			udp_send(s);	// the MAC address only matters on a real wire
+		break;
+
+	case W5100_SKT_CR_SEND:
+		if (sr == W5100_SKT_SR_UDP) {
+			udp_send(s);
+			break;
+		}
+		if (sr == W5100_SKT_SR_MACRAW) {
+			macraw_send(s);
+			break;
+		}
+		if (sr != W5100_SKT_SR_ESTABLISHED && sr != W5100_SKT_SR_CLOSE_WAIT)
+			break;
+		skt[s].tx_end = reg16(SKT_REG(s, W5100_TX_WR_OFFSET));
+		skt[s].sending = 1;
+		tx_flush(s);
+		break;
+
+	case W5100_SKT_CR_RECV:
+		rx_fill(s);
+		break;
+	}
+}
+
+static unsigned char mem_read(unsigned int addr)
+{
+	unsigned char s;
+	unsigned int off;
+
+	addr &= EMU_MEM_SIZE - 1;
+	if (addr == W5100_IR)
+		w5100emu_poll();
+	if (addr < W5100_SKT_REG_BASE
+	    || addr >= W5100_SKT_BASE(W5100_NUM_SOCKETS))
+		return mem[addr];
+
+	s = (addr - W5100_SKT_REG_BASE) / W5100_SKT_OFFSET;
+	off = addr & (W5100_SKT_OFFSET - 1);
+	switch (off) {
+	case W5100_CR_OFFSET:
+		if (mem[addr] && --skt[s].cmd_reads == 0) {
+			command(s, mem[addr]);
+			mem[addr] = 0;	// command accepted
+		}
+		break;
+	case W5100_SR_OFFSET:
+	case W5100_IR_OFFSET:
+		w5100emu_poll();
+		break;
+	case W5100_TX_FSR_OFFSET:
+		w5100emu_poll();
+		return tx_free(s) >> 8;
+	case W5100_TX_FSR_OFFSET + 1:
+		return tx_free(s) & 0xff;
+	case W5100_RX_RSR_OFFSET:
+		w5100emu_poll();
+		return rx_used(s) >> 8;
+	case W5100_RX_RSR_OFFSET + 1:
+		return rx_used(s) & 0xff;
+	}
+	return mem[addr];
+}
+
+static void mem_write(unsigned int addr, unsigned char val)
+{
+	unsigned char s;
+	unsigned int off;
+
+	addr &= EMU_MEM_SIZE - 1;
+	if (addr == W5100_MR && (val & W5100_MR_SOFTRST)) {
+		w5100emu_reset();
+		return;
+	}
+	if (addr == W5100_IR) {	// write 1 to clear CONFLICT/UNREACH/PPPoE
+		mem[addr] &= ~(val & 0xe0);
+		return;
+	}
+	if (addr < W5100_SKT_REG_BASE
+	    || addr >= W5100_SKT_BASE(W5100_NUM_SOCKETS)) {
+		mem[addr] = val;
+		return;
+	}
+
+	s = (addr - W5100_SKT_REG_BASE) / W5100_SKT_OFFSET;
+	off = addr & (W5100_SKT_OFFSET - 1);
+	switch (off) {
+	case W5100_CR_OFFSET:
+		if (cmd_delay) {
+			mem[addr] = val;	// taken on a later CR read
+			skt[s].cmd_reads = cmd_delay;
+			return;
+		}
+		command(s, val);
+		mem[addr] = 0;	// command accepted
+		return;
+	case W5100_IR_OFFSET:
+		clear_ir(s, val);
+		return;
+	case W5100_SR_OFFSET:
+	case W5100_TX_FSR_OFFSET:
+	case W5100_TX_FSR_OFFSET + 1:
+	case W5100_TX_RR_OFFSET:
+	case W5100_TX_RR_OFFSET + 1:
+	case W5100_RX_RSR_OFFSET:
+	case W5100_RX_RSR_OFFSET + 1:
+		return;		// read-only
+	}
+	mem[addr] = val;
+}
+
+void w5100emu_select(void)
+{
+	if (selected && frame_len != 0)
+		stats.frames_bad++;	// frame abandoned without deselect
+	selected = 1;
+	frame_len = 0;
+}
+
+/*
+ *  The W5100 answers 0x00, 0x01, 0x02 while the opcode and address are
+ *  shifted in, then the data byte (reads) or 0x03 (writes).
+ */
+unsigned char w5100emu_xchg(unsigned char val)
+{
+	unsigned int addr;
+	unsigned char out;
+
+	if (!selected || frame_len >= 4) {
+		stats.frames_bad++;
+		return 0;
+	}
+	frame[frame_len] = val;
+	out = frame_len;
+	if (frame_len == 3) {
+		addr = (frame[1] << 8) | frame[2];
+		if (frame[0] == W5100_WRITE_OPCODE) {
+			mem_write(addr, val);
+			stats.frames_write++;
+		} else if (frame[0] == W5100_READ_OPCODE) {
+			out = mem_read(addr);
+			stats.frames_read++;
+		} else {
+			stats.frames_bad++;
+		}
+		stats.bus_ns += frame_ns;
+	}
+	frame_len++;
+	return out;
+}
+
+void w5100emu_deselect(void)
+{
+	if (frame_len != 0 && frame_len != 4)
+		stats.frames_bad++;
+	selected = 0;
+	frame_len = 0;
+}
+
+void w5100emu_reset(void)
+{
+	unsigned char s;
+
+	for (s = 0; s < W5100_NUM_SOCKETS; s++) {
+		skt_close(s);
+		skt[s].rx_wr = 0;
+		skt[s].tx_end = 0;
+	}
+	memset(mem, 0, sizeof(mem));
+	set_reg16(W5100_RTR, 0x07d0);	// 200 ms
+	mem[W5100_RCR] = 0x08;
+	mem[W5100_RMSR] = 0x55;
+	mem[W5100_TMSR] = 0x55;
+}
+
+void w5100emu_set_port_base(unsigned int base)
+{
+	port_base = base;
+}
+
+/*
+ *  Make the chip slow to take socket commands: each one stays in CR, and
+ *  is only carried out, after the given number of CR reads.  A huge value
+ *  stands in for a wedged chip.  0 (the default) takes commands at once.
+ */
+void w5100emu_set_cmd_delay(unsigned int reads)
+{
+	cmd_delay = reads;
+}
+
+void w5100emu_set_spi_clock(unsigned long hz)
+{
+	frame_ns = 32UL * 1000000000UL / hz;
+}
+
+unsigned long long w5100emu_time_ns(void)
+{
+	return stats.bus_ns + stats.idle_ns;
+}
+
+void w5100emu_get_stats(W5100EMU_STATS *pstats)
+{
+	*pstats = stats;
+}
+
+void w5100emu_clear_stats(void)
+{
+	memset(&stats, 0, sizeof(stats));
+}
+
+void w5100emu_print_stats(FILE *fp)
+{
+	fprintf(fp, "spi frames:    %lu read, %lu write, %lu bad\n",
+		stats.frames_read, stats.frames_write, stats.frames_bad);
+	fprintf(fp, "spi bus time:  %.3f ms (%lu ns/frame)\n",
+		stats.bus_ns / 1e6, frame_ns);
+	fprintf(fp, "idle time:     %.3f ms\n", stats.idle_ns / 1e6);
+	fprintf(fp, "tcp:           %lu accepted, %lu refused\n",
+		stats.accepts, stats.refused);
+	if (stats.connects || stats.connect_fails)
+		fprintf(fp, "tcp client:    %lu connected, %lu failed\n",
+			stats.connects, stats.connect_fails);
+	fprintf(fp, "payload:       %lu bytes in, %lu bytes out\n",
+		stats.bytes_rx, stats.bytes_tx);
+	if (stats.dgrams_rx || stats.dgrams_tx)
+		fprintf(fp, "udp:           %lu datagrams in, %lu out\n",
+			stats.dgrams_rx, stats.dgrams_tx);
+	if (stats.frames_rx || stats.frames_tx)
+		fprintf(fp, "macraw:        %lu frames in, %lu out\n",
+			stats.frames_rx, stats.frames_tx);
+}
@@ -0,0 +1,50 @@
+/*
+ *  w5100emu.h      W5100 emulator for host (Linux) builds
+ *
+ *  The emulator plugs into the W5100 library through the normal
+ *  W5100_CALLBACKS block and decodes the 4-byte SPI frames itself.
+ *  TCP and UDP sockets on the emulated chip are bridged to real sockets on
+ *  the loopback interface; W5100 port N is reachable as 127.0.0.1:(base + N).
+ */
+#ifndef  W5100EMU_H
+#define  W5100EMU_H
+
+#include <stdio.h>
+
+typedef struct  w5100emu_stats_t
+{
+	unsigned long		frames_read;	/* SPI read frames (0x0F) */
+	unsigned long		frames_write;	/* SPI write frames (0xF0) */
+	unsigned long		frames_bad;	/* malformed frames (bad opcode, short or long frame) */
+	unsigned long long	bus_ns;		/* emulated SPI bus time */
+	unsigned long long	idle_ns;	/* time spent waiting for INT in w5100emu_wait */
+	unsigned long		accepts;	/* TCP connections handed to a listening socket */
+	unsigned long		refused;	/* TCP connections reset because no socket was listening */
+	unsigned long		connects;	/* TCP connections made by CONNECT */
+	unsigned long		connect_fails;	/* CONNECTs that ended in a timeout */
+	unsigned long		bytes_rx;	/* payload bytes moved into RX buffers */
+	unsigned long		bytes_tx;	/* payload bytes sent from TX buffers */
+	unsigned long		dgrams_rx;	/* UDP datagrams moved into RX buffers */
+	unsigned long		dgrams_tx;	/* UDP datagrams sent */
+	unsigned long		frames_rx;	/* MACRAW frames moved into RX buffers */
+	unsigned long		frames_tx;	/* MACRAW frames sent */
+}  W5100EMU_STATS;
+
+void w5100emu_select(void);
+unsigned char w5100emu_xchg(unsigned char  val);
+void w5100emu_deselect(void);
+void w5100emu_reset(void);
+
+void w5100emu_set_port_base(unsigned int  base);
+void w5100emu_set_spi_clock(unsigned long  hz);
+void w5100emu_set_cmd_delay(unsigned int  reads);
+void w5100emu_poll(void);
+unsigned char w5100emu_int_asserted(void);
+void w5100emu_wait(unsigned int  timeout_ms);
+
+unsigned long long w5100emu_time_ns(void);
+void w5100emu_get_stats(W5100EMU_STATS  *pstats);
+void w5100emu_clear_stats(void);
+void w5100emu_print_stats(FILE  *fp);
+
+#endif
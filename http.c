@@ -0,0 +1,399 @@
+/*      http.c      incremental HTTP/1.x request parser
+ *
+ *      http_parse() takes one byte per call and keeps all of its state in
+ *      an HTTP_REQ, so it can be fed straight from ReceiveStream() across
+ *      any number of RX events.  Words (method, version, header names and
+ *      the Connection and Accept-Encoding tokens) are matched against small tables in flash by
+ *      narrowing a bit mask of candidates one character at a time.
+*/
+
+#include <avr/pgmspace.h>
+#include "http.h"
+
+/* parser states */
+#define S_METHOD        0	/* request method */
+#define S_PATH          1	/* request path */
+#define S_QUERY         2	/* query string, skipped */
+#define S_VERSION       3	/* protocol version, up to end of line */
+#define S_NAME          4	/* header name, or blank line */
+#define S_VALUE         5	/* header value, up to end of line */
+#define S_DONE          6
+#define S_ERROR         7
+
+#define WORD_MAX        16	/* table entry size, including the NUL */
+
+static const char methods_P[][WORD_MAX] PROGMEM = {
+	"GET", "HEAD", "POST"	/* in HTTP_METHOD_xxx order */
+};
+
+static const char versions_P[][WORD_MAX] PROGMEM = {
+	"HTTP/1.0", "HTTP/1.1"
+};
+
+/* headers we care about, lower case */
+#define H_CONNECTION    0
+#define H_CONTENT_LENGTH        1
+#define H_IF_NONE_MATCH 2
+#define H_ACCEPT_ENCODING       3
+#define H_CODING_PARAMS 0xFE	/* parameters after an Accept-Encoding coding */
+#define H_NONE          0xFF
+
+static const char headers_P[][WORD_MAX] PROGMEM = {
+	"connection", "content-length", "if-none-match", "accept-encoding"
+};
+
+/* Connection and Accept-Encoding tokens, lower case */
+#define T_CLOSE         0
+#define T_KEEPALIVE     1
+#define T_GZIP          2
+#define T_ANY           3
+
+static const char tokens_P[][WORD_MAX] PROGMEM = {
+	"close", "keep-alive", "gzip", "*"
+};
+
+/* what is known about the Accept-Encoding coding in H_CODING_PARAMS (cand) */
+#define C_GZIP          0x01	/* coding is gzip or * */
+#define C_Q             0x02	/* has a q value */
+#define C_NONZERO       0x04	/* q value has a nonzero digit */
+
+static HTTP_ETAG_HOOK etag_hook;	/* see http_register_etag() */
+
+#define ALL(n)          ((unsigned char)((1 << (n)) - 1))
+#define COUNT(t)        (sizeof(t) / sizeof(t[0]))
+
+/*
+ *  Drop the candidates in cand whose character at idx is not c.
+ */
+static unsigned char narrow(unsigned char cand, const char (*table_P)[WORD_MAX],
+			    unsigned char n, unsigned char idx, unsigned char c)
+{
+	unsigned char i;
+
+	for (i = 0; i < n; i++) {
+		if (!(cand & (1 << i)))
+			continue;
+		if (idx >= WORD_MAX - 1 || pgm_read_byte(&table_P[i][idx]) != c)
+			cand &= ~(1 << i);
+	}
+	return cand;
+}
+
+/*
+ *  Return the candidate that is exactly idx characters long, or n if none.
+ */
+static unsigned char matched(unsigned char cand, const char (*table_P)[WORD_MAX],
+			     unsigned char n, unsigned char idx)
+{
+	unsigned char i;
+
+	if (idx >= WORD_MAX)
+		return n;
+	for (i = 0; i < n; i++)
+		if ((cand & (1 << i)) && pgm_read_byte(&table_P[i][idx]) == 0)
+			return i;
+	return n;
+}
+
+static unsigned char lower(unsigned char c)
+{
+	return (c >= 'A' && c <= 'Z') ? c + ('a' - 'A') : c;
+}
+
+/*
+ *  Record the Connection token just finished.
+ */
+static void connection_token(HTTP_REQ *req)
+{
+	switch (matched(req->cand, tokens_P, COUNT(tokens_P), req->idx)) {
+	case T_CLOSE:
+		req->flags |= HTTP_REQ_CLOSE;
+		break;
+	case T_KEEPALIVE:
+		req->flags |= HTTP_REQ_KEEPALIVE;
+		break;
+	}
+	req->idx = 0;
+	req->cand = ALL(COUNT(tokens_P));
+}
+
+/*
+ *  Finish the Accept-Encoding coding just read, up to its parameters.
+ *  Leaves what is known about it in cand for coding_end().
+ */
+static void coding_token(HTTP_REQ *req)
+{
+	unsigned char t;
+
+	t = matched(req->cand, tokens_P, COUNT(tokens_P), req->idx);
+	req->cand = (t == T_GZIP || t == T_ANY) ? C_GZIP : 0;
+	req->hdr = H_CODING_PARAMS;
+}
+
+/*
+ *  Finish one Accept-Encoding list entry.  gzip is accepted unless its
+ *  q value is zero ("gzip;q=0").
+ */
+static void coding_end(HTTP_REQ *req)
+{
+	if (req->hdr == H_ACCEPT_ENCODING)
+		coding_token(req);
+	if ((req->cand & C_GZIP) && (!(req->cand & C_Q) || (req->cand & C_NONZERO)))
+		req->flags |= HTTP_REQ_GZIP;
+	req->hdr = H_ACCEPT_ENCODING;
+	req->idx = 0;
+	req->cand = ALL(COUNT(tokens_P));
+}
+
+/*
+ *  One byte of a header value.  Returns HTTP_ERROR on a bad value.
+ */
+static unsigned char value_byte(HTTP_REQ *req, unsigned char c)
+{
+	unsigned char ws;
+
+	ws = (c == ' ' || c == '\t');
+	switch (req->hdr) {
+	case H_CONNECTION:
+		if (ws || c == ',') {
+			if (req->idx)
+				connection_token(req);
+		} else {
+			req->cand = narrow(req->cand, tokens_P, COUNT(tokens_P), req->idx, lower(c));
+			if (req->idx < 0xFF)
+				req->idx++;
+		}
+		break;
+
+	case H_CONTENT_LENGTH:
+		if (ws)
+			break;
+		if (c < '0' || c > '9')
+			return HTTP_ERROR;
+		if (req->content_length > (0xFFFFFFFFUL - (c - '0')) / 10)
+			return HTTP_ERROR;	// does not fit in 32 bits
+		req->content_length = req->content_length * 10 + (c - '0');
+		break;
+
+	case H_ACCEPT_ENCODING:
+		if (c == ',') {
+			if (req->idx)
+				coding_end(req);
+		} else if (c == ';') {
+			coding_token(req);
+		} else if (!ws) {
+			req->cand = narrow(req->cand, tokens_P, COUNT(tokens_P), req->idx, lower(c));
+			if (req->idx < 0xFF)
+				req->idx++;
+		}
+		break;
+
+	case H_CODING_PARAMS:
+		if (c == ',')
+			coding_end(req);
+		else if (c == '=')
+			req->cand |= C_Q;	// q is the only parameter codings have
+		else if (c >= '1' && c <= '9')
+			req->cand |= C_NONZERO;
+		break;
+
+	case H_IF_NONE_MATCH:
+		if (req->idx == 0) {	// between entity tags
+			if (c == '"') {
+				req->idx = 1;
+				req->inm_hash = HTTP_HASH(HTTP_HASH_INIT, c);
+			} else if (c == '*')
+				req->inm_match = HTTP_INM_ANY;
+			break;	// commas, spaces and the W/ of weak tags
+		}
+		req->inm_hash = HTTP_HASH(req->inm_hash, c);
+		if (c == '"') {	// closing quote; a tag may contain commas
+			req->idx = 0;
+			if (etag_hook)
+				req->inm_match |= etag_hook(req, req->inm_hash);
+		}
+		break;
+	}
+	return HTTP_MORE;
+}
+
+/*
+ *  http_register_etag      set the hook If-None-Match entity tags are given to
+ *
+ *  Without one, If-None-Match sets nothing but HTTP_REQ_INM and, for "*",
+ *  inm_match.
+ */
+void http_register_etag(HTTP_ETAG_HOOK hook)
+{
+	etag_hook = hook;
+}
+
+/*
+ *  http_init      get a request structure ready for a new request
+ */
+void http_init(HTTP_REQ *req)
+{
+	req->state = S_METHOD;
+	req->idx = 0;
+	req->cand = ALL(COUNT(methods_P));
+	req->hdr = H_NONE;
+	req->method = HTTP_METHOD_NONE;
+	req->flags = 0;
+	req->path_len = 0;
+	req->path_hash = HTTP_HASH_INIT;
+	req->inm_hash = HTTP_HASH_INIT;
+	req->inm_match = 0;
+	req->content_length = 0;
+}
+
+/*
+ *  http_parse      feed one request byte to the parser
+ *
+ *  Returns HTTP_MORE until the blank line that ends the headers has been
+ *  seen, then HTTP_DONE.  Any body is left to the caller (see
+ *  content_length).  Returns HTTP_ERROR if the request is malformed; once
+ *  DONE or ERROR is returned, further bytes are ignored until http_init().
+ *  Lines may end in CRLF or a bare LF.
+ */
+unsigned char http_parse(HTTP_REQ *req, unsigned char c)
+{
+	switch (req->state) {
+	case S_METHOD:
+		if (c == ' ') {
+			if (req->idx == 0)
+				goto bad;
+			req->method = matched(req->cand, methods_P, COUNT(methods_P), req->idx) + 1;
+			req->state = S_PATH;
+		} else if (c == '\r' || c == '\n') {
+			if (req->idx)
+				goto bad;	// blank lines before a request are allowed
+		} else {
+			req->cand = narrow(req->cand, methods_P, COUNT(methods_P), req->idx, c);
+			if (req->idx < 0xFF)
+				req->idx++;
+		}
+		return HTTP_MORE;
+
+	case S_PATH:
+	case S_QUERY:
+		if (c == ' ') {
+			req->state = S_VERSION;
+			req->idx = 0;
+			req->cand = ALL(COUNT(versions_P));
+		} else if (c == '\r' || c == '\n') {
+			goto bad;	// HTTP/0.9 simple request
+		} else if (c == '?') {
+			req->state = S_QUERY;
+		} else if (req->state == S_PATH) {
+			req->path_hash = HTTP_HASH(req->path_hash, c);
+			if (req->path_len < 0xFF)
+				req->path_len++;
+		}
+		return HTTP_MORE;
+
+	case S_VERSION:
+		if (c == '\r')
+			return HTTP_MORE;
+		if (c == '\n') {
+			switch (matched(req->cand, versions_P, COUNT(versions_P), req->idx)) {
+			case 0:
+				break;
+			case 1:
+				req->flags |= HTTP_REQ_V11;
+				break;
+			default:
+				goto bad;
+			}
+			req->state = S_NAME;
+			req->idx = 0;
+			req->cand = ALL(COUNT(headers_P));
+			return HTTP_MORE;
+		}
+		req->cand = narrow(req->cand, versions_P, COUNT(versions_P), req->idx, c);
+		if (req->idx < 0xFF)
+			req->idx++;
+		return HTTP_MORE;
+
+	case S_NAME:
+		if (c == '\r' && req->idx == 0)
+			return HTTP_MORE;
+		if (c == '\n') {
+			if (req->idx)
+				goto bad;	// header line without a colon
+			req->state = S_DONE;
+			return HTTP_DONE;
+		}
+		if (c == ':') {
+			req->hdr = matched(req->cand, headers_P, COUNT(headers_P), req->idx);
+			switch (req->hdr) {
+			case H_CONNECTION:
+				req->idx = 0;
+				req->cand = ALL(COUNT(tokens_P));
+				break;
+			case H_CONTENT_LENGTH:
+				req->flags |= HTTP_REQ_LENGTH;
+				req->content_length = 0;
+				break;
+			case H_IF_NONE_MATCH:
+				req->flags |= HTTP_REQ_INM;
+				req->idx = 0;
+				break;
+			case H_ACCEPT_ENCODING:
+				req->idx = 0;
+				req->cand = ALL(COUNT(tokens_P));
+				break;
+			default:
+				req->hdr = H_NONE;
+				break;
+			}
+			req->state = S_VALUE;
+			return HTTP_MORE;
+		}
+		req->cand = narrow(req->cand, headers_P, COUNT(headers_P), req->idx, lower(c));
+		if (req->idx < 0xFF)
+			req->idx++;
+		return HTTP_MORE;
+
+	case S_VALUE:
+		if (c == '\r')
+			return HTTP_MORE;
+		if (c == '\n') {
+			if (req->hdr == H_CONNECTION && req->idx)
+				connection_token(req);
+			else if ((req->hdr == H_ACCEPT_ENCODING && req->idx)
+				 || req->hdr == H_CODING_PARAMS)
+				coding_end(req);
+			req->hdr = H_NONE;
+			req->state = S_NAME;
+			req->idx = 0;
+			req->cand = ALL(COUNT(headers_P));
+			return HTTP_MORE;
+		}
+		if (value_byte(req, c) == HTTP_ERROR)
+			goto bad;
+		return HTTP_MORE;
+
+	case S_DONE:
+		return HTTP_DONE;
+	}
+
+bad:
+	req->state = S_ERROR;
+	return HTTP_ERROR;
+}
+
+/*
+ *  http_hash_P      HTTP_HASH of a NUL-terminated string in flash
+ *
+ *  Use this to get the hash of a fixed path to compare with path_hash.
+ */
+unsigned long http_hash_P(const char *s_P)
+{
+	unsigned long h;
+	unsigned char c;
+
+	h = HTTP_HASH_INIT;
+	while ((c = pgm_read_byte(s_P++)) != 0)
+		h = HTTP_HASH(h, c);
+	return h;
+}
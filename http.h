@@ -0,0 +1,67 @@
+#ifndef HTTPH
+#define HTTPH
+
+/*
+ *  Incremental HTTP/1.x request parser.  Bytes are fed in one at a time as
+ *  they come out of the socket, so a request may arrive in any number of
+ *  pieces and be of any length; nothing but the fields below is kept.
+ */
+
+/* return values from http_parse() */
+#define HTTP_MORE       0	/* need more bytes */
+#define HTTP_DONE       1	/* end of request headers reached */
+#define HTTP_ERROR      2	/* malformed request; answer 400 and close */
+
+/* request methods */
+#define HTTP_METHOD_NONE        0	/* request line not parsed yet */
+#define HTTP_METHOD_GET         1
+#define HTTP_METHOD_HEAD        2
+#define HTTP_METHOD_POST        3
+#define HTTP_METHOD_OTHER       4	/* anything else */
+
+/* request flags */
+#define HTTP_REQ_V11            0x01	/* HTTP/1.1 (else HTTP/1.0) */
+#define HTTP_REQ_CLOSE          0x02	/* "Connection: close" */
+#define HTTP_REQ_KEEPALIVE      0x04	/* "Connection: keep-alive" */
+#define HTTP_REQ_INM            0x08	/* If-None-Match present, see inm_match */
+#define HTTP_REQ_LENGTH         0x10	/* Content-Length present */
+#define HTTP_REQ_GZIP           0x20	/* Accept-Encoding allows gzip */
+
+/*
+ *  Hash used for the path and the If-None-Match value (djb2, xor variant,
+ *  32 bits).  Build-time tools must use the same function.
+ */
+#define HTTP_HASH_INIT          5381UL
+#define HTTP_HASH(h, c)         (((((h) << 5) + (h)) ^ (unsigned char)(c)) & 0xFFFFFFFFUL)
+
+/*
+ *  If-None-Match is a list of entity tags.  Each one is hashed as it comes
+ *  in (quotes included, W/ not, as If-None-Match compares weakly) and
+ *  handed to the hook given to http_register_etag(), which returns the
+ *  bits of the caller's choosing that the tag matches; they are or-ed into
+ *  inm_match.  The path is complete by then.  "*" sets every bit.
+ */
+#define HTTP_INM_ANY            0xFF	/* inm_match of "If-None-Match: *" */
+
+typedef struct http_req_t {
+	unsigned char state;	/* parser state */
+	unsigned char idx;	/* position within the current word */
+	unsigned char cand;	/* words the current word may still match */
+	unsigned char hdr;	/* header whose value is being parsed */
+	unsigned char method;	/* HTTP_METHOD_xxx */
+	unsigned char flags;	/* HTTP_REQ_xxx */
+	unsigned char path_len;	/* path length (saturates at 255) */
+	unsigned long path_hash;	/* HTTP_HASH of the path, query excluded */
+	unsigned long inm_hash;	/* HTTP_HASH of the If-None-Match entity tag being read */
+	unsigned char inm_match;	/* hook bits matched by If-None-Match, see above */
+	unsigned long content_length;	/* Content-Length, 0 if none */
+} HTTP_REQ;
+
+typedef unsigned char (*HTTP_ETAG_HOOK)(const HTTP_REQ  *req, unsigned long  tag_hash);
+
+void http_register_etag(HTTP_ETAG_HOOK  hook);
+void http_init(HTTP_REQ  *req);
+unsigned char http_parse(HTTP_REQ  *req, unsigned char  c);
+unsigned long http_hash_P(const char  *s_P);
+
+#endif
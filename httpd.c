@@ -0,0 +1,579 @@
+/*      httpd.c      minimal web server on top of the W5100 socket layer
+ *
+ *      Target-independent; the board code sets up the W5100 and then
+ *      calls httpd_poll() from its main loop.
+ *
+ *      Connections are persistent (HTTP/1.1, or HTTP/1.0 with
+ *      "Connection: keep-alive").  Every response carries Content-Length,
+ *      so a client can send its next request, or several pipelined ones,
+ *      on the same socket.  The server closes a connection after
+ *      HTTPD_MAX_REQUESTS responses or HTTPD_IDLE_MS without progress:
+ *      no request bytes taken and no response bytes queued, which also
+ *      covers a client that stops halfway through a request or stops
+ *      reading its responses.
+ *
+ *      Built with W5100_USE_STATS, /stats returns the performance counters
+ *      as text (stats.c), formatted into RAM when it is requested.
+*/
+
+#include <stdio.h>
+#include <string.h>
+#include <avr/pgmspace.h>
+#include "w5100.h"
+#include "socket.h"
+#include "clock.h"
+#include "http.h"
+#include "assets.h"
+#include "stats.h"
+#include "httpd.h"
+
+/*
+ *  Responses, sent straight from flash.  A response is a status line, a
+ *  Connection header, then the header lines and body of either an asset
+ *  (assets.h) or one of the canned bodies below.  The header lines come
+ *  before the body, so HEAD can send just the first part.  A 304 is the
+ *  status line, the asset's ETag (and Vary) line, then the Connection
+ *  header and the blank line.
+ */
+static const unsigned char ok_P[] PROGMEM = "HTTP/1.1 200 OK\r\n";
+static const unsigned char not_modified_P[] PROGMEM = "HTTP/1.1 304 Not Modified\r\n";
+static const unsigned char not_found_P[] PROGMEM = "HTTP/1.1 404 Not Found\r\n";
+
+/* the blank line at the end is only sent after a 304 */
+static const unsigned char keep_alive_P[] PROGMEM = "Connection: keep-alive\r\n\r\n";
+static const unsigned char close_P[] PROGMEM = "Connection: close\r\n\r\n";
+
+#define NOT_FOUND_HDR	"Content-Type: text/plain\r\nContent-Length: 11\r\n\r\n"
+static const unsigned char not_found_body_P[] PROGMEM = NOT_FOUND_HDR "Not found\r\n";
+
+/* sent whole, and the connection is closed after them */
+static const unsigned char bad_request_P[] PROGMEM =
+	"HTTP/1.1 400 Bad Request\r\nConnection: close\r\nContent-Length: 0\r\n\r\n";
+static const unsigned char not_implemented_P[] PROGMEM =
+	"HTTP/1.1 501 Not Implemented\r\nConnection: close\r\nContent-Length: 0\r\n\r\n";
+
+#ifdef W5100_USE_STATS
+static const char stats_path_P[] PROGMEM = "/stats";
+static const unsigned char unavailable_P[] PROGMEM =
+	"HTTP/1.1 503 Service Unavailable\r\nConnection: close\r\nContent-Length: 0\r\n\r\n";
+
+#define STATS_HDR_MAX	80	/* room for the /stats header lines */
+#define STATS_HDR	"Content-Type: text/plain\r\nCache-Control: no-store\r\nContent-Length: %u\r\n\r\n"
+
+/* headers and body of the /stats page; one connection at a time */
+static char stats_page[STATS_HDR_MAX + STATS_TEXT_MAX];
+#endif
+
+#define HTTPD_PIECES	3	/* status line, Connection header, headers and body */
+
+typedef struct httpd_piece_t {
+	const unsigned char *ptr;	/* next byte to queue (flash) */
+	unsigned int len;	/* bytes not queued yet */
+#ifdef W5100_USE_STATS
+	unsigned char ram;	/* ptr is in RAM (stats_page), not flash */
+#endif
+} HTTPD_PIECE;
+
+/* values of HTTPD_CONN.open */
+#define CONN_NONE	0	/* no connection seen yet */
+#define CONN_OPEN	1	/* connection established */
+#define CONN_CLOSING	2	/* disconnect issued */
+
+/*
+ *  Per-connection state.  A response that does not fit in the socket's TX
+ *  buffer is queued a piece at a time on later passes, so one slow client
+ *  does not hold up the others.
+ */
+typedef struct httpd_conn_t {
+	HTTP_REQ req;	/* request being parsed; first, see httpd_etag() */
+	ASSET_MATCH match;	/* asset paths the request path may still be */
+#ifdef W5100_USE_STATS
+	unsigned char stats;	/* request path so far is a prefix of stats_path_P */
+#endif
+	HTTPD_PIECE tx[HTTPD_PIECES];	/* response being queued */
+	unsigned char tx_cur;	/* piece being queued */
+	unsigned char tx_count;	/* pieces in the response; tx_cur == tx_count when idle */
+	unsigned char open;	/* CONN_xxx */
+	unsigned char keep;	/* keep the connection after this response */
+	unsigned char requests;	/* responses on this connection */
+	unsigned int idle_since;	/* clock_ms() when the connection last made progress */
+	unsigned char parsed;	/* HTTP_MORE, HTTP_DONE or HTTP_ERROR */
+} HTTPD_CONN;
+
+static HTTPD_CONN conn[HTTPD_NUM_SOCKETS];
+static unsigned int relisten_since;	/* clock_ms() of httpd_expire()'s last listener check */
+
+#define HTTPD_MASK	((1 << HTTPD_NUM_SOCKETS) - 1)	/* bit per server socket */
+
+/*
+ *  Get ready to parse the next request on a connection.
+ */
+static void httpd_next(HTTPD_CONN *c)
+{
+	c->parsed = HTTP_MORE;
+	http_init(&c->req);
+	asset_match_init(&c->match);
+#ifdef W5100_USE_STATS
+	c->stats = 1;
+#endif
+}
+
+/*
+ *  Open a socket and put it in listen state on the HTTP port.
+ */
+static void httpd_listen(unsigned char sock)
+{
+	conn[sock].tx_cur = conn[sock].tx_count = 0;
+	conn[sock].open = CONN_NONE;
+	conn[sock].requests = 0;
+	httpd_next(&conn[sock]);
+	if (OpenSocket(sock, W5100_SKT_MR_TCP, HTTP_PORT) == sock)	// if successful opening a socket...
+		Listen(sock);
+}
+
+/* http_register_etag() bits: which copy of the requested asset a tag names */
+#define INM_DATA	0x01
+#define INM_GZ	0x02
+
+/*
+ *  httpd_etag      If-None-Match hook, see http_register_etag()
+ *
+ *  Headers may come in any order, so which copy will be sent is not known
+ *  yet; report both.  req is the first member of an HTTPD_CONN, which has
+ *  the path match.
+ */
+static unsigned char httpd_etag(const HTTP_REQ *req, unsigned long tag_hash)
+{
+	const HTTPD_CONN *c = (const HTTPD_CONN *)req;
+	ASSET a;
+	unsigned char m;
+
+	if (!asset_find(req, &c->match, &a))
+		return 0;
+	m = 0;
+	if (asset_etag_hash(a.data) == tag_hash)
+		m |= INM_DATA;
+	if (a.gz_data && asset_etag_hash(a.gz_data) == tag_hash)
+		m |= INM_GZ;
+	return m;
+}
+
+/*
+ *  httpd_close      disconnect after the last response
+ *
+ *  If the peer has already closed its side, the DISCON closes the socket
+ *  at once; listen again right away rather than on the next pass, so a
+ *  client that reconnects straight away is not refused.  If the chip has
+ *  not taken the DISCON yet, the next pass sees the socket closed instead.
+ */
+static void httpd_close(unsigned char sock, HTTPD_CONN *c)
+{
+	DisconnectSocket(sock);
+	c->open = CONN_CLOSING;
+	c->idle_since = clock_ms();	// see httpd_expire()
+	if (CommandStatus(sock) == SOCKET_CMD_DONE
+	    && W51_read(W5100_SKT_BASE(sock) + W5100_SR_OFFSET) == W5100_SKT_SR_CLOSED)
+		httpd_listen(sock);
+}
+
+/*
+ *  httpd_scan      ReceiveStream() consumer for the request bytes
+ *
+ *  Feeds the request straight from the RX buffer to the parser, and each
+ *  path byte (the ones that make path_len grow) to the path matches.
+ *  Returns 0 once the headers are complete (or broken), leaving anything
+ *  after them in the buffer for the next request.
+ */
+static unsigned char httpd_scan(void *ctx, unsigned char c)
+{
+	HTTPD_CONN *cn = ctx;
+	unsigned char idx;
+
+	idx = cn->req.path_len;
+	cn->parsed = http_parse(&cn->req, c);
+	if (cn->req.path_len != idx) {
+		asset_match_byte(&cn->match, idx, c);
+#ifdef W5100_USE_STATS
+		if (idx >= sizeof(stats_path_P) - 1 || pgm_read_byte(&stats_path_P[idx]) != c)
+			cn->stats = 0;
+#endif
+	}
+	return cn->parsed == HTTP_MORE;
+}
+
+static void httpd_piece(HTTPD_CONN *c, const unsigned char *ptr, unsigned int len)
+{
+	c->tx[c->tx_count].ptr = ptr;
+	c->tx[c->tx_count].len = len;
+#ifdef W5100_USE_STATS
+	c->tx[c->tx_count].ram = 0;
+#endif
+	c->tx_count++;
+}
+
+
+/*
+ *  Queue the Connection header, and the blank line if last is set.
+ */
+static void httpd_connection(HTTPD_CONN *c, unsigned char last)
+{
+	if (c->keep)
+		httpd_piece(c, keep_alive_P, sizeof(keep_alive_P) - (last ? 1 : 3));
+	else
+		httpd_piece(c, close_P, sizeof(close_P) - (last ? 1 : 3));
+}
+
+#ifdef W5100_USE_STATS
+/*
+ *  httpd_stats      queue the /stats page
+ *
+ *  The counters are formatted into stats_page now, so the page shows them
+ *  as they were when the request came in.  The buffer is shared; while
+ *  another connection is still sending it the request gets a 503.
+ */
+static void httpd_stats(HTTPD_CONN *c, unsigned char head)
+{
+	HTTPD_PIECE *p;
+	unsigned int body_len;
+	unsigned int hdr_len;
+	unsigned char i, j;
+
+	for (i = 0; i < HTTPD_NUM_SOCKETS; i++) {
+		for (j = conn[i].tx_cur; j < conn[i].tx_count; j++) {
+			p = &conn[i].tx[j];
+			if (p->ram && p->len) {
+				c->keep = 0;
+				httpd_piece(c, unavailable_P, sizeof(unavailable_P) - 1);
+				return;
+			}
+		}
+	}
+	body_len = stats_format(stats_page + STATS_HDR_MAX, STATS_TEXT_MAX);
+	hdr_len = snprintf_P(stats_page, STATS_HDR_MAX, PSTR(STATS_HDR), body_len);
+	memmove(stats_page + hdr_len, stats_page + STATS_HDR_MAX, body_len);
+
+	httpd_piece(c, ok_P, sizeof(ok_P) - 1);
+	httpd_connection(c, 0);
+	httpd_piece(c, (const unsigned char *)stats_page, head ? hdr_len : hdr_len + body_len);
+	c->tx[c->tx_count - 1].ram = 1;
+}
+#endif
+
+/*
+ *  httpd_respond      pick the response for a parsed request
+ *
+ *  Argument more is zero if no further request can come on the
+ *  connection, because the client has closed its side and nothing else
+ *  is waiting in RX; the response then closes the connection.
+ */
+static void httpd_respond(HTTPD_CONN *c, unsigned char more)
+{
+	const unsigned char *data;
+	unsigned int hdr_len;
+	unsigned int len;
+	unsigned char head;
+	unsigned char inm;
+	ASSET a;
+
+	c->tx_cur = c->tx_count = 0;
+	c->keep = 0;
+	if (c->parsed == HTTP_ERROR) {
+		httpd_piece(c, bad_request_P, sizeof(bad_request_P) - 1);	// not the NUL
+		return;
+	}
+	if (c->req.method != HTTP_METHOD_GET && c->req.method != HTTP_METHOD_HEAD) {
+		httpd_piece(c, not_implemented_P, sizeof(not_implemented_P) - 1);
+		return;
+	}
+
+	c->requests++;
+	if (more && !(c->req.flags & HTTP_REQ_CLOSE)
+	    && (c->req.flags & (HTTP_REQ_V11 | HTTP_REQ_KEEPALIVE))
+	    && c->req.content_length == 0	// a body would have to be skipped
+	    && c->requests < HTTPD_MAX_REQUESTS)
+		c->keep = 1;
+
+	head = (c->req.method == HTTP_METHOD_HEAD);
+	if (asset_find(&c->req, &c->match, &a)) {
+		if (a.gz_data && (c->req.flags & HTTP_REQ_GZIP)) {
+			data = a.gz_data;	// smaller copy
+			hdr_len = a.gz_hdr_len;
+			len = a.gz_len;
+			inm = INM_GZ;
+		} else {
+			data = a.data;
+			hdr_len = a.hdr_len;
+			len = a.len;
+			inm = INM_DATA;
+		}
+		if (c->req.inm_match & inm) {
+			httpd_piece(c, not_modified_P, sizeof(not_modified_P) - 1);
+			httpd_piece(c, data, asset_cond_len(&a));	// client's copy is current
+			httpd_connection(c, 1);
+			return;
+		}
+		httpd_piece(c, ok_P, sizeof(ok_P) - 1);
+		httpd_connection(c, 0);
+		httpd_piece(c, data, head ? hdr_len : len);
+#ifdef W5100_USE_STATS
+	} else if (c->stats && c->req.path_len == sizeof(stats_path_P) - 1) {
+		httpd_stats(c, head);
+#endif
+	} else {
+		httpd_piece(c, not_found_P, sizeof(not_found_P) - 1);
+		httpd_connection(c, 0);
+		httpd_piece(c, not_found_body_P,
+			    head ? sizeof(NOT_FOUND_HDR) - 1 : sizeof(not_found_body_P) - 1);
+	}
+}
+
+/*
+ *  httpd_send      queue as much of the response as fits, as one SEND
+ *
+ *  Returns nonzero if anything was queued.
+ */
+static unsigned char httpd_send(unsigned char sock, HTTPD_CONN *c)
+{
+	HTTPD_PIECE *p;
+	unsigned int room;
+	unsigned int n;
+	unsigned char i;
+
+	n = 0;
+	for (i = c->tx_cur; i < c->tx_count; i++)
+		n += c->tx[i].len;
+	room = SendBegin(sock, n);	// TX_FSR is only read if the rest may not fit
+	if (room == 0)
+		return 0;	// TX buffer full
+	while (c->tx_cur < c->tx_count && room) {
+		p = &c->tx[c->tx_cur];
+		n = (p->len < room) ? p->len : room;
+#ifdef W5100_USE_STATS
+		if (p->ram)
+			SendWrite(sock, p->ptr, n);
+		else
+#endif
+		SendWrite_P(sock, p->ptr, n);
+		p->ptr += n;
+		p->len -= n;
+		room -= n;
+		if (p->len == 0)
+			c->tx_cur++;
+	}
+	SendCommit(sock);
+	return 1;
+}
+
+/*
+ *  httpd_service      run the state machine for one server socket
+ *
+ *  Works from the socket's entry in this pass's snapshot (PollSockets);
+ *  only requests that had arrived when it was taken are answered, the
+ *  rest wait for the next pass.  A client that shuts down its side after
+ *  sending (CLOSE_WAIT) is served the same way: every request it sent is
+ *  answered, the last response closes the connection, and the socket is
+ *  disconnected once that has been queued.  Returns nonzero if the
+ *  socket needed any work.
+ */
+static unsigned char httpd_service(unsigned char sock, const W5100_SKT_STATUS *st)
+{
+	HTTPD_CONN *c;
+	unsigned int rx;
+	unsigned int used;
+	unsigned char busy;
+	unsigned char fin;
+
+	c = &conn[sock];
+	if (CommandStatus(sock) == SOCKET_CMD_TIMEOUT) {	// chip never took the last command
+		CloseSocket(sock);
+		httpd_listen(sock);	// start over with this socket
+		return 1;
+	}
+	switch (st->sr)		// based on current status of socket...
+	{
+	case W5100_SKT_SR_CLOSED:	// if socket is closed...
+		httpd_listen(sock);
+		return 1;
+
+	case W5100_SKT_SR_ESTABLISHED:	// if socket connection is established...
+	case W5100_SKT_SR_CLOSE_WAIT:	// ...or the client has sent all it will
+		if (c->open == CONN_NONE) {
+			c->open = CONN_OPEN;	// new connection
+			c->idle_since = clock_ms();
+			W51_COUNT(connections, 1);
+		}
+		if (c->open != CONN_OPEN)
+			return 0;	// on its way out
+
+		fin = (st->sr == W5100_SKT_SR_CLOSE_WAIT);	// RX holds all that will ever come
+		busy = 0;
+		rx = st->rx_rsr;
+		for (;;) {
+			if (c->tx_cur == c->tx_count) {
+				if (rx == 0 || (used = ReceiveStream(sock, httpd_scan, c)) == 0) {
+					if (fin) {
+						httpd_close(sock, c);	// all answered; a partial request never will be
+						return 1;
+					}
+					return busy;	// no (more) requests yet
+				}
+				rx = (used < rx) ? rx - used : 0;
+				busy = 1;
+				c->idle_since = clock_ms();	// client is sending
+				if (c->parsed == HTTP_MORE)
+					return 1;	// rest of the request still to come
+				httpd_respond(c, !fin || rx);
+				httpd_next(c);
+			}
+
+			if (!httpd_send(sock, c))
+				return busy;	// TX buffer full, come back later
+			busy = 1;
+			c->idle_since = clock_ms();	// client is reading
+			if (c->tx_cur < c->tx_count)
+				return 1;	// rest of the response goes out later
+			if (!c->keep) {
+				httpd_close(sock, c);	// whole response queued
+				return 1;
+			}
+			// see if another request is waiting
+		}
+
+	case W5100_SKT_SR_FIN_WAIT:
+	case W5100_SKT_SR_CLOSING:
+	case W5100_SKT_SR_TIME_WAIT:
+	case W5100_SKT_SR_LAST_ACK:
+		CloseSocket(sock);
+		httpd_listen(sock);	// put the listener back right away
+		return 1;
+	}
+	return 0;
+}
+
+/*
+ *  httpd_expire      close connections that have made no progress for too long
+ *
+ *  A connection with nothing left to send is disconnected.  One whose
+ *  client has stopped reading is closed outright, since a DISCON would
+ *  wait behind the data the client is not taking; so is one whose DISCON
+ *  has not gone through within HTTPD_IDLE_MS.
+ *
+ *  Also puts back, every HTTPD_RELISTEN_MS, any server socket that is not
+ *  connected and has been left closed: an OPEN or LISTEN that failed, or
+ *  a command the chip never took.  Such a socket raises no interrupt, so
+ *  with httpd_interrupt() nothing else would notice.  That check costs
+ *  one SR read per unconnected socket; otherwise this costs no SPI traffic
+ *  unless a connection has to be closed.  httpd_poll() calls this itself;
+ *  with httpd_interrupt(), call it from the main loop.
+ */
+void httpd_expire(void)
+{
+	HTTPD_CONN *c;
+	unsigned char sock;
+	unsigned char sr;
+	unsigned char relisten;
+	unsigned int now;
+
+	now = clock_ms();
+	relisten = ((unsigned int)(now - relisten_since) >= HTTPD_RELISTEN_MS);
+	if (relisten)
+		relisten_since = now;
+	for (sock = 0; sock < HTTPD_NUM_SOCKETS; sock++) {
+		c = &conn[sock];
+		if (c->open == CONN_CLOSING
+		    && (unsigned int)(now - c->idle_since) >= HTTPD_IDLE_MS) {
+			CloseSocket(sock);	// DISCON stuck behind data the client is not taking
+			httpd_listen(sock);
+			continue;
+		}
+		if (c->open != CONN_OPEN) {
+			if (!relisten)
+				continue;
+			sr = W51_read(W5100_SKT_BASE(sock) + W5100_SR_OFFSET);
+			if (sr == W5100_SKT_SR_CLOSED || sr == W5100_SKT_SR_INIT
+			    || CommandStatus(sock) == SOCKET_CMD_TIMEOUT) {
+				CloseSocket(sock);
+				httpd_listen(sock);
+			}
+			continue;
+		}
+		if ((unsigned int)(now - c->idle_since) < HTTPD_IDLE_MS)
+			continue;
+		if (c->tx_cur == c->tx_count) {
+			httpd_close(sock, c);
+		} else {
+			CloseSocket(sock);	// stuck sending
+			httpd_listen(sock);
+		}
+	}
+}
+
+/*
+ *  httpd_init      open the server sockets
+ *
+ *  Puts every server socket in listen state and enables the W5100 socket
+ *  interrupts for them, so the board can use either httpd_poll() or
+ *  httpd_interrupt() from its main loop.
+ */
+void httpd_init(void)
+{
+	unsigned char sock;
+	unsigned char imr;
+
+	http_register_etag(&httpd_etag);
+	relisten_since = clock_ms();
+	imr = 0;
+	for (sock = 0; sock < HTTPD_NUM_SOCKETS; sock++) {
+		httpd_listen(sock);
+		imr |= W5100_IMR_SKT_INT(sock);
+	}
+	W51_write(W5100_IMR, imr);
+}
+
+/*
+ *  httpd_interrupt      service the sockets that raised an interrupt
+ *
+ *  Call this when the W5100 INT line is asserted.  Reads the chip's
+ *  Interrupt register once and takes a snapshot of only the sockets with
+ *  pending events; their events are cleared as part of it, before their
+ *  state is read, so anything that happens meanwhile keeps INT asserted.
+ */
+void httpd_interrupt(void)
+{
+	W5100_SKT_STATUS st[W5100_NUM_SOCKETS];
+	unsigned char sock;
+	unsigned char ir;
+
+	ir = W51_read(W5100_IR) & HTTPD_MASK;
+	if (ir == 0)
+		return;
+	PollSockets(ir, 1, st);
+	for (sock = 0; sock < HTTPD_NUM_SOCKETS; sock++)
+		if (ir & W5100_IR_SKT_INT(sock))
+			httpd_service(sock, &st[sock]);
+}
+
+/*
+ *  httpd_poll      run one pass of the server state machine
+ *
+ *  Call this from the main loop.  Each pass takes one snapshot of every
+ *  server socket (PollSockets), one register read for each listening
+ *  socket and about eight for a connected one, and then services them
+ *  from it, round-robin, so up to HTTPD_NUM_SOCKETS clients can be
+ *  connected at the same time while the remaining sockets keep listening.
+ *  Returns nonzero if any socket needed work, so the caller knows when it
+ *  may idle.
+ */
+unsigned char httpd_poll(void)
+{
+	W5100_SKT_STATUS st[W5100_NUM_SOCKETS];
+	unsigned char sock;
+	unsigned char busy;
+
+	busy = 0;
+	PollSockets(HTTPD_MASK, 0, st);
+	for (sock = 0; sock < HTTPD_NUM_SOCKETS; sock++)
+		busy |= httpd_service(sock, &st[sock]);
+	httpd_expire();
+	return busy;
+}
@@ -0,0 +1,18 @@
+#ifndef HTTPDH
+#define HTTPDH
+
+#include "upstream.h"
+
+#define HTTP_PORT       80	/* TCP port for HTTP */
+
+#define HTTPD_NUM_SOCKETS	UPSTREAM_FIRST_SOCKET	/* sockets listening on HTTP_PORT; the pool has the rest */
+#define HTTPD_IDLE_MS	5000	/* close a connection that makes no progress this long */
+#define HTTPD_MAX_REQUESTS	100	/* responses per connection before it is closed */
+#define HTTPD_RELISTEN_MS	1000	/* how often httpd_expire() checks that idle sockets still listen */
+
+void httpd_init(void);
+unsigned char httpd_poll(void);
+void httpd_interrupt(void);
+void httpd_expire(void);
+
+#endif
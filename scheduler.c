@@ -0,0 +1,70 @@
+/*      scheduler.c      cooperative task scheduler on clock_ms()
+ *
+ *      Target-independent.  A task with period 0 runs on every pass; any
+ *      other runs once each period_ms, on a fixed grid so it does not
+ *      drift.  A task that falls more than a period behind (a long pass)
+ *      runs once and starts a new grid rather than catching up in a burst.
+ *      Nothing here waits: time that used to go to delay loops is left to
+ *      the other tasks, or to the caller to sleep through.
+*/
+
+#include "clock.h"
+#include "scheduler.h"
+
+typedef struct sched_task_t {
+	unsigned char (*task)(void);
+	unsigned int period;	/* ms, 0 for every pass */
+	unsigned int due;	/* clock_ms() of the next run */
+} SCHED_TASK;
+
+static SCHED_TASK tasks[SCHED_TASKS];
+static unsigned char ntasks;
+
+/*
+ *  sched_add      add a task to the table
+ *
+ *  A periodic task first runs period_ms from now.  Tasks run in the order
+ *  they were added.  Returns the task's slot, or SCHED_FAIL if the table
+ *  is full.
+ */
+unsigned char sched_add(unsigned char (*task)(void), unsigned int period_ms)
+{
+	SCHED_TASK *t;
+
+	if (ntasks == SCHED_TASKS)
+		return SCHED_FAIL;
+	t = &tasks[ntasks];
+	t->task = task;
+	t->period = period_ms;
+	t->due = clock_ms() + period_ms;
+	return ntasks++;
+}
+
+/*
+ *  sched_run      one pass over the task table
+ *
+ *  Returns nonzero if any task that ran found work to do.
+ */
+unsigned char sched_run(void)
+{
+	SCHED_TASK *t;
+	unsigned char busy;
+	unsigned int now;
+	unsigned int late;
+
+	busy = 0;
+	for (t = tasks; t < tasks + ntasks; t++) {
+		if (t->period) {
+			now = clock_ms();
+			late = now - t->due;
+			if (late & 0x8000)
+				continue;	// due is still ahead: not time yet
+			if (late >= t->period)
+				t->due = now + t->period;	// fell behind: new grid from now
+			else
+				t->due += t->period;
+		}
+		busy |= t->task();
+	}
+	return busy;
+}
@@ -0,0 +1,17 @@
+#ifndef SCHEDULERH
+#define SCHEDULERH
+
+/*
+ *  Cooperative scheduler.  A task is a function that does a bounded amount
+ *  of work and returns nonzero if it found any.  sched_run() calls every
+ *  task that is due, once; the main loop calls it over and over and may
+ *  idle when a pass found nothing to do.  Periods are in ms, up to 32767.
+ */
+
+#define SCHED_TASKS	6	/* room in the task table */
+#define SCHED_FAIL	0xff
+
+unsigned char sched_add(unsigned char  (*task)(void), unsigned int  period_ms);
+unsigned char sched_run(void);
+
+#endif
@@ -0,0 +1,837 @@
+/*      socket.c      W5100 socket layer (open, listen, send, receive)
+ *
+ *      Target-independent; talks to the chip only through the W51_xxx
+ *      routines in w5100.c.
+ *
+ *      Socket commands do not wait for the chip.  A command is written to
+ *      CR and the call returns; the chip clears CR once it has taken the
+ *      command, and that is checked when the next command for the same
+ *      socket comes along (or by CommandStatus).  A command the chip has
+ *      not taken within SOCKET_CMD_MS is given up on, so a wedged chip
+ *      cannot hang the main loop.
+ *
+ *      The MCU is the only writer of each socket's TX_WR and RX_RD, so
+ *      they are kept in RAM and read from the chip only when the socket is
+ *      opened.  The free and received sizes are remembered too: what was
+ *      free or waiting at the last read, less what has been used since, is
+ *      still there, so TX_FSR and RX_RSR are read only when that is not
+ *      enough.
+*/
+
+#include "w5100.h"
+#include "clock.h"
+#include "socket.h"
+#include "trace.h"
+
+static unsigned char cmd_pending;	/* bit per socket: command written, CR not seen clear yet */
+static unsigned int cmd_issued[W5100_NUM_SOCKETS];	/* clock_ms() when it was written */
+
+static unsigned int tx_wr[W5100_NUM_SOCKETS];	/* TX write pointer, as the chip will see it at the next SEND */
+static unsigned int rx_rd[W5100_NUM_SOCKETS];	/* RX read pointer, as last written to the chip */
+static unsigned int tx_free[W5100_NUM_SOCKETS];	/* TX bytes known to be free (at least) */
+static unsigned int rx_ready[W5100_NUM_SOCKETS];	/* RX bytes known to be waiting (at least) */
+#ifdef W5100_USE_TRACE
+static unsigned int tx_begin[W5100_NUM_SOCKETS];	/* tx_wr at SendBegin, for TRACE_TX */
+#endif
+
+/*
+ *  Read a 16-bit register pair, MSB first, that the chip may be updating.
+ *  The MSB is read again after the LSB; if it moved, the pair may be torn
+ *  and is read again, up to STABLE_TRIES times.  This is only used for the
+ *  size registers, which only grow between our own commands: a steady MSB
+ *  means the LSB belongs to it, and a torn pair is never above the size
+ *  it was read during, so if the MSB never settles the lower of the last
+ *  two pairs is still a safe lower bound.
+ */
+#define STABLE_TRIES	3
+
+static unsigned int ReadStable(unsigned int addr)
+{
+	unsigned char hi;
+	unsigned char lo;
+	unsigned char again;
+	unsigned char i;
+	unsigned int val;
+	unsigned int last;
+
+	last = 0xFFFF;
+	hi = W51_read(addr);
+	for (i = 1; ; i++) {
+		lo = W51_read(addr + 1);
+		again = W51_read(addr);
+		val = (hi << 8) | lo;
+		if (again == hi)
+			return val;
+		if (i == STABLE_TRIES)
+			return (val < last) ? val : last;	// still moving, give up
+		last = val;
+		hi = again;
+	}
+}
+
+/*
+ *  Load the pointer shadows from the chip, just after OPEN.  The TX buffer
+ *  of a socket that has just been opened is empty; nothing is known to be
+ *  waiting in RX until RX_RSR is read.
+ */
+static void SyncPointers(unsigned char sock)
+{
+	unsigned int sockaddr;
+
+	sockaddr = W5100_SKT_BASE(sock);	// calc base addr for this socket
+	tx_wr[sock] = (W51_read(sockaddr + W5100_TX_WR_OFFSET) << 8)
+	    + W51_read(sockaddr + W5100_TX_WR_OFFSET + 1);
+	rx_rd[sock] = (W51_read(sockaddr + W5100_RX_RD_OFFSET) << 8)
+	    + W51_read(sockaddr + W5100_RX_RD_OFFSET + 1);
+	tx_free[sock] = W51_tx_size(sock);
+	rx_ready[sock] = 0;
+}
+
+/*
+ *  CommandStatus      has the chip taken the socket's last command?
+ *
+ *  Costs one CR read while a command is pending, nothing otherwise.
+ *  Returns SOCKET_CMD_DONE, SOCKET_CMD_BUSY, or SOCKET_CMD_TIMEOUT once
+ *  when the deadline has passed; the command is then forgotten and the
+ *  caller decides what to do with the socket (usually close it).
+ */
+unsigned char CommandStatus(unsigned char sock)
+{
+	if (sock >= W5100_NUM_SOCKETS || !(cmd_pending & (1 << sock)))
+		return SOCKET_CMD_DONE;
+	if (W51_read(W5100_SKT_BASE(sock) + W5100_CR_OFFSET) == 0) {
+		cmd_pending &= ~(1 << sock);
+		TRACE(TRACE_CMD_DONE, sock, 0);
+		return SOCKET_CMD_DONE;
+	}
+	if ((unsigned int)(clock_ms() - cmd_issued[sock]) < SOCKET_CMD_MS) {
+		W51_COUNT(cmd_waits, 1);
+		return SOCKET_CMD_BUSY;
+	}
+	cmd_pending &= ~(1 << sock);
+	W51_COUNT(cmd_timeouts, 1);
+	TRACE(TRACE_CMD_TIMEOUT, sock, 0);
+	return SOCKET_CMD_TIMEOUT;
+}
+
+/*
+ *  CommandWait      wait, at most SOCKET_CMD_MS, for the last command to be taken
+ *
+ *  Returns W5100_OK, or W5100_FAIL if the deadline passed.
+ */
+unsigned char CommandWait(unsigned char sock)
+{
+	unsigned char status;
+
+	while ((status = CommandStatus(sock)) == SOCKET_CMD_BUSY) ;
+	return (status == SOCKET_CMD_DONE) ? W5100_OK : W5100_FAIL;
+}
+
+/*
+ *  SocketCommand      write a command to a socket's CR and return
+ *
+ *  The chip takes one command at a time, so this first waits (bounded) for
+ *  the previous one.  Returns W5100_OK, or W5100_FAIL if the previous
+ *  command was never taken; the new one is written either way, so a CLOSE
+ *  still gets its chance.
+ */
+unsigned char SocketCommand(unsigned char sock, unsigned char cmd)
+{
+	unsigned char retval;
+
+	if (sock >= W5100_NUM_SOCKETS)
+		return W5100_FAIL;
+	retval = CommandWait(sock);
+	W51_write(W5100_SKT_BASE(sock) + W5100_CR_OFFSET, cmd);
+	cmd_issued[sock] = clock_ms();
+	cmd_pending |= (1 << sock);
+	TRACE(TRACE_CMD, sock, cmd);
+	return retval;
+}
+
+/*
+ *  Status a socket opened in the given mode should be in.
+ */
+static unsigned char OpenStatus(unsigned char eth_protocol)
+{
+	switch (eth_protocol & 0x0F) {
+	case W5100_SKT_MR_UDP:
+		return W5100_SKT_SR_UDP;
+	case W5100_SKT_MR_IPRAW:
+		return W5100_SKT_SR_IPRAW;
+	case W5100_SKT_MR_MACRAW:
+		return W5100_SKT_SR_MACRAW;
+	}
+	return W5100_SKT_SR_INIT;	// TCP
+}
+
+unsigned char OpenSocket(unsigned char sock, unsigned char eth_protocol,
+			 unsigned int tcp_port)
+{
+	unsigned char retval;
+	unsigned int sockaddr;
+
+	retval = W5100_FAIL;	// assume this doesn't work
+	if (sock >= W5100_NUM_SOCKETS)
+		return retval;	// illegal socket value is bad!
+
+	sockaddr = W5100_SKT_BASE(sock);	// calc base addr for this socket
+
+	if (W51_read(sockaddr + W5100_SR_OFFSET) != W5100_SKT_SR_CLOSED)	// Make sure we close the socket first
+	{
+		CloseSocket(sock);
+		CommandWait(sock);	// MR and PORT only take effect on a closed socket
+	}
+
+	W51_write(sockaddr + W5100_MR_OFFSET, eth_protocol);	// set protocol for this socket
+	W51_write(sockaddr + W5100_PORT_OFFSET, ((tcp_port & 0xFF00) >> 8));	// set port for this socket (MSB)
+	W51_write(sockaddr + W5100_PORT_OFFSET + 1, (tcp_port & 0x00FF));	// set port for this socket (LSB)
+	SocketCommand(sock, W5100_SKT_CR_OPEN);	// open the socket
+
+	if (CommandWait(sock) == W5100_OK	// the status is only meaningful once OPEN is taken
+	    && W51_read(sockaddr + W5100_SR_OFFSET) == OpenStatus(eth_protocol)) {
+		SyncPointers(sock);	// the only time they are read
+		retval = sock;	// if success, return socket number
+	} else
+		CloseSocket(sock);	// if failed, close socket immediately
+
+	return retval;
+}
+
+void CloseSocket(unsigned char sock)
+{
+	SocketCommand(sock, W5100_SKT_CR_CLOSE);	// tell chip to close the socket
+	if (sock < W5100_NUM_SOCKETS) {
+		tx_free[sock] = 0;	// nothing to send or receive until it is opened again
+		rx_ready[sock] = 0;
+	}
+}
+
+void DisconnectSocket(unsigned char sock)
+{
+	SocketCommand(sock, W5100_SKT_CR_DISCON);	// disconnect the socket
+}
+
+unsigned char Listen(unsigned char sock)
+{
+	unsigned char retval;
+	unsigned int sockaddr;
+
+	retval = W5100_FAIL;	// assume this fails
+	if (sock >= W5100_NUM_SOCKETS)
+		return retval;	// if illegal socket number, ignore request
+
+	sockaddr = W5100_SKT_BASE(sock);	// calc base addr for this socket
+	if (W51_read(sockaddr + W5100_SR_OFFSET) == W5100_SKT_SR_INIT)	// if socket is in initialized state...
+	{
+		SocketCommand(sock, W5100_SKT_CR_LISTEN);	// put socket in listen state
+
+		if (CommandWait(sock) == W5100_OK
+		    && W51_read(sockaddr + W5100_SR_OFFSET) == W5100_SKT_SR_LISTEN)
+			retval = W5100_OK;	// if socket state changed, show success
+		else
+			CloseSocket(sock);	// not in listen mode, close and show an error occurred
+	}
+	return retval;
+}
+
+/*
+ *  Local ports for outgoing connections.  Each connection gets the next
+ *  one, so a reconnect never reuses a port the peer may still hold in
+ *  TIME_WAIT.
+ */
+#define EPHEMERAL_FIRST	49152
+static unsigned int next_port = EPHEMERAL_FIRST;
+
+/*
+ *  Connect      open a TCP connection to addr:port (client mode)
+ *
+ *  Opens the socket on a fresh local port, sets the destination and issues
+ *  CONNECT, then returns without waiting for the handshake.  The socket
+ *  stays in SYNSENT until it reaches ESTABLISHED (IR CON) or the chip
+ *  gives up and closes it (IR TIMEOUT); the caller watches the status
+ *  register.  Returns W5100_OK if the CONNECT was issued, else W5100_FAIL.
+ */
+unsigned char Connect(unsigned char sock, const unsigned char *addr,
+		      unsigned int port)
+{
+	unsigned int sockaddr;
+	unsigned char i;
+
+	if (OpenSocket(sock, W5100_SKT_MR_TCP, next_port) != sock)
+		return W5100_FAIL;
+	if (next_port == 0xFFFF)
+		next_port = EPHEMERAL_FIRST;	// last port; unsigned int is wider than 16 bits on the host
+	else
+		next_port++;
+
+	sockaddr = W5100_SKT_BASE(sock);	// calc base addr for this socket
+	for (i = 0; i < 4; i++)
+		W51_write(sockaddr + W5100_DIPR_OFFSET + i, addr[i]);	// destination IP
+	W51_write(sockaddr + W5100_DPORT_OFFSET, (port & 0xFF00) >> 8);	// destination port (MSB)
+	W51_write(sockaddr + W5100_DPORT_OFFSET + 1, (port & 0x00FF));	// LSB
+
+	SocketCommand(sock, W5100_SKT_CR_CONNECT);	// start the handshake
+	return W5100_OK;
+}
+
+/*
+ *  Read a socket's TX free size register.  It only counts a SEND once the
+ *  chip has taken it.
+ */
+static unsigned int TxFreeSize(unsigned char sock)
+{
+	CommandWait(sock);
+	tx_free[sock] = ReadStable(W5100_SKT_BASE(sock) + W5100_TX_FSR_OFFSET);
+	return tx_free[sock];
+}
+
+/*
+ *  SendBegin      start gathering data for one SEND
+ *
+ *  Returns the TX free size.  TX_FSR is read only if less than want bytes
+ *  are known to be free, so pass the size of the whole message; the result
+ *  may then be less than what is really free, but is at least want if
+ *  that much is.  The caller may queue up to the returned number of bytes,
+ *  in any number of pieces, with SendWrite and SendWrite_P, and send them
+ *  all as one SEND with SendCommit.
+ */
+unsigned int SendBegin(unsigned char sock, unsigned int want)
+{
+	if (sock >= W5100_NUM_SOCKETS)
+		return 0;	// illegal socket value is bad!
+	if (tx_free[sock] < want)
+		TxFreeSize(sock);
+#ifdef W5100_USE_TRACE
+	tx_begin[sock] = tx_wr[sock];
+#endif
+	return tx_free[sock];
+}
+
+/*
+ *  SendWrite      queue data after SendBegin
+ */
+void SendWrite(unsigned char sock, const unsigned char *buf,
+	       unsigned int buflen)
+{
+	if (sock >= W5100_NUM_SOCKETS)
+		return;
+	W51_write_block(sock, tx_wr[sock], buf, buflen);	// copy application data to TX buffer
+	tx_wr[sock] += buflen;	// next TX buffer addr
+	tx_free[sock] -= buflen;
+}
+
+/*
+ *  SendWrite_P      SendWrite for data in flash
+ */
+void SendWrite_P(unsigned char sock, const unsigned char *buf_P,
+		 unsigned int buflen)
+{
+	if (sock >= W5100_NUM_SOCKETS)
+		return;
+	W51_write_block_P(sock, tx_wr[sock], buf_P, buflen);	// copy straight from flash
+	tx_wr[sock] += buflen;
+	tx_free[sock] -= buflen;
+}
+
+/*
+ *  Move the TX write pointer past the queued data and issue cmd (SEND or
+ *  SEND_MAC).
+ */
+static void SendCommand(unsigned char sock, unsigned char cmd)
+{
+	unsigned int sockaddr;
+
+	if (sock >= W5100_NUM_SOCKETS)
+		return;
+	sockaddr = W5100_SKT_BASE(sock);	// calc base addr for this socket
+
+	CommandWait(sock);	// the previous SEND must have taken its TX_WR first
+	W51_write(sockaddr + W5100_TX_WR_OFFSET, (tx_wr[sock] & 0xFF00) >> 8);	// send MSB of new write-pointer addr
+	W51_write(sockaddr + W5100_TX_WR_OFFSET + 1, (tx_wr[sock] & 0x00FF));	// send LSB
+
+	TRACE(TRACE_TX, sock, tx_wr[sock] - tx_begin[sock]);
+	SocketCommand(sock, cmd);	// start the send on its way
+}
+
+/*
+ *  SendCommit      issue SEND for everything queued since SendBegin
+ */
+void SendCommit(unsigned char sock)
+{
+	SendCommand(sock, W5100_SKT_CR_SEND);
+}
+
+/*
+ *  Send      queue buflen bytes and send them, waiting for room if need be
+ *
+ *  Waits up to SOCKET_SEND_MS for the TX buffer to have room for all of
+ *  buf, reading TX_FSR at most once per clock_ms() tick meanwhile, and
+ *  disconnects the socket if it never does.  buflen must not exceed the
+ *  socket's TX buffer size.  Returns W5100_OK or W5100_FAIL.
+ */
+unsigned char Send(unsigned char sock, const unsigned char *buf,
+		   unsigned int buflen)
+{
+	unsigned int start;
+	unsigned int last;
+	unsigned int now;
+
+	if (buflen == 0 || sock >= W5100_NUM_SOCKETS)
+		return W5100_FAIL;	// ignore illegal requests
+
+	if (SendBegin(sock, buflen) < buflen) {
+		W51_COUNT(send_waits, 1);
+		start = last = clock_ms();
+		while (TxFreeSize(sock) < buflen) {
+			while ((now = clock_ms()) == last) ;	// no SPI traffic until the next tick
+			last = now;
+			if ((unsigned int)(now - start) >= SOCKET_SEND_MS)	// if max delay has passed...
+			{
+				W51_COUNT(send_timeouts, 1);
+				DisconnectSocket(sock);	// can't connect, close it down
+				return W5100_FAIL;	// show failure
+			}
+		}
+	}
+
+	SendBegin(sock, buflen);
+	SendWrite(sock, buf, buflen);
+	SendCommit(sock);
+	return W5100_OK;
+}
+
+/*
+ *  TrySend      queue as much data as fits right now, without waiting
+ *
+ *  Copies up to buflen bytes into the socket's TX buffer, limited by the
+ *  current TX free size, and issues SEND for them.  Returns the number of
+ *  bytes accepted, which may be 0; the caller resends the rest later (see
+ *  SendFreeSize).  Unlike Send, this never waits for buffer space and never
+ *  disconnects a slow peer, and buflen may exceed the TX buffer size.
+ */
+unsigned int TrySend(unsigned char sock, const unsigned char *buf,
+		     unsigned int buflen)
+{
+	unsigned int txsize;
+
+	if (buflen == 0 || sock >= W5100_NUM_SOCKETS)
+		return 0;	// ignore illegal requests
+	txsize = SendBegin(sock, buflen);
+	if (txsize == 0)
+		return 0;	// TX buffer full, try again later
+	if (buflen > txsize)
+		buflen = txsize;	// send what fits
+
+	SendWrite(sock, buf, buflen);
+	SendCommit(sock);
+	return buflen;
+}
+
+/*
+ *  TrySend_P      TrySend for data in flash
+ *
+ *  Same as TrySend, but buf_P is a PROGMEM address; the bytes go from flash
+ *  to the TX buffer without a RAM copy.  A response longer than the TX
+ *  buffer is sent by calling this again with the remainder as space frees.
+ */
+unsigned int TrySend_P(unsigned char sock, const unsigned char *buf_P,
+		       unsigned int buflen)
+{
+	unsigned int txsize;
+
+	if (buflen == 0 || sock >= W5100_NUM_SOCKETS)
+		return 0;	// ignore illegal requests
+	txsize = SendBegin(sock, buflen);
+	if (txsize == 0)
+		return 0;	// TX buffer full, try again later
+	if (buflen > txsize)
+		buflen = txsize;	// send what fits
+
+	SendWrite_P(sock, buf_P, buflen);
+	SendCommit(sock);
+	return buflen;
+}
+
+/*
+ *  SendFreeSize      how many bytes TrySend would accept right now
+ *
+ *  Returns 0 unless the socket is connected (ESTABLISHED, or CLOSE_WAIT
+ *  where the peer has closed its side but still reads ours).
+ */
+unsigned int SendFreeSize(unsigned char sock)
+{
+	unsigned int sockaddr;
+	unsigned char status;
+
+	if (sock >= W5100_NUM_SOCKETS)
+		return 0;
+	sockaddr = W5100_SKT_BASE(sock);	// calc base addr for this socket
+	status = W51_read(sockaddr + W5100_SR_OFFSET);
+	if (status != W5100_SKT_SR_ESTABLISHED && status != W5100_SKT_SR_CLOSE_WAIT)
+		return 0;
+	return TxFreeSize(sock);
+}
+
+/*
+ *  Move the RX read pointer to offaddr and issue RECV, releasing the
+ *  buffer space before it to the chip.
+ */
+static void RecvCommand(unsigned char sock, unsigned int offaddr)
+{
+	unsigned int sockaddr;
+	unsigned int used;
+
+	used = offaddr - rx_rd[sock];
+	rx_ready[sock] = (rx_ready[sock] > used) ? rx_ready[sock] - used : 0;
+	rx_rd[sock] = offaddr;
+	sockaddr = W5100_SKT_BASE(sock);	// calc base addr for this socket
+	CommandWait(sock);	// the previous RECV must have taken its RX_RD first
+	W51_write(sockaddr + W5100_RX_RD_OFFSET, (offaddr & 0xFF00) >> 8);	// update RX read offset (MSB)
+	W51_write(sockaddr + W5100_RX_RD_OFFSET + 1, (offaddr & 0x00FF));	// update LSB
+	SocketCommand(sock, W5100_SKT_CR_RECV);	// issue the receive command
+}
+
+/*
+ *  Bytes waiting in the RX buffer, reading RX_RSR only if less than need
+ *  are known to be there.
+ */
+static unsigned int RxWaiting(unsigned char sock, unsigned int need)
+{
+	if (sock >= W5100_NUM_SOCKETS)
+		return 0;
+	if (rx_ready[sock] < need)
+		return ReceivedSize(sock);
+	return rx_ready[sock];
+}
+
+unsigned int Receive(unsigned char sock, unsigned char *buf,
+		     unsigned int buflen)
+{
+	unsigned int offaddr;
+
+	if (buflen == 0 || sock >= W5100_NUM_SOCKETS)
+		return W5100_FAIL;	// ignore illegal conditions
+
+	if (buflen > (MAX_BUF - 2))
+		buflen = MAX_BUF - 2;	// requests that exceed the max are truncated
+
+	offaddr = rx_rd[sock];	// where the last RECV left off
+
+	W51_read_block(sock, offaddr, buf, buflen);	// copy data out of RX buffer
+	offaddr += buflen;
+	buf[buflen] = '\0';	// buffer read is complete, terminate the str
+
+	TRACE(TRACE_RX, sock, buflen);
+	RecvCommand(sock, offaddr);	// release what was read
+
+	return W5100_OK;
+}
+
+/*
+ *  ReceiveStream      feed received data straight from the RX buffer to a consumer
+ *
+ *  Hands the bytes waiting at the socket's RX read pointer to consume(ctx, c),
+ *  one at a time, until they run out or the consumer returns 0.  The read
+ *  pointer is then advanced past the bytes handed over and RECV is issued
+ *  once.  Bytes the consumer did not get stay in the RX buffer for the next
+ *  call.  Returns the number of bytes consumed (0 if nothing was waiting).
+ */
+unsigned int ReceiveStream(unsigned char sock,
+			   unsigned char (*consume)(void *ctx, unsigned char c),
+			   void *ctx)
+{
+	unsigned int offaddr;
+	unsigned int rsize;
+	unsigned int used;
+
+	rsize = RxWaiting(sock, 1);
+	if (rsize == 0)
+		return 0;	// nothing waiting (or illegal socket)
+
+	offaddr = rx_rd[sock];	// where the last RECV left off
+
+	used = W51_read_stream(sock, offaddr, rsize, consume, ctx);
+	offaddr += used;
+
+	TRACE(TRACE_RX, sock, used);
+	RecvCommand(sock, offaddr);	// release what was read
+
+	return used;
+}
+
+/*
+ *  ReceiveDiscard      drop whatever is waiting in the RX buffer
+ *
+ *  Moves the read pointer past it and issues RECV without reading the
+ *  data out of the chip.  Returns the number of bytes dropped.
+ */
+unsigned int ReceiveDiscard(unsigned char sock)
+{
+	unsigned int rsize;
+
+	rsize = RxWaiting(sock, 1);
+	if (rsize == 0)
+		return 0;	// nothing waiting (or illegal socket)
+
+	TRACE(TRACE_RX, sock, rsize);
+	RecvCommand(sock, rx_rd[sock] + rsize);	// release it unread
+
+	return rsize;
+}
+
+unsigned int ReceivedSize(unsigned char sock)
+{
+	if (sock >= W5100_NUM_SOCKETS)
+		return 0;
+	CommandWait(sock);	// RSR only counts a RECV once the chip has taken it
+	rx_ready[sock] = ReadStable(W5100_SKT_BASE(sock) + W5100_RX_RSR_OFFSET);
+	return rx_ready[sock];
+}
+
+/*
+ *  SendTo      queue one UDP datagram for addr:port and send it
+ *
+ *  The socket must be open in UDP mode.  The chip takes one datagram at
+ *  a time: until the previous one has gone out (TX buffer empty again),
+ *  nothing is sent and 0 is returned, so the caller can try again or drop
+ *  the sample.  Returns buflen once the datagram has been handed to the
+ *  chip.  buflen must not exceed UDP_MAX or the socket's TX buffer size.
+ */
+unsigned int SendTo(unsigned char sock, const unsigned char *buf,
+		    unsigned int buflen, const unsigned char *addr,
+		    unsigned int port)
+{
+	unsigned int sockaddr;
+	unsigned char i;
+
+	if (buflen == 0 || buflen > UDP_MAX || sock >= W5100_NUM_SOCKETS)
+		return 0;	// ignore illegal requests
+	sockaddr = W5100_SKT_BASE(sock);	// calc base addr for this socket
+	if (W51_read(sockaddr + W5100_SR_OFFSET) != W5100_SKT_SR_UDP)
+		return 0;	// not a UDP socket
+	if (SendBegin(sock, W51_tx_size(sock)) != W51_tx_size(sock) || buflen > W51_tx_size(sock))
+		return 0;	// previous datagram still going out, try again later
+
+	for (i = 0; i < 4; i++)
+		W51_write(sockaddr + W5100_DIPR_OFFSET + i, addr[i]);	// destination IP
+	W51_write(sockaddr + W5100_DPORT_OFFSET, (port & 0xFF00) >> 8);	// destination port (MSB)
+	W51_write(sockaddr + W5100_DPORT_OFFSET + 1, (port & 0x00FF));	// LSB
+
+	SendWrite(sock, buf, buflen);
+	SendCommit(sock);	// one SEND is one datagram
+	return buflen;
+}
+
+/*
+ *  ReceiveFrom      take the next UDP datagram out of the RX buffer
+ *
+ *  The chip stores each datagram behind an 8-byte header: the sender's
+ *  IP address (4 bytes), its port and the data length (2 bytes each, MSB
+ *  first).  If a datagram is waiting, up to buflen bytes of it are copied
+ *  to buf, the sender is stored in addr (4 bytes) and *port, and the
+ *  whole datagram is released; bytes past buflen are dropped.  Returns
+ *  the number of bytes copied, 0 if nothing was waiting.
+ */
+unsigned int ReceiveFrom(unsigned char sock, unsigned char *buf,
+			 unsigned int buflen, unsigned char *addr,
+			 unsigned int *port)
+{
+	unsigned char hdr[UDP_HDR_LEN];
+	unsigned int offaddr;
+	unsigned int size;
+
+	if (RxWaiting(sock, UDP_HDR_LEN) < UDP_HDR_LEN)
+		return 0;	// nothing waiting (or illegal socket)
+
+	offaddr = rx_rd[sock];	// where the last RECV left off
+
+	W51_read_block(sock, offaddr, hdr, UDP_HDR_LEN);	// peer header
+	offaddr += UDP_HDR_LEN;
+	addr[0] = hdr[0];
+	addr[1] = hdr[1];
+	addr[2] = hdr[2];
+	addr[3] = hdr[3];
+	*port = (hdr[4] << 8) + hdr[5];
+	size = (hdr[6] << 8) + hdr[7];
+
+	if (buflen > size)
+		buflen = size;
+	W51_read_block(sock, offaddr, buf, buflen);	// copy data out of RX buffer
+	offaddr += size;	// skip whatever did not fit
+
+	TRACE(TRACE_RX, sock, size);
+	RecvCommand(sock, offaddr);	// release what was read
+
+	return buflen;
+}
+
+/*
+ *  OpenMulticast      open a UDP socket that is a member of a multicast group
+ *
+ *  Sets the group's MAC address (01:00:5e and the low 23 bits of the group
+ *  address), the group address and port as the socket's destination, then
+ *  opens the socket in UDP multicast mode; the chip sends the IGMP join
+ *  itself and leaves the group when the socket is closed.  Datagrams sent
+ *  to the group arrive through ReceiveFrom; Publish sends to the group.
+ *  Returns the socket number, or W5100_FAIL.
+ */
+unsigned char OpenMulticast(unsigned char sock, const unsigned char *group,
+			    unsigned int port)
+{
+	unsigned int sockaddr;
+	unsigned char i;
+
+	if (sock >= W5100_NUM_SOCKETS || (group[0] & 0xF0) != 0xE0)
+		return W5100_FAIL;	// not a socket, or not a multicast address
+	sockaddr = W5100_SKT_BASE(sock);	// calc base addr for this socket
+
+	W51_write(sockaddr + W5100_DHAR_OFFSET, 0x01);	// IPv4 multicast MAC prefix
+	W51_write(sockaddr + W5100_DHAR_OFFSET + 1, 0x00);
+	W51_write(sockaddr + W5100_DHAR_OFFSET + 2, 0x5E);
+	W51_write(sockaddr + W5100_DHAR_OFFSET + 3, group[1] & 0x7F);
+	W51_write(sockaddr + W5100_DHAR_OFFSET + 4, group[2]);
+	W51_write(sockaddr + W5100_DHAR_OFFSET + 5, group[3]);
+	for (i = 0; i < 4; i++)
+		W51_write(sockaddr + W5100_DIPR_OFFSET + i, group[i]);	// group address
+	W51_write(sockaddr + W5100_DPORT_OFFSET, (port & 0xFF00) >> 8);	// group port (MSB)
+	W51_write(sockaddr + W5100_DPORT_OFFSET + 1, (port & 0x00FF));	// LSB
+
+	return OpenSocket(sock, W5100_SKT_MR_UDP | W5100_SKT_MR_MULTI, port);
+}
+
+/*
+ *  Publish      send one datagram to the group of a multicast socket
+ *
+ *  Like SendTo, but the destination stays as OpenMulticast set it, and
+ *  SEND_MAC uses the group MAC address directly, so there is no ARP and
+ *  no per-datagram destination setup.  Every member of the group gets the
+ *  one datagram.  Returns buflen, or 0 if the previous datagram is still
+ *  going out.
+ */
+unsigned int Publish(unsigned char sock, const unsigned char *buf,
+		     unsigned int buflen)
+{
+	if (buflen == 0 || buflen > UDP_MAX || sock >= W5100_NUM_SOCKETS)
+		return 0;	// ignore illegal requests
+	if (W51_read(W5100_SKT_BASE(sock) + W5100_SR_OFFSET) != W5100_SKT_SR_UDP)
+		return 0;	// not a UDP socket
+	if (SendBegin(sock, W51_tx_size(sock)) != W51_tx_size(sock) || buflen > W51_tx_size(sock))
+		return 0;	// previous datagram still going out, try again later
+
+	SendWrite(sock, buf, buflen);
+	SendCommand(sock, W5100_SKT_CR_SEND_MAC);
+	return buflen;
+}
+
+/*
+ *  OpenMacRaw      open socket 0 in MACRAW mode
+ *
+ *  Only socket 0 can do MACRAW; it must not be in use by anything else.
+ *  The socket then sends and receives whole Ethernet frames (destination
+ *  MAC, source MAC, type, payload; no preamble or CRC) and the chip's
+ *  TCP/IP engine is bypassed for them.  With mac_filter set, only frames
+ *  for our own MAC address, broadcasts and multicasts are received.
+ *  Returns MACRAW_SOCKET, or W5100_FAIL.
+ */
+unsigned char OpenMacRaw(unsigned char mac_filter)
+{
+	return OpenSocket(MACRAW_SOCKET,
+			  W5100_SKT_MR_MACRAW | (mac_filter ? W5100_SKT_MR_MF : 0), 0);
+}
+
+/*
+ *  SendFrame      queue one raw Ethernet frame and send it
+ *
+ *  Same rules as SendTo: the frame is sent whole, and 0 is returned while
+ *  the previous frame is still going out.  len must be at least
+ *  MACRAW_HDR_LEN (the 14-byte Ethernet header) and at most MACRAW_MAX.
+ *  Returns len once the frame has been handed to the chip.
+ */
+unsigned int SendFrame(const unsigned char *frame, unsigned int len)
+{
+	if (len < MACRAW_HDR_LEN || len > MACRAW_MAX)
+		return 0;	// ignore illegal requests
+	if (W51_read(W5100_SKT_BASE(MACRAW_SOCKET) + W5100_SR_OFFSET) != W5100_SKT_SR_MACRAW)
+		return 0;	// not open in MACRAW mode
+	if (SendBegin(MACRAW_SOCKET, W51_tx_size(MACRAW_SOCKET)) != W51_tx_size(MACRAW_SOCKET) || len > W51_tx_size(MACRAW_SOCKET))
+		return 0;	// previous frame still going out, try again later
+
+	SendWrite(MACRAW_SOCKET, frame, len);
+	SendCommit(MACRAW_SOCKET);
+	return len;
+}
+
+/*
+ *  ReceiveFrame      take the next raw Ethernet frame out of the RX buffer
+ *
+ *  In MACRAW mode the chip stores each frame behind a 2-byte length (MSB
+ *  first) that counts the length bytes too.  Up to buflen bytes of the
+ *  frame are copied to buf and the whole frame is released, so a small
+ *  fixed buffer is enough to look at headers; the rest of a longer frame
+ *  is dropped.  Returns the number of bytes copied, 0 if no frame was
+ *  waiting.
+ */
+unsigned int ReceiveFrame(unsigned char *buf, unsigned int buflen)
+{
+	unsigned char hdr[MACRAW_INFO_LEN];
+	unsigned int offaddr;
+	unsigned int size;
+
+	if (RxWaiting(MACRAW_SOCKET, MACRAW_INFO_LEN) < MACRAW_INFO_LEN)
+		return 0;	// nothing waiting
+
+	offaddr = rx_rd[MACRAW_SOCKET];	// where the last RECV left off
+
+	W51_read_block(MACRAW_SOCKET, offaddr, hdr, MACRAW_INFO_LEN);	// frame length
+	size = ((hdr[0] << 8) + hdr[1]);
+	if (size < MACRAW_INFO_LEN)
+		size = MACRAW_INFO_LEN;	// never seen, but do not go backwards
+	offaddr += MACRAW_INFO_LEN;
+	size -= MACRAW_INFO_LEN;
+
+	if (buflen > size)
+		buflen = size;
+	W51_read_block(MACRAW_SOCKET, offaddr, buf, buflen);	// copy the frame out of RX buffer
+	offaddr += size;	// skip whatever did not fit
+
+	TRACE(TRACE_RX, MACRAW_SOCKET, size);
+	RecvCommand(MACRAW_SOCKET, offaddr);	// release what was read
+
+	return buflen;
+}
+
+/*
+ *  PollSockets      snapshot the sockets in mask and bring this layer up to date
+ *
+ *  Reads every socket in mask in one pass (W51_poll_all) into st[], which
+ *  has room for W5100_NUM_SOCKETS entries; with clear set, the interrupt
+ *  bits are read and cleared on the way.  CR is only read for sockets
+ *  with a command pending; one the snapshot shows taken is finished here,
+ *  so CommandStatus costs nothing afterward.  For a socket with no command
+ *  in CR, the sizes read raise the known free and received sizes, so
+ *  SendBegin and the receive calls do not read them again unless they
+ *  need more than the snapshot saw.
+ */
+void PollSockets(unsigned char mask, unsigned char clear,
+		 W5100_SKT_STATUS *st)
+{
+	unsigned char sock;
+
+	W51_poll_all(mask, cmd_pending, clear, st);
+	for (sock = 0; sock < W5100_NUM_SOCKETS; sock++) {
+		if (!(mask & (1 << sock)))
+			continue;
+		TRACE_SR_READ(sock, st[sock].sr);
+		if (st[sock].cr)
+			continue;	// sizes do not count that command yet
+		if (cmd_pending & (1 << sock)) {
+			cmd_pending &= ~(1 << sock);
+			TRACE(TRACE_CMD_DONE, sock, 0);
+		}
+		if (st[sock].tx_fsr > tx_free[sock])
+			tx_free[sock] = st[sock].tx_fsr;
+		if (st[sock].rx_rsr > rx_ready[sock])
+			rx_ready[sock] = st[sock].rx_rsr;
+	}
+}
@@ -0,0 +1,51 @@
+#ifndef SOCKETH
+#define SOCKETH
+
+#define MAX_BUF         256	/* largest buffer we can read from chip */
+
+#define SOCKET_CMD_MS   5	/* deadline for the chip to take a socket command */
+#define SOCKET_SEND_MS  1000	/* deadline for Send() to find room in the TX buffer */
+
+/* CommandStatus() results */
+#define SOCKET_CMD_DONE     0	/* taken (or none pending) */
+#define SOCKET_CMD_BUSY     1	/* still in CR */
+#define SOCKET_CMD_TIMEOUT  2	/* not taken by the deadline */
+
+#define UDP_MAX         1472	/* largest datagram SendTo will send (Ethernet MTU less IP and UDP headers) */
+#define UDP_HDR_LEN     8	/* header the chip puts before each received datagram */
+
+#define MACRAW_SOCKET   0	/* only socket 0 can be opened in MACRAW mode */
+#define MACRAW_HDR_LEN  14	/* Ethernet header: destination, source, type */
+#define MACRAW_MAX      1514	/* largest frame SendFrame will send (no CRC) */
+#define MACRAW_INFO_LEN 2	/* length the chip puts before each received frame */
+
+unsigned char CommandStatus(unsigned char  sock);
+unsigned char CommandWait(unsigned char  sock);
+unsigned char SocketCommand(unsigned char  sock, unsigned char  cmd);
+unsigned char OpenSocket(unsigned char  sock, unsigned char  eth_protocol, unsigned int  tcp_port);
+void CloseSocket(unsigned char  sock);
+void DisconnectSocket(unsigned char  sock);
+unsigned char Listen(unsigned char  sock);
+unsigned char Connect(unsigned char  sock, const unsigned char  *addr, unsigned int  port);
+unsigned int SendBegin(unsigned char  sock, unsigned int  want);
+void SendWrite(unsigned char  sock, const unsigned char  *buf, unsigned int  buflen);
+void SendWrite_P(unsigned char  sock, const unsigned char  *buf_P, unsigned int  buflen);
+void SendCommit(unsigned char  sock);
+unsigned char Send(unsigned char  sock, const unsigned char  *buf, unsigned int  buflen);
+unsigned int TrySend(unsigned char  sock, const unsigned char  *buf, unsigned int  buflen);
+unsigned int TrySend_P(unsigned char  sock, const unsigned char  *buf_P, unsigned int  buflen);
+unsigned int SendFreeSize(unsigned char  sock);
+unsigned int Receive(unsigned char  sock, unsigned char  *buf, unsigned int  buflen);
+unsigned int ReceiveStream(unsigned char  sock, unsigned char  (*consume)(void  *ctx, unsigned char  c), void  *ctx);
+unsigned int ReceiveDiscard(unsigned char  sock);
+unsigned int ReceivedSize(unsigned char  sock);
+unsigned int SendTo(unsigned char  sock, const unsigned char  *buf, unsigned int  buflen, const unsigned char  *addr, unsigned int  port);
+unsigned int ReceiveFrom(unsigned char  sock, unsigned char  *buf, unsigned int  buflen, unsigned char  *addr, unsigned int  *port);
+unsigned char OpenMulticast(unsigned char  sock, const unsigned char  *group, unsigned int  port);
+unsigned int Publish(unsigned char  sock, const unsigned char  *buf, unsigned int  buflen);
+unsigned char OpenMacRaw(unsigned char  mac_filter);
+unsigned int SendFrame(const unsigned char  *frame, unsigned int  len);
+unsigned int ReceiveFrame(unsigned char  *buf, unsigned int  buflen);
+void PollSockets(unsigned char  mask, unsigned char  clear, W5100_SKT_STATUS  *st);
+
+#endif
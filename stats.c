@@ -0,0 +1,92 @@
+/*      stats.c      text dump of the performance counters
+ *
+ *      One "name value" line per counter, then one line per socket.  The
+ *      same lines go to the /stats page (httpd.c) and to the UART
+ *      (avrethernet.c).  Empty unless built with W5100_USE_STATS.
+*/
+
+#include <stdio.h>
+#include <string.h>
+#include <avr/pgmspace.h>
+#include "w5100.h"
+#include "stats.h"
+
+#ifdef W5100_USE_STATS
+
+#define LINES_BEFORE_SOCKETS	8
+#define LINES	(LINES_BEFORE_SOCKETS + W5100_NUM_SOCKETS)
+
+/*
+ *  Format line i of the dump into buf.  Returns its length, which is 0 for
+ *  a line this build leaves out.  The counters are read as they stand; no
+ *  snapshot.
+ */
+static unsigned char stats_line(unsigned char i, char *buf)
+{
+	W5100_STATS *st = &W51_stats;
+
+	switch (i) {
+	case 0:
+		return snprintf_P(buf, STATS_LINE_MAX, PSTR("spi_reads %lu\n"), st->spi_reads);
+	case 1:
+		return snprintf_P(buf, STATS_LINE_MAX, PSTR("spi_writes %lu\n"), st->spi_writes);
+	case 2:
+#ifdef W5100_STATS_CYCLES
+		return snprintf_P(buf, STATS_LINE_MAX, PSTR("spi_cycles %lu\n"), st->spi_cycles);
+#else
+		return 0;	// not timed in this build
+#endif
+	case 3:
+		return snprintf_P(buf, STATS_LINE_MAX, PSTR("cmd_waits %lu\n"), st->cmd_waits);
+	case 4:
+		return snprintf_P(buf, STATS_LINE_MAX, PSTR("cmd_timeouts %u\n"), st->cmd_timeouts);
+	case 5:
+		return snprintf_P(buf, STATS_LINE_MAX, PSTR("send_waits %lu\n"), st->send_waits);
+	case 6:
+		return snprintf_P(buf, STATS_LINE_MAX, PSTR("send_timeouts %u\n"), st->send_timeouts);
+	case 7:
+		return snprintf_P(buf, STATS_LINE_MAX, PSTR("connections %lu\n"), st->connections);
+	}
+	i -= LINES_BEFORE_SOCKETS;
+	return snprintf_P(buf, STATS_LINE_MAX, PSTR("socket%u rx %lu tx %lu\n"),
+			  i, st->rx_bytes[i], st->tx_bytes[i]);
+}
+
+/*
+ *  stats_format      the whole dump into buf
+ *
+ *  Returns its length.  Stops at a line that would not fit.
+ */
+unsigned int stats_format(char *buf, unsigned int len)
+{
+	char line[STATS_LINE_MAX];
+	unsigned int n;
+	unsigned char i;
+	unsigned char l;
+
+	n = 0;
+	for (i = 0; i < LINES; i++) {
+		l = stats_line(i, line);
+		if (n + l >= len)
+			break;
+		memcpy(buf + n, line, l);
+		n += l;
+	}
+	buf[n] = '\0';
+	return n;
+}
+
+/*
+ *  stats_print      the whole dump to stdout, a line at a time
+ */
+void stats_print(void)
+{
+	char line[STATS_LINE_MAX];
+	unsigned char i;
+
+	for (i = 0; i < LINES; i++)
+		if (stats_line(i, line))
+			fputs(line, stdout);
+}
+
+#endif
@@ -0,0 +1,10 @@
+#ifndef STATSH
+#define STATSH
+
+#define STATS_LINE_MAX	40	/* longest line of the dump, NUL included */
+#define STATS_TEXT_MAX	384	/* room for the whole dump */
+
+unsigned int stats_format(char  *buf, unsigned int  len);
+void stats_print(void);
+
+#endif
@@ -0,0 +1,125 @@
+/*      trace.c      binary event trace in a RAM ring
+ *
+ *      Target-independent.  Events are recorded from the main loop only,
+ *      never from an interrupt, so the ring needs no locking.  Recording one
+ *      costs a clock read and six stores; all formatting is left to
+ *      host/tracedump.  When the ring is full new events are counted
+ *      rather than stored, and a TRACE_LOST event with the count goes in as
+ *      soon as there is room again.  Empty unless built with W5100_USE_TRACE.
+*/
+
+#include "w5100.h"
+#include "clock.h"
+#include "trace.h"
+
+#ifdef W5100_USE_TRACE
+
+#define MASK	(TRACE_EVENTS - 1)
+
+typedef struct trace_event_t {
+	unsigned int ms;
+	unsigned char tick;
+	unsigned char code;	/* type << 2 | socket */
+	unsigned int arg;
+} TRACE_EVENT;
+
+static TRACE_EVENT ring[TRACE_EVENTS];
+static unsigned char head;	/* next free slot */
+static unsigned char tail;	/* next to flush */
+static unsigned int lost;
+static unsigned char last_sr[W5100_NUM_SOCKETS];
+
+static void trace_store(unsigned char type, unsigned char sock, unsigned int arg)
+{
+	TRACE_EVENT *e;
+
+	e = &ring[head];
+	e->ms = clock_ms_tick(&e->tick);
+	e->code = (type << 2) | (sock & 3);
+	e->arg = arg;
+	head = (head + 1) & MASK;
+}
+
+/*
+ *  trace_init      empty the ring and record TRACE_START
+ */
+void trace_init(void)
+{
+	unsigned char i;
+
+	head = tail = 0;
+	lost = 0;
+	for (i = 0; i < W5100_NUM_SOCKETS; i++)
+		last_sr[i] = 0xff;	// not a status, so the first read is recorded
+	trace_store(TRACE_START, 0, CLOCK_TICKS_PER_MS);
+}
+
+/*
+ *  trace_event      record one event
+ */
+void trace_event(unsigned char type, unsigned char sock, unsigned int arg)
+{
+	unsigned char room;
+
+	room = (tail - head - 1) & MASK;
+	if (room < (lost ? 2 : 1)) {
+		if (lost != 0xffff)
+			lost++;
+		return;
+	}
+	if (lost) {
+		trace_store(TRACE_LOST, 0, lost);	// marks where the gap is
+		lost = 0;
+	}
+	trace_store(type, sock, arg);
+}
+
+/*
+ *  trace_sr      record a status register read if it differs from the last one
+ *
+ *  The servers read SR on every pass; this keeps only the transitions.
+ */
+void trace_sr(unsigned char sock, unsigned char sr)
+{
+	if (sock >= W5100_NUM_SOCKETS || last_sr[sock] == sr)
+		return;
+	last_sr[sock] = sr;
+	trace_event(TRACE_SR, sock, sr);
+}
+
+/*
+ *  trace_flush      hand recorded events to put(), one frame at a time
+ *
+ *  put() returns nonzero if it took the whole frame, 0 if it has no room;
+ *  flushing stops there and the rest waits for the next call.  Returns the
+ *  number of events flushed.
+ */
+unsigned char trace_flush(unsigned char (*put)(const unsigned char *frame, unsigned char len))
+{
+	unsigned char frame[TRACE_FRAME_LEN];
+	TRACE_EVENT *e;
+	unsigned char n;
+	unsigned char i;
+
+	n = 0;
+	while (tail != head) {
+		e = &ring[tail];
+		frame[0] = TRACE_SYNC;
+		frame[1] = e->ms & 0xff;
+		frame[2] = e->ms >> 8;
+		frame[3] = e->tick;
+		frame[4] = e->code;
+		frame[5] = e->arg & 0xff;
+		frame[6] = e->arg >> 8;
+		frame[7] = 0;
+		for (i = 1; i < TRACE_FRAME_LEN - 1; i++)
+			frame[7] += frame[i];
+		if (!put(frame, TRACE_FRAME_LEN))
+			break;
+		tail = (tail + 1) & MASK;
+		n++;
+	}
+	return n;
+}
+
+#endif
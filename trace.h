@@ -0,0 +1,50 @@
+#ifndef TRACEH
+#define TRACEH
+
+/*
+ *  Binary event trace.  With W5100_USE_TRACE defined, TRACE() records a
+ *  fixed-size event, time-stamped from clock_ms_tick(), in a RAM ring, and
+ *  trace_flush() streams the ring out in TRACE_FRAME_LEN-byte frames.
+ *  host/tracedump turns the stream back into a timeline.  Without it TRACE()
+ *  compiles to nothing.
+ *
+ *  Frame on the wire, multi-byte fields LSB first:
+ *
+ *      0       TRACE_SYNC
+ *      1-2     clock_ms()
+ *      3       CLOCK_TICKS_PER_MS ticks into that millisecond
+ *      4       type << 2 | socket
+ *      5-6     argument
+ *      7       sum of bytes 1-6, mod 256
+ */
+
+#ifndef TRACE_EVENTS
+#define TRACE_EVENTS	32	/* ring size, a power of two up to 256 */
+#endif
+#define TRACE_SYNC	0xA5
+#define TRACE_FRAME_LEN	8
+
+/* event types, and what the argument holds */
+#define TRACE_START	0	/* trace_init(); CLOCK_TICKS_PER_MS */
+#define TRACE_LOST	1	/* events dropped because the ring was full */
+#define TRACE_SR	2	/* socket status changed; new SR */
+#define TRACE_CMD	3	/* command written to CR; the command */
+#define TRACE_CMD_DONE	4	/* CR seen clear; 0 */
+#define TRACE_CMD_TIMEOUT 5	/* CR not clear by the deadline; 0 */
+#define TRACE_RX	6	/* bytes released from the RX buffer */
+#define TRACE_TX	7	/* bytes handed to SEND */
+
+#ifdef W5100_USE_TRACE
+#define TRACE(type, sock, arg)	trace_event((type), (sock), (arg))
+#define TRACE_SR_READ(sock, sr)	trace_sr((sock), (sr))
+#else
+#define TRACE(type, sock, arg)	do { } while (0)
+#define TRACE_SR_READ(sock, sr)	do { } while (0)
+#endif
+
+void trace_init(void);
+void trace_event(unsigned char  type, unsigned char  sock, unsigned int  arg);
+void trace_sr(unsigned char  sock, unsigned char  sr);
+unsigned char trace_flush(unsigned char  (*put)(const unsigned char  *frame, unsigned char  len));
+
+#endif
@@ -1,26 +1,148 @@
-#define SPEED 9600
+/*      uart.c      interrupt-driven USART0 for debug output
+ *
+ *      Characters go through ring buffers in both directions.  uart_putchar()
+ *      only queues a character; the data-register-empty interrupt sends it.
+ *      The receive interrupt fills the RX ring, so uart_kbhit() and
+ *      uart_getchar() never look at the USART themselves.
+ *
+ *      When the TX ring is full, uart_putchar() either waits for room
+ *      (UART_TX_BLOCK) or drops the character (UART_TX_DROP), as set by
+ *      uart_tx_policy().  With interrupts off it always waits, sending from
+ *      the ring itself so it cannot hang.  Interrupts must be enabled (sei)
+ *      for output to go out otherwise.
+*/
 
 #include <avr/io.h>
+#include <avr/interrupt.h>
 #include <stdio.h>
 #include "uart.h"
 
 /* For ATMEga168 ONLY. you need to adapt it to other AVR CPUs   */
 
+#define TX_MASK		(UART_TX_SIZE - 1)
+#define RX_MASK		(UART_RX_SIZE - 1)
+
+static char tx_buf[UART_TX_SIZE];
+static volatile unsigned char tx_head;	/* next free slot; written by uart_putchar() only */
+static volatile unsigned char tx_tail;	/* next to send; written by the UDRE ISR */
+static char rx_buf[UART_RX_SIZE];
+static volatile unsigned char rx_head;	/* written by the RX ISR only */
+static volatile unsigned char rx_tail;
+static unsigned char tx_policy = UART_TX_BLOCK;
+static volatile unsigned int tx_dropped;
+
+ISR(USART_UDRE_vect)
+{
+	if (tx_tail == tx_head) {
+		UCSR0B &= ~(1 << UDRIE0);	// ring empty, stop until uart_putchar() queues more
+		return;
+	}
+	UDR0 = tx_buf[tx_tail];
+	tx_tail = (tx_tail + 1) & TX_MASK;
+}
+
+ISR(USART_RX_vect)
+{
+	unsigned char c;
+	unsigned char next;
+
+	c = UDR0;		// always read, or the interrupt fires again
+	next = (rx_head + 1) & RX_MASK;
+	if (next != rx_tail) {	// ring full: the character is lost
+		rx_buf[rx_head] = c;
+		rx_head = next;
+	}
+}
+
 void uart_init(void)
 {
 	unsigned int bittimer;
 
-	bittimer = (F_CPU / SPEED / 16) - 1;
+	bittimer = (F_CPU + 4UL * UART_BAUD) / (8UL * UART_BAUD) - 1;	// double speed, rounded
 
 	/* Set the baud rate */
 	UBRR0H = (unsigned char)(bittimer >> 8);
 	UBRR0L = (unsigned char)bittimer;
+	UCSR0A = (1 << U2X0);
 
 	/* set the framing to 8N1 */
 	UCSR0C = (1 << UCSZ01) | (1 << UCSZ00);
 
-	/* Enable Rx & Tx */
-	UCSR0B = (1 << RXEN0) | (1 << TXEN0);
+	/* Enable Rx & Tx, and the RX interrupt; UDRIE0 is set when there is output */
+	UCSR0B = (1 << RXCIE0) | (1 << RXEN0) | (1 << TXEN0);
+}
+
+/*
+ *  uart_tx_policy      choose what uart_putchar() does when the TX ring is full
+ *
+ *  UART_TX_BLOCK waits for room, so nothing is lost; UART_TX_DROP throws
+ *  the character away (see uart_dropped()), so logging never holds up the
+ *  caller.  Returns the policy in force before.
+ */
+unsigned char uart_tx_policy(unsigned char policy)
+{
+	unsigned char old;
+
+	old = tx_policy;
+	tx_policy = policy;
+	return old;
+}
+
+/*
+ *  uart_dropped      number of characters UART_TX_DROP has thrown away
+ */
+unsigned int uart_dropped(void)
+{
+	unsigned int n;
+	unsigned char sreg;
+
+	sreg = SREG;
+	cli();
+	n = tx_dropped;
+	SREG = sreg;
+	return n;
+}
+
+static void uart_queue(char c)
+{
+	unsigned char next;
+
+	next = (tx_head + 1) & TX_MASK;
+	while (next == tx_tail) {	// ring full
+		if (!(SREG & (1 << SREG_I))) {	// the ISR can't run, so send from here
+			if (UCSR0A & (1 << UDRE0)) {
+				UDR0 = tx_buf[tx_tail];
+				tx_tail = (tx_tail + 1) & TX_MASK;
+			}
+		} else if (tx_policy == UART_TX_DROP) {
+			tx_dropped++;
+			return;
+		}
+	}
+	tx_buf[tx_head] = c;
+	tx_head = next;
+	UCSR0B |= (1 << UDRIE0);	// the ISR only clears this once the ring is empty, which it isn't now
+}
+
+/*
+ *  uart_write      queue raw bytes, all of them or none
+ *
+ *  No newline translation and no waiting: returns 0 if the TX ring does
+ *  not have room for all len bytes, nonzero once they are queued.  For
+ *  binary output such as trace frames (trace_flush()).
+ */
+unsigned char uart_write(const unsigned char *buf, unsigned char len)
+{
+	unsigned char i;
+
+	if (((tx_tail - tx_head - 1) & TX_MASK) < len)
+		return 0;
+	for (i = 0; i < len; i++) {
+		tx_buf[tx_head] = buf[i];
+		tx_head = (tx_head + 1) & TX_MASK;
+	}
+	UCSR0B |= (1 << UDRIE0);
+	return 1;
 }
 
 int uart_putchar(char c, FILE * stream)
@@ -31,9 +153,8 @@ int uart_putchar(char c, FILE * stream)
 	}
 
 	if (c == '\n')
-		uart_putchar('\r', stream);
-	while (!(UCSR0A & (1 << UDRE0))) ;
-	UDR0 = c;
+		uart_queue('\r');
+	uart_queue(c);
 
 	return 0;
 }
@@ -41,8 +162,9 @@ int uart_putchar(char c, FILE * stream)
 int uart_getchar(FILE * stream)
 {
 	unsigned char ch;
-	while (!(UCSR0A & (1 << RXC0))) ;
-	ch = UDR0;
+	while (rx_head == rx_tail) ;
+	ch = rx_buf[rx_tail];
+	rx_tail = (rx_tail + 1) & RX_MASK;
 
 	/* Echo the Output Back to terminal */
 	uart_putchar(ch, stream);
@@ -52,10 +174,6 @@ int uart_getchar(FILE * stream)
 
 unsigned char uart_kbhit(void)
 {
-	//return nonzero if char is waiting (polled version)
-	unsigned char b;
-	b = 0;
-	if (UCSR0A & (1 << RXC0))
-		b = 1;
-	return b;
+	//return nonzero if char is waiting
+	return rx_head != rx_tail;
 }
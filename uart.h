@@ -1,7 +1,21 @@
 #ifndef UART_H
 #define UART_H
 
+#ifndef UART_BAUD
+#define UART_BAUD	9600	/* set UART_BAUD in the Makefile */
+#endif
+
+#define UART_TX_SIZE	64	/* TX ring, a power of two up to 256 */
+#define UART_RX_SIZE	16	/* RX ring, a power of two up to 256 */
+
+/* what uart_putchar() does when the TX ring is full */
+#define UART_TX_BLOCK	0	/* wait for room */
+#define UART_TX_DROP	1	/* throw the character away */
+
 void uart_init(void);
+unsigned char uart_tx_policy(unsigned char policy);
+unsigned int uart_dropped(void);
+unsigned char uart_write(const unsigned char *buf, unsigned char len);
 int uart_putchar(char c, FILE * stream);
 int uart_getchar(FILE * stream);
 unsigned char uart_kbhit(void);
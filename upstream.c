@@ -0,0 +1,171 @@
+/*      upstream.c      pool of client connections to a collector
+ *
+ *      Target-independent.  upstream_init() names the collector, then the
+ *      board runs upstream_poll() every UPSTREAM_POLL_MS; that keeps every
+ *      pool socket connected, reconnecting when the collector closes a
+ *      connection or one drops.  upstream_send() queues a report on a
+ *      connection that is already up, so a report costs one SEND rather
+ *      than a handshake.  Nothing here waits on the network.
+*/
+
+#include "w5100.h"
+#include "socket.h"
+#include "clock.h"
+#include "upstream.h"
+
+#if UPSTREAM_SOCKETS > 0
+
+/* values of UPSTREAM_CONN.state */
+#define UP_DOWN		0	/* closed; reconnect once UPSTREAM_RETRY_MS have passed */
+#define UP_CONNECTING	1	/* CONNECT issued */
+#define UP_READY	2	/* established, reports can be sent */
+#define UP_CLOSING	3	/* was up; waiting for the socket to close */
+
+typedef struct upstream_conn_t {
+	unsigned char state;	/* UP_xxx */
+	unsigned int since;	/* clock_ms() of the last connection attempt */
+} UPSTREAM_CONN;
+
+static UPSTREAM_CONN pool[UPSTREAM_SOCKETS];
+
+#define UPSTREAM_MASK	(((1 << UPSTREAM_SOCKETS) - 1) << UPSTREAM_FIRST_SOCKET)	/* bit per pool socket */
+static unsigned char collector_addr[4];
+static unsigned int collector_port;
+static unsigned char next;	/* pool slot to try first for the next report */
+
+static void upstream_connect(unsigned char i)
+{
+	pool[i].since = clock_ms();
+	if (Connect(UPSTREAM_FIRST_SOCKET + i, collector_addr, collector_port) == W5100_OK)
+		pool[i].state = UP_CONNECTING;
+	else
+		pool[i].state = UP_DOWN;
+}
+
+/*
+ *  upstream_service      follow one pool socket's status register
+ *
+ *  Works from the socket's entry in the upstream_poll() snapshot.
+ */
+static void upstream_service(unsigned char i, const W5100_SKT_STATUS *st)
+{
+	UPSTREAM_CONN *c;
+	unsigned char sock;
+
+	c = &pool[i];
+	sock = UPSTREAM_FIRST_SOCKET + i;
+	if (CommandStatus(sock) == SOCKET_CMD_TIMEOUT) {	// chip never took the last command
+		CloseSocket(sock);
+		c->state = UP_DOWN;	// and try again after UPSTREAM_RETRY_MS
+		return;
+	}
+	switch (st->sr) {
+	case W5100_SKT_SR_CLOSED:	// never opened, refused, timed out or closed
+		if (c->state == UP_READY || c->state == UP_CLOSING
+		    || (unsigned int)(clock_ms() - c->since) >= UPSTREAM_RETRY_MS)
+			upstream_connect(i);	// was up, or time to try again
+		else
+			c->state = UP_DOWN;
+		break;
+
+	case W5100_SKT_SR_ESTABLISHED:
+		if (c->state != UP_READY)
+			W51_COUNT(connections, 1);
+		c->state = UP_READY;
+		if (st->rx_rsr)
+			ReceiveDiscard(sock);	// whatever the collector says; keep the window open
+		break;
+
+	case W5100_SKT_SR_CLOSE_WAIT:	// collector closed its side
+		DisconnectSocket(sock);
+		c->state = UP_CLOSING;
+		break;
+
+	case W5100_SKT_SR_FIN_WAIT:
+	case W5100_SKT_SR_CLOSING:
+	case W5100_SKT_SR_TIME_WAIT:
+	case W5100_SKT_SR_LAST_ACK:
+		CloseSocket(sock);
+		c->state = UP_CLOSING;
+		break;
+	}	// INIT and SYNSENT: handshake still going
+}
+
+/*
+ *  upstream_init      name the collector and start connecting to it
+ */
+void upstream_init(const unsigned char *addr, unsigned int port)
+{
+	unsigned char i;
+
+	for (i = 0; i < 4; i++)
+		collector_addr[i] = addr[i];
+	collector_port = port;
+	for (i = 0; i < UPSTREAM_SOCKETS; i++)
+		upstream_connect(i);
+}
+
+/*
+ *  upstream_poll      keep the pool connected
+ *
+ *  Run this every UPSTREAM_POLL_MS, as a scheduler task (scheduler.h).  It
+ *  takes one snapshot of the pool (PollSockets), about 8 register reads
+ *  per socket.  A connection that drops after being up is reopened at
+ *  once; failed attempts are retried every UPSTREAM_RETRY_MS.
+ */
+void upstream_poll(void)
+{
+	W5100_SKT_STATUS st[W5100_NUM_SOCKETS];
+	unsigned char i;
+
+	PollSockets(UPSTREAM_MASK, 0, st);
+	for (i = 0; i < UPSTREAM_SOCKETS; i++)
+		upstream_service(i, &st[UPSTREAM_FIRST_SOCKET + i]);
+}
+
+/*
+ *  upstream_ready      number of connections reports can be sent on
+ */
+unsigned char upstream_ready(void)
+{
+	unsigned char i;
+	unsigned char n;
+
+	n = 0;
+	for (i = 0; i < UPSTREAM_SOCKETS; i++)
+		if (pool[i].state == UP_READY)
+			n++;
+	return n;
+}
+
+/*
+ *  upstream_send      queue one report on an open connection
+ *
+ *  A report is never split: it goes to the first connection, round-robin,
+ *  whose TX buffer has room for all of it.  Returns len, or 0 if no
+ *  connection is up or none has room; the caller can try again after the
+ *  next upstream_poll() or drop the report.
+ */
+unsigned int upstream_send(const unsigned char *buf, unsigned int len)
+{
+	unsigned char i;
+	unsigned char n;
+	unsigned char sock;
+
+	i = next;
+	for (n = 0; n < UPSTREAM_SOCKETS; n++) {
+		if (pool[i].state == UP_READY) {
+			sock = UPSTREAM_FIRST_SOCKET + i;
+			if (SendBegin(sock, len) >= len) {
+				SendWrite(sock, buf, len);
+				SendCommit(sock);
+				next = (i + 1) % UPSTREAM_SOCKETS;
+				return len;
+			}
+		}
+		i = (i + 1) % UPSTREAM_SOCKETS;
+	}
+	return 0;
+}
+
+#endif
@@ -0,0 +1,24 @@
+#ifndef UPSTREAMH
+#define UPSTREAMH
+
+#include "w5100.h"
+
+/*
+ *  Client connections kept open to one collector.  They use the top
+ *  UPSTREAM_SOCKETS sockets of the chip; the web server gets the rest.
+ *  Set UPSTREAM_SOCKETS in the Makefile; with 0 the pool is left out.
+ */
+#ifndef UPSTREAM_SOCKETS
+#define UPSTREAM_SOCKETS	0
+#endif
+#define UPSTREAM_FIRST_SOCKET	(W5100_NUM_SOCKETS - UPSTREAM_SOCKETS)
+
+#define UPSTREAM_RETRY_MS	1000	/* wait between failed connection attempts */
+#define UPSTREAM_POLL_MS	10	/* how often to run upstream_poll() */
+
+void upstream_init(const unsigned char  *addr, unsigned int  port);
+void upstream_poll(void);
+unsigned char upstream_ready(void);
+unsigned int upstream_send(const unsigned char  *buf, unsigned int  len);
+
+#endif
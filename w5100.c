@@ -47,9 +47,17 @@
  *  functions.
  */
 
+/*
+ *  If the library is built with W5100_SPI_STATIC defined, select, xchg and
+ *  deselect are bound at compile time to the AVR SPI port instead (see below).
+ *  W51_register() must still be called; only the reset function is used.
+ */
 
-#include <util/delay.h>
+
+#include <avr/pgmspace.h>
+#include <string.h>
 #include "w5100.h"
+#include "clock.h"
 
 
 
@@ -59,6 +67,56 @@
 #endif
 
 
+static  void                                    (*reset)(void) = (void *)0;
+
+
+/*
+ *  Base address and size of each socket's TX and RX buffer, filled in by
+ *  W51_config() from the buffer sizes in the W5100_CFG block.  Until then
+ *  they describe the chip's reset layout of 2K bytes per socket.
+ */
+static  unsigned int                    tx_base[W5100_NUM_SOCKETS] =
+        {W5100_TXBUFADDR, W5100_TXBUFADDR + 0x0800, W5100_TXBUFADDR + 0x1000, W5100_TXBUFADDR + 0x1800};
+static  unsigned int                    tx_size[W5100_NUM_SOCKETS] = {0x0800, 0x0800, 0x0800, 0x0800};
+static  unsigned int                    rx_base[W5100_NUM_SOCKETS] =
+        {W5100_RXBUFADDR, W5100_RXBUFADDR + 0x0800, W5100_RXBUFADDR + 0x1000, W5100_RXBUFADDR + 0x1800};
+static  unsigned int                    rx_size[W5100_NUM_SOCKETS] = {0x0800, 0x0800, 0x0800, 0x0800};
+
+
+#ifdef  W5100_SPI_STATIC
+
+/*
+ *  Static SPI backend.  The library drives the AVR hardware SPI port and the
+ *  chip-select line itself, so the compiler can inline every byte of a frame.
+ *  The host must still set up the SPI port (master, mode 0) and the CS pin as an
+ *  output before calling W51_init().  Override W5100_CS_PORT and W5100_CS_BIT on
+ *  the compiler command line if the W5100 chip-select is not on PB2.
+ */
+#include <avr/io.h>
+
+#ifndef  W5100_CS_PORT
+#define  W5100_CS_PORT                  PORTB
+#endif
+#ifndef  W5100_CS_BIT
+#define  W5100_CS_BIT                   2
+#endif
+
+
+static inline unsigned char  spi_xchg(unsigned char  val)
+{
+        SPDR = val;
+        while (!(SPSR & (1<<SPIF)))  ;
+        return  SPDR;
+}
+
+
+#define  W51_SELECT()                   (W5100_CS_PORT &= ~(1<<W5100_CS_BIT))
+#define  W51_XCHG(v)                    spi_xchg(v)
+#define  W51_DESELECT()                 (W5100_CS_PORT |= (1<<W5100_CS_BIT))
+#define  W51_READY                      TRUE
+
+#else
+
 /*
  *  Define the function pointers used to access the SPI port assigned to the
  *  W5100 device.  These pointers will be filled in at run-time when the host
@@ -67,22 +125,49 @@
 static  void                                    (*select)(void) = (void *)0;
 static  unsigned char                   (*xchg)(unsigned char  val) = (void *)0;
 static  void                                    (*deselect)(void) = (void *)0;
-static  void                                    (*reset)(void) = (void *)0;
 
 
 static  unsigned char                   inited = FALSE;
 
 
+#define  W51_SELECT()                   select()
+#define  W51_XCHG(v)                    xchg(v)
+#define  W51_DESELECT()                 deselect()
+#define  W51_READY                      inited
+
+#endif
+
+
+
+/*
+ *  Performance counters (see w5100.h).  W51_TIME_START must come right after a function's
+ *  local declarations; it declares the start time.
+ */
+#ifdef  W5100_USE_STATS
+W5100_STATS                             W51_stats;
+#endif
+
+#ifdef  W5100_STATS_CYCLES
+#define  W51_TIME_START()               unsigned int  t0 = clock_cycles()
+#define  W51_TIME_END()                 (W51_stats.spi_cycles += CLOCK_CYCLES_PER_TICK * (unsigned long)(unsigned int)(clock_cycles() - t0))
+#else
+#define  W51_TIME_START()               do { } while (0)
+#define  W51_TIME_END()                 do { } while (0)
+#endif
+
+
 
 
 void  W51_register(W5100_CALLBACKS  *pcallbacks)
 {
+        reset = pcallbacks->_reset;
+#ifndef  W5100_SPI_STATIC
         select = pcallbacks->_select;
         xchg = pcallbacks->_xchg;
         deselect = pcallbacks->_deselect;
-        reset = pcallbacks->_reset;
         inited = FALSE;
         if ((select) && (xchg) && (deselect))  inited = TRUE;   // these functions must be valid
+#endif
 }
 
 
@@ -90,52 +175,427 @@ void  W51_register(W5100_CALLBACKS  *pcallbacks)
 
 void  W51_write(unsigned int  addr, unsigned char  data)
 {
-        if (!inited)  return;                                           // not set up, ignore request
-
-        select();                                                                       // enable the W5100 chip
-        xchg(W5100_WRITE_OPCODE);                                       // need to write a byte
-        xchg((addr & 0xff00) >> 8);                             // send MSB of addr
-        xchg(addr & 0xff);                                                      // send LSB
-        xchg(data);                                                                     // send the data
-        deselect();                                                                     // done with the chip
+        W51_TIME_START();
+
+        if (!W51_READY)  return;                                        // not set up, ignore request
+
+        W51_SELECT();                                                                   // enable the W5100 chip
+        W51_XCHG(W5100_WRITE_OPCODE);                                   // need to write a byte
+        W51_XCHG((addr & 0xff00) >> 8);                         // send MSB of addr
+        W51_XCHG(addr & 0xff);                                                  // send LSB
+        W51_XCHG(data);                                                                 // send the data
+        W51_DESELECT();                                                                 // done with the chip
+        W51_COUNT(spi_writes, 1);
+        W51_TIME_END();
 }
 
 
 unsigned char  W51_read(unsigned int  addr)
 {
         unsigned char                           val;
+        W51_TIME_START();
+
+        if (!W51_READY)  return  0;                                     // not set up, ignore request
+
+        W51_SELECT();                                                                   // enable the W5100 chip
+        W51_XCHG(W5100_READ_OPCODE);                                    // need to read a byte
+        W51_XCHG((addr & 0xff00) >> 8);                         // send MSB of addr
+        W51_XCHG(addr & 0xff);                                                  // send LSB
+        val = W51_XCHG(0x00);                                                   // need to send a dummy char to get response
+        W51_DESELECT();                                                                 // done with the chip
+        W51_COUNT(spi_reads, 1);
+        W51_TIME_END();
+        return  val;                                                            // tell her what she's won
+}
 
-        if (!inited)  return  0;                                        // not set up, ignore request
 
-        select();                                                                       // enable the W5100 chip
-        xchg(W5100_READ_OPCODE);                                        // need to read a byte
-        xchg((addr & 0xff00) >> 8);                             // send MSB of addr
-        xchg(addr & 0xff);                                                      // send LSB
-        val = xchg(0x00);                                                       // need to send a dummy char to get response
-        deselect();                                                                     // done with the chip
-        return  val;                                                            // tell her what she's won
+
+/*
+ *  Move a run of bytes between the MCU and consecutive W5100 addresses.  The W5100
+ *  SPI interface only moves one byte per 4-byte frame, but keeping the frame loop
+ *  here means the caller pays for the address math and the inited check once per
+ *  block instead of once per byte.  The run must not cross the end of a socket buffer.
+ */
+static inline void  W51_write_run(unsigned int  addr, const unsigned char  *buf, unsigned int  len)
+{
+        while (len--)
+        {
+                W51_SELECT();
+                W51_XCHG(W5100_WRITE_OPCODE);
+                W51_XCHG(addr >> 8);
+                W51_XCHG(addr & 0xff);
+                W51_XCHG(*buf++);
+                W51_DESELECT();
+                addr++;
+        }
+}
+
+
+static inline void  W51_write_run_P(unsigned int  addr, const unsigned char  *buf_P, unsigned int  len)
+{
+        while (len--)
+        {
+                W51_SELECT();
+                W51_XCHG(W5100_WRITE_OPCODE);
+                W51_XCHG(addr >> 8);
+                W51_XCHG(addr & 0xff);
+                W51_XCHG(pgm_read_byte(buf_P++));                       // byte comes straight from flash
+                W51_DESELECT();
+                addr++;
+        }
+}
+
+
+static inline void  W51_read_run(unsigned int  addr, unsigned char  *buf, unsigned int  len)
+{
+        while (len--)
+        {
+                W51_SELECT();
+                W51_XCHG(W5100_READ_OPCODE);
+                W51_XCHG(addr >> 8);
+                W51_XCHG(addr & 0xff);
+                *buf++ = W51_XCHG(0x00);
+                W51_DESELECT();
+                addr++;
+        }
+}
+
+
+
+void  W51_write_block(unsigned char  sock, unsigned int  offset, const unsigned char  *buf, unsigned int  len)
+{
+        unsigned int                            base;
+        unsigned int                            run;
+        W51_TIME_START();
+
+        if (!W51_READY)  return;                                        // not set up, ignore request
+        if (sock >= W5100_NUM_SOCKETS)  return;                         // illegal socket value is bad!
+
+        if (tx_size[sock] == 0)  return;                                // socket has no TX memory
+        W51_COUNT(spi_writes, len);
+        W51_COUNT(tx_bytes[sock], len);
+
+        base = tx_base[sock];                                           // start of this socket's TX buffer
+        offset &= tx_size[sock] - 1;
+        run = tx_size[sock] - offset;                                   // bytes left before the buffer wraps
+        if (len > run)
+        {
+                W51_write_run(base + offset, buf, run);                 // fill to the end of the buffer...
+                buf += run;
+                len -= run;
+                offset = 0;                                             // ...then carry on at the start
+        }
+        W51_write_run(base + offset, buf, len);
+        W51_TIME_END();
+}
+
+
+void  W51_write_block_P(unsigned char  sock, unsigned int  offset, const unsigned char  *buf_P, unsigned int  len)
+{
+        unsigned int                            base;
+        unsigned int                            run;
+        W51_TIME_START();
+
+        if (!W51_READY)  return;                                        // not set up, ignore request
+        if (sock >= W5100_NUM_SOCKETS)  return;                         // illegal socket value is bad!
+
+        if (tx_size[sock] == 0)  return;                                // socket has no TX memory
+        W51_COUNT(spi_writes, len);
+        W51_COUNT(tx_bytes[sock], len);
+
+        base = tx_base[sock];
+        offset &= tx_size[sock] - 1;
+        run = tx_size[sock] - offset;
+        if (len > run)
+        {
+                W51_write_run_P(base + offset, buf_P, run);
+                buf_P += run;
+                len -= run;
+                offset = 0;
+        }
+        W51_write_run_P(base + offset, buf_P, len);
+        W51_TIME_END();
+}
+
+
+void  W51_read_block(unsigned char  sock, unsigned int  offset, unsigned char  *buf, unsigned int  len)
+{
+        unsigned int                            base;
+        unsigned int                            run;
+        W51_TIME_START();
+
+        if (!W51_READY)  return;                                        // not set up, ignore request
+        if (sock >= W5100_NUM_SOCKETS)  return;                         // illegal socket value is bad!
+
+        if (rx_size[sock] == 0)  return;                                // socket has no RX memory
+        W51_COUNT(spi_reads, len);
+        W51_COUNT(rx_bytes[sock], len);
+
+        base = rx_base[sock];                                           // start of this socket's RX buffer
+        offset &= rx_size[sock] - 1;
+        run = rx_size[sock] - offset;                                   // bytes left before the buffer wraps
+        if (len > run)
+        {
+                W51_read_run(base + offset, buf, run);
+                buf += run;
+                len -= run;
+                offset = 0;
+        }
+        W51_read_run(base + offset, buf, len);
+        W51_TIME_END();
 }
 
 
 
 void  W51_init(void)
 {
+        unsigned int                    t;
+
         if (reset)  reset();                                            // if host provided a reset function, use it
         else            W51_write(W5100_MR, W5100_MR_SOFTRST);          // otherwise, force the w5100 to soft-reset
-        _delay_ms(1);
+        t = clock_ms();
+        while ((W51_read(W5100_MR) & W5100_MR_SOFTRST)                  // the chip clears RST once it is ready
+               && (unsigned int)(clock_ms() - t) < W5100_RESET_MS)  ;
+}
+
+
+
+/*
+ *  Hand a run of consecutive W5100 bytes to a consumer, one byte per frame,
+ *  until the run ends or the consumer asks to stop.  Returns the number of
+ *  bytes handed over.
+ */
+static inline unsigned int  W51_stream_run(unsigned int  addr, unsigned int  len,
+                                           unsigned char  (*consume)(void  *ctx, unsigned char  c), void  *ctx)
+{
+        unsigned int                            n;
+        unsigned char                           c;
+
+        for (n=0; n<len; n++)
+        {
+                W51_SELECT();
+                W51_XCHG(W5100_READ_OPCODE);
+                W51_XCHG(addr >> 8);
+                W51_XCHG(addr & 0xff);
+                c = W51_XCHG(0x00);
+                W51_DESELECT();
+                addr++;
+                if (!consume(ctx, c))  return  n + 1;                   // consumer has what it wants
+        }
+        return  n;
+}
+
+
+unsigned int  W51_read_stream(unsigned char  sock, unsigned int  offset, unsigned int  len,
+                              unsigned char  (*consume)(void  *ctx, unsigned char  c), void  *ctx)
+{
+        unsigned int                            base;
+        unsigned int                            run;
+        unsigned int                            n;
+        W51_TIME_START();
+
+        if (!W51_READY)  return  0;                                     // not set up, ignore request
+        if (sock >= W5100_NUM_SOCKETS)  return  0;                      // illegal socket value is bad!
+        if (rx_size[sock] == 0)  return  0;                             // socket has no RX memory
+
+        base = rx_base[sock];                                           // start of this socket's RX buffer
+        offset &= rx_size[sock] - 1;
+        run = rx_size[sock] - offset;                                   // bytes left before the buffer wraps
+        if (len <= run)
+        {
+                n = W51_stream_run(base + offset, len, consume, ctx);
+        }
+        else
+        {
+                n = W51_stream_run(base + offset, run, consume, ctx);
+                if (n == run)                                           // consumer wants more after the wrap
+                        n += W51_stream_run(base, len - run, consume, ctx);
+        }
+        W51_COUNT(spi_reads, n);
+        W51_COUNT(rx_bytes[sock], n);
+        W51_TIME_END();
+        return  n;
+}
+
+
+
+unsigned int  W51_tx_size(unsigned char  sock)
+{
+        if (sock >= W5100_NUM_SOCKETS)  return  0;
+        return  tx_size[sock];
+}
+
+
+unsigned int  W51_rx_size(unsigned char  sock)
+{
+        if (sock >= W5100_NUM_SOCKETS)  return  0;
+        return  rx_size[sock];
+}
+
+
+
+/*
+ *  Read a 16-bit size register that the chip may be updating: MSB and LSB, then the MSB
+ *  again.  If the MSB moved, the pair may be torn and the LSB is read again with the new
+ *  MSB, up to W51_STABLE_TRIES times.  The sizes only grow between the host's own
+ *  commands, so a torn pair is never above the size it was read during, and if the MSB
+ *  never settles the lower of the last two pairs is a safe lower bound.  This is the
+ *  same read as ReadStable() in socket.c, without the function call per frame.
+ */
+#define  W51_STABLE_TRIES               3
+
+static unsigned int  W51_read_stable(unsigned int  addr)
+{
+        unsigned char                           reg[2];
+        unsigned char                           again;
+        unsigned char                           i;
+        unsigned int                            val;
+        unsigned int                            last;
+
+        last = 0xFFFF;
+        W51_read_run(addr, reg, 2);
+        W51_COUNT(spi_reads, 2);
+        for (i=1; ; i++)
+        {
+                W51_read_run(addr, &again, 1);
+                W51_COUNT(spi_reads, 1);
+                val = (reg[0] << 8) | reg[1];
+                if (again == reg[0])  return  val;              // MSB held, so the LSB belongs to it
+                if (i == W51_STABLE_TRIES)  return  (val < last) ? val : last;  // still moving, give up
+                last = val;
+                reg[0] = again;
+                W51_read_run(addr + 1, &reg[1], 1);
+                W51_COUNT(spi_reads, 1);
+        }
+}
+
+
+void  W51_poll_all(unsigned char  mask, unsigned char  cmd, unsigned char  clear, W5100_SKT_STATUS  *pstat)
+{
+        unsigned char                           n;
+        unsigned int                            base;
+        unsigned char                           reg[2];
+        W5100_SKT_STATUS                        *p;
+        W51_TIME_START();
+
+        for (n=0; n<W5100_NUM_SOCKETS; n++)
+        {
+                if (!(mask & (1<<n)))  continue;                        // not asked for
+                p = &pstat[n];
+                p->cr = p->ir = p->sr = 0;
+                p->tx_fsr = p->rx_rsr = 0;
+                if (!W51_READY)  continue;                              // not set up, report all clear
+
+                base = W5100_SKT_BASE(n);
+                if ((cmd & (1<<n)) && clear)
+                {
+                        W51_read_run(base + W5100_CR_OFFSET, reg, 2);   // CR and IR; CR first, so the sizes below count what it took
+                        p->cr = reg[0];
+                        p->ir = reg[1];
+                        W51_COUNT(spi_reads, 2);
+                }
+                else if (cmd & (1<<n))
+                {
+                        W51_read_run(base + W5100_CR_OFFSET, &p->cr, 1);
+                        W51_COUNT(spi_reads, 1);
+                }
+                else if (clear)
+                {
+                        W51_read_run(base + W5100_IR_OFFSET, &p->ir, 1);
+                        W51_COUNT(spi_reads, 1);
+                }
+                if (p->ir)
+                {
+                        W51_write_run(base + W5100_IR_OFFSET, &p->ir, 1);       // clear what was seen before looking at the state
+                        W51_COUNT(spi_writes, 1);
+                }
+                W51_read_run(base + W5100_SR_OFFSET, &p->sr, 1);
+                W51_COUNT(spi_reads, 1);
+                switch (p->sr)
+                {
+                        case  W5100_SKT_SR_ESTABLISHED:
+                        case  W5100_SKT_SR_CLOSE_WAIT:
+                        case  W5100_SKT_SR_UDP:
+                        case  W5100_SKT_SR_IPRAW:
+                        case  W5100_SKT_SR_MACRAW:
+                        p->tx_fsr = W51_read_stable(base + W5100_TX_FSR_OFFSET);
+                        p->rx_rsr = W51_read_stable(base + W5100_RX_RSR_OFFSET);
+                        break;
+                }
+        }
+        W51_TIME_END();
+}
+
+
+
+/*
+ *  Turn a list of per-socket buffer sizes (in Kbytes) into an RMSR/TMSR value
+ *  and a table of buffer addresses.  The chip hands out its 8K bytes to the
+ *  sockets in order, so a socket can only be left without memory once the
+ *  sockets before it have used all 8K.
+ */
+static unsigned char  W51_memsize(const unsigned char  *kbytes, unsigned int  bufaddr,
+                                  unsigned int  *base, unsigned int  *size, unsigned char  *msr)
+{
+        unsigned char                           n;
+        unsigned char                           code;
+        unsigned char                           total;
+
+        *msr = 0;
+        total = 0;
+        for (n=0; n<W5100_NUM_SOCKETS; n++)
+        {
+                switch (kbytes[n])
+                {
+                        case  1:  code = 0;  break;
+                        case  2:  code = 1;  break;
+                        case  4:  code = 2;  break;
+                        case  8:  code = 3;  break;
+                        case  0:  if (total == 8)  { code = 0;  break; }        // all memory used, socket gets none
+                                                                                // otherwise fall through, illegal
+                        default:  return  W5100_FAIL;
+                }
+                if (total + kbytes[n] > 8)  return  W5100_FAIL;                 // more than the chip has
+
+                base[n] = bufaddr + (total * 1024);
+                size[n] = kbytes[n] * 1024;
+                total = total + kbytes[n];
+                *msr = *msr | (code << (2 * n));
+        }
+        return  W5100_OK;
 }
 
 
 
 unsigned char  W51_config(W5100_CFG  *pcfg)
 {
+        static const unsigned char              defsize[W5100_NUM_SOCKETS] = {2, 2, 2, 2};
+        const unsigned char                     *rxk;
+        const unsigned char                     *txk;
+        unsigned int                            rxb[W5100_NUM_SOCKETS];
+        unsigned int                            rxs[W5100_NUM_SOCKETS];
+        unsigned int                            txb[W5100_NUM_SOCKETS];
+        unsigned int                            txs[W5100_NUM_SOCKETS];
+        unsigned char                           rmsr;
+        unsigned char                           tmsr;
+        unsigned char                           n;
+
         if (pcfg == 0)  return  W5100_FAIL;
 
+        rxk = defsize;                                                  // all sizes zero means 2K per socket
+        txk = defsize;
+        for (n=0; n<W5100_NUM_SOCKETS; n++)
+        {
+                if (pcfg->rx_kbytes[n])  rxk = pcfg->rx_kbytes;
+                if (pcfg->tx_kbytes[n])  txk = pcfg->tx_kbytes;
+        }
+        if (W51_memsize(rxk, W5100_RXBUFADDR, rxb, rxs, &rmsr) != W5100_OK)  return  W5100_FAIL;
+        if (W51_memsize(txk, W5100_TXBUFADDR, txb, txs, &tmsr) != W5100_OK)  return  W5100_FAIL;
+
         W51_write(W5100_GAR + 0, pcfg->gtw_addr[0]);    // set up the gateway address
         W51_write(W5100_GAR + 1, pcfg->gtw_addr[1]);
         W51_write(W5100_GAR + 2, pcfg->gtw_addr[2]);
         W51_write(W5100_GAR + 3, pcfg->gtw_addr[3]);
-        _delay_ms(1);
 
         W51_write(W5100_SHAR + 0, pcfg->mac_addr[0]);   // set up the MAC address
         W51_write(W5100_SHAR + 1, pcfg->mac_addr[1]);
@@ -143,22 +603,41 @@ unsigned char  W51_config(W5100_CFG  *pcfg)
         W51_write(W5100_SHAR + 3, pcfg->mac_addr[3]);
         W51_write(W5100_SHAR + 4, pcfg->mac_addr[4]);
         W51_write(W5100_SHAR + 5, pcfg->mac_addr[5]);
-        _delay_ms(1);
 
         W51_write(W5100_SUBR + 0, pcfg->sub_mask[0]);   // set up the subnet mask
         W51_write(W5100_SUBR + 1, pcfg->sub_mask[1]);
         W51_write(W5100_SUBR + 2, pcfg->sub_mask[2]);
         W51_write(W5100_SUBR + 3, pcfg->sub_mask[3]);
-        _delay_ms(1);
 
         W51_write(W5100_SIPR + 0, pcfg->ip_addr[0]);    // set up the source IP address
         W51_write(W5100_SIPR + 1, pcfg->ip_addr[1]);
         W51_write(W5100_SIPR + 2, pcfg->ip_addr[2]);
         W51_write(W5100_SIPR + 3, pcfg->ip_addr[3]);
-        _delay_ms(1);
 
-        W51_write(W5100_RMSR, 0x55);                                    // use default buffer sizes (2K bytes RX and TX for each socket
-        W51_write(W5100_TMSR, 0x55);
+        W51_write(W5100_RMSR, rmsr);                                    // set up the per-socket buffer sizes
+        W51_write(W5100_TMSR, tmsr);
+        for (n=0; n<W5100_NUM_SOCKETS; n++)                             // and remember where each buffer lives
+        {
+                rx_base[n] = rxb[n];
+                rx_size[n] = rxs[n];
+                tx_base[n] = txb[n];
+                tx_size[n] = txs[n];
+        }
 
         return  W5100_OK;                                                               // everything worked, show success
 }
+
+
+
+#ifdef  W5100_USE_STATS
+void  W51_get_stats(W5100_STATS  *pstats)
+{
+        memcpy(pstats, &W51_stats, sizeof(W5100_STATS));
+}
+
+
+void  W51_clear_stats(void)
+{
+        memset(&W51_stats, 0, sizeof(W5100_STATS));
+}
+#endif
@@ -65,10 +65,14 @@
 
 /*
  *  Define masks for accessing the addresses with a TX or RX buffer.
- *  Note that these masks assume 2K buffers!
+ *  Note that these masks assume 2K buffers, which is the chip's reset layout!
+ *  The buffer sizes can be changed through W51_config; see W51_tx_size and
+ *  W51_rx_size for the sizes actually in use.
  */
 #define  W5100_TX_BUF_MASK      0x07FF          /* Tx 2K Buffer Mask */
 #define  W5100_RX_BUF_MASK      0x07FF          /* Rx 2K Buffer Mask */
+#define  W5100_TX_BUF_SIZE      0x0800          /* Tx 2K Buffer Size */
+#define  W5100_RX_BUF_SIZE      0x0800          /* Rx 2K Buffer Size */
 
 
 
@@ -123,9 +127,10 @@
 #define  W5100_IR_UNREACH               (1<<6)          /* 1 means IP addr & port were unreachable (ICMP packet received) */
 #define  W5100_IR_PPPOE                 (1<<5)          /* 1 means PPPoE connection closed */
 #define  W5100_IR_S3_INT                (1<<3)          /* 1 means socket 3 interrup occurred */
-#define  W5100_IR_S2_INT                (1<<3)          /* 1 means socket 2 interrup occurred */
-#define  W5100_IR_S1_INT                (1<<3)          /* 1 means socket 1 interrup occurred */
-#define  W5100_IR_S0_INT                (1<<3)          /* 1 means socket 0 interrup occurred */
+#define  W5100_IR_S2_INT                (1<<2)          /* 1 means socket 2 interrup occurred */
+#define  W5100_IR_S1_INT                (1<<1)          /* 1 means socket 1 interrup occurred */
+#define  W5100_IR_S0_INT                (1<<0)          /* 1 means socket 0 interrup occurred */
+#define  W5100_IR_SKT_INT(n)            (1<<(n))        /* 1 means socket n interrupt occurred */
 
 
 /*
@@ -138,9 +143,22 @@
 #define  W5100_IMR_UNREACH              (1<<6)          /* Enable interrupt for IP addr & port were unreachable (ICMP packet received) */
 #define  W5100_IMR_PPPOE                (1<<5)          /* Enable interrupt for PPPoE connection closed */
 #define  W5100_IMR_S3_INT               (1<<3)          /* Enable interrupt for socket 3 interrup */
-#define  W5100_IMR_S2_INT               (1<<3)          /* Enable interrupt for socket 2 interrup */
-#define  W5100_IMR_S1_INT               (1<<3)          /* Enable interrupt for socket 1 interrup */
-#define  W5100_IMR_S0_INT               (1<<3)          /* Enable interrupt for socket 0 interrup */
+#define  W5100_IMR_S2_INT               (1<<2)          /* Enable interrupt for socket 2 interrup */
+#define  W5100_IMR_S1_INT               (1<<1)          /* Enable interrupt for socket 1 interrup */
+#define  W5100_IMR_S0_INT               (1<<0)          /* Enable interrupt for socket 0 interrup */
+#define  W5100_IMR_SKT_INT(n)           (1<<(n))        /* Enable interrupt for socket n interrupt */
+
+
+/*
+ *  The following #defines are OR-masks for checking bits in each socket's Interrupt
+ *  register (W5100_IR_OFFSET).  A bit is cleared by writing a 1 to it; the socket's
+ *  bit in the chip's Interrupt register stays set until all of them are cleared.
+ */
+#define  W5100_SKT_IR_SEND_OK           (1<<4)          /* 1 means a SEND command completed */
+#define  W5100_SKT_IR_TIMEOUT           (1<<3)          /* 1 means ARP or TCP timeout */
+#define  W5100_SKT_IR_RECV              (1<<2)          /* 1 means data was received */
+#define  W5100_SKT_IR_DISCON            (1<<1)          /* 1 means FIN or FIN/ACK received from the peer */
+#define  W5100_SKT_IR_CON               (1<<0)          /* 1 means connection established */
 
 
 /*
@@ -180,7 +198,7 @@
  */
 #define  W5100_SKT_CR_OPEN              0x01            /* open the socket */
 #define  W5100_SKT_CR_LISTEN    0x02            /* wait for TCP connection (server mode) */
-#define  W5100_SKT_CR_CONNECT   0x04            /* listen for TCP connection (client mode) */
+#define  W5100_SKT_CR_CONNECT   0x04            /* connect to DIPR:DPORT (client mode) */
 #define  W5100_SKT_CR_DISCON    0x08            /* close TCP connection */
 #define  W5100_SKT_CR_CLOSE             0x10            /* mark socket as closed (does not close TCP connection) */
 #define  W5100_SKT_CR_SEND              0x20            /* transmit data in TX buffer */
@@ -200,6 +218,7 @@
 #define  W5100_SKT_MR_MACRAW    0x04            /* MAC LAYER RAW SOCK */
 #define  W5100_SKT_MR_PPPOE             0x05            /* PPPoE */
 #define  W5100_SKT_MR_ND                0x20            /* No Delayed Ack(TCP) flag */
+#define  W5100_SKT_MR_MF                0x40            /* MAC filter (MACRAW on socket 0): only own, broadcast and multicast frames */
 #define  W5100_SKT_MR_MULTI             0x80            /* support multicasting */
 
 
@@ -208,6 +227,11 @@
 /*
  *  The W5100_CFG structure holds the target-specific MAC, IP, and gateway addresses,
  *  as well as the subnet mask.
+ *
+ *  It also holds the size of each socket's RX and TX buffer, in Kbytes.  The chip has
+ *  8K bytes of each, handed out to sockets 0 to 3 in order; legal sizes are 1, 2, 4
+ *  and 8, and a socket may be given 0 only if the sockets before it used up all 8K.
+ *  Leave all four sizes at 0 to get the default of 2K bytes per socket.
  */
 typedef struct  W5100_cfg_t
 {
@@ -215,6 +239,8 @@ typedef struct  W5100_cfg_t
         unsigned char                   ip_addr[4];
         unsigned char                   sub_mask[4];
         unsigned char                   gtw_addr[4];
+        unsigned char                   rx_kbytes[W5100_NUM_SOCKETS];   // RX buffer size for each socket
+        unsigned char                   tx_kbytes[W5100_NUM_SOCKETS];   // TX buffer size for each socket
 }  W5100_CFG;
 
 
@@ -227,6 +253,12 @@ typedef struct  W5100_cfg_t
  *  which means the library code does not have to be rebuilt just because your hardware design
  *  changed.
  */
+/*
+ *  If you build the library with W5100_SPI_STATIC defined, the library accesses the AVR
+ *  hardware SPI port directly and ignores ._select, ._xchg and ._deselect; only ._reset
+ *  is used.  The chip-select line defaults to PB2 and can be moved by defining
+ *  W5100_CS_PORT and W5100_CS_BIT.
+ */
 typedef struct  W5100_callbacks_t
 {
         void                                    (* _select)(void);                                      // function for selecting the W5100 chip
@@ -279,6 +311,66 @@ void                                    W51_write(unsigned int  addr, unsigned c
 unsigned char                   W51_read(unsigned int  addr);
 
 
+/*
+ *  W51_write_block      copy a block of data into a socket's TX buffer
+ *
+ *  Argument sock holds the socket number (0 to W5100_NUM_SOCKETS-1).
+ *
+ *  Argument offset holds the socket's TX write pointer (the raw value read from the
+ *  socket's TX_WR register).  The offset is masked to the socket's buffer, so the caller
+ *  does not have to handle the wrap at the end of the buffer.
+ *
+ *  Arguments buf and len hold the address and size of the data to copy.  len must not
+ *  be larger than the socket's TX buffer (see W51_tx_size).
+ *
+ *  This routine does NOT update the socket's TX_WR register or issue a SEND command.
+ */
+void                                    W51_write_block(unsigned char  sock, unsigned int  offset, const unsigned char  *buf, unsigned int  len);
+
+
+/*
+ *  W51_write_block_P      copy a block of data from flash into a socket's TX buffer
+ *
+ *  Same as W51_write_block, except that buf_P is a PROGMEM address.  The data is read
+ *  with pgm_read_byte one byte per SPI frame, so no RAM copy of it is ever made.
+ */
+void                                    W51_write_block_P(unsigned char  sock, unsigned int  offset, const unsigned char  *buf_P, unsigned int  len);
+
+
+/*
+ *  W51_read_block      copy a block of data out of a socket's RX buffer
+ *
+ *  Argument sock holds the socket number (0 to W5100_NUM_SOCKETS-1).
+ *
+ *  Argument offset holds the socket's RX read pointer (the raw value read from the
+ *  socket's RX_RD register).  As with W51_write_block, the wrap at the end of the buffer
+ *  is handled here.
+ *
+ *  Arguments buf and len hold the address and size of the destination buffer.
+ *
+ *  This routine does NOT update the socket's RX_RD register or issue a RECV command.
+ */
+void                                    W51_read_block(unsigned char  sock, unsigned int  offset, unsigned char  *buf, unsigned int  len);
+
+
+/*
+ *  W51_read_stream      hand the data in a socket's RX buffer to a consumer function
+ *
+ *  Arguments sock and offset are as for W51_read_block.  Argument len holds the number of
+ *  bytes available at offset.
+ *
+ *  Argument consume points to a function that is called once per byte, in order, with
+ *  argument ctx and the byte.  The consumer returns non-zero to ask for the next byte,
+ *  or 0 to stop after the byte it was just given.  No RAM buffer is involved, so the
+ *  amount of data is limited only by the socket's RX buffer.
+ *
+ *  This routine returns the number of bytes handed to the consumer.  Like W51_read_block,
+ *  it does NOT update the socket's RX_RD register or issue a RECV command.
+ */
+unsigned int                    W51_read_stream(unsigned char  sock, unsigned int  offset, unsigned int  len,
+                                                unsigned char  (*consume)(void  *ctx, unsigned char  c), void  *ctx);
+
+
 /*
  *  W51_init      initialize the W5100 chip
  *
@@ -289,8 +381,13 @@ unsigned char                   W51_read(unsigned int  addr);
  *  function in the W5100_CALLBACKS structure provided to W51_register above.  If your hardware
  *  cannot perform a hardware reset, pass a value of 0 for the reset function.
  *
+ *  After the reset it waits, by clock_ms() (clock.h) and for at most W5100_RESET_MS, for the
+ *  chip to clear the RST bit in MR, so the clock must be running before this is called.
+ *
  *  This routine does NOT set any MAC or TCP addresses!  See W51_config for these operations.
  */
+#define  W5100_RESET_MS                 10              /* longest wait for the chip to come out of reset */
+
 void                                    W51_init(void);
 
 
@@ -298,11 +395,109 @@ void                                    W51_init(void);
  *  W51_config      setup MAC and TCP addresses for the entire device or a socket
  *
  *  This routine uses the contents of the W5100_CFG structure pointed to by argument
- *  pcfg to configure the W5100 IP address and MAC value.
+ *  pcfg to configure the W5100 IP address and MAC value, and the size of each socket's
+ *  RX and TX buffers.
  *
- *  Upon exit, this routine returns W5100_OK if successful, else it returns W5100_FAIL. 
+ *  Upon exit, this routine returns W5100_OK if successful, else it returns W5100_FAIL.
+ *  An illegal set of buffer sizes fails before anything is written to the chip.
  */
 unsigned char                   W51_config(W5100_CFG  *pcfg);
 
 
+/*
+ *  W51_tx_size      return the size of a socket's TX buffer, in bytes
+ *  W51_rx_size      return the size of a socket's RX buffer, in bytes
+ *
+ *  Argument sock holds the socket number.  These routines return the sizes set up by
+ *  the last call to W51_config (2K bytes before W51_config has been called).  A socket
+ *  that was given no memory, or an illegal socket number, returns 0.
+ */
+unsigned int                    W51_tx_size(unsigned char  sock);
+unsigned int                    W51_rx_size(unsigned char  sock);
+
+
+/*
+ *  The W5100_SKT_STATUS structure holds one socket's entry in the snapshot taken by
+ *  W51_poll_all.
+ */
+typedef struct  W5100_skt_status_t
+{
+        unsigned char                   cr;                                     // Command register; 0 once the last command was taken
+        unsigned char                   ir;                                     // socket Interrupt register (W5100_SKT_IR_xxx)
+        unsigned char                   sr;                                     // Status register (W5100_SKT_SR_xxx)
+        unsigned int                    tx_fsr;                                 // TX free size
+        unsigned int                    rx_rsr;                                 // RX received size
+}  W5100_SKT_STATUS;
+
+
+/*
+ *  W51_poll_all      read the state of a set of sockets in one pass
+ *
+ *  Argument mask holds a bit per socket to read (W5100_IR_SKT_INT(n)).  Argument pstat
+ *  points to W5100_NUM_SOCKETS entries; pstat[n] is filled in for each socket in mask and
+ *  the others are left alone.
+ *
+ *  Argument cmd holds a bit per socket that may still have a command in CR; CR is only
+ *  read for those, and cr is 0 for the rest.  If argument clear is non-zero, IR is read
+ *  and the bits seen are written back, which clears them, before SR and the sizes are
+ *  read; an event that comes in after that keeps its bit set, so this is the way to
+ *  service the chip's INT line.  Without clear, IR is not read and ir is 0.
+ *
+ *  Then SR is read and, if it shows a socket that can move data (ESTABLISHED, CLOSE_WAIT,
+ *  UDP, IPRAW or MACRAW), TX_FSR and RX_RSR; tx_fsr and rx_rsr are 0 for the rest.  So an
+ *  idle socket polled without clear costs one frame, and a busy one 10 (CR, IR, the IR
+ *  write-back, SR and three frames per size).
+ *
+ *  Each size is read MSB, LSB, MSB; if the MSB moved in between, the LSB and MSB are read
+ *  again, at most twice more, and the lower of the last two values is kept if it never
+ *  settles.  Between the host's own commands the chip only makes the sizes grow, so treat
+ *  them as lower bounds.  They only count the last SEND or RECV once the chip has taken
+ *  it, so they mean nothing unless cr is 0.
+ */
+void                                    W51_poll_all(unsigned char  mask, unsigned char  cmd, unsigned char  clear, W5100_SKT_STATUS  *pstat);
+
+
+
+
+/*
+ *  Performance counters.  If the library is built with W5100_USE_STATS defined, W51_stats
+ *  counts the SPI traffic and the per-socket data moved through the chip's buffers, and
+ *  socket.c and the servers add their waits, timeouts and connections through W51_COUNT.
+ *  Without it W51_COUNT compiles to nothing and there is no counter overhead at all.
+ *
+ *  If W5100_STATS_CYCLES is defined as well, every SPI access is also timed with
+ *  clock_cycles() (clock.h) and the CPU cycles spent in them are added to spi_cycles.
+ */
+typedef struct  W5100_stats_t
+{
+        unsigned long                   spi_reads;                              // SPI read frames
+        unsigned long                   spi_writes;                             // SPI write frames
+        unsigned long                   spi_cycles;                             // CPU cycles spent on SPI (W5100_STATS_CYCLES only)
+        unsigned long                   rx_bytes[W5100_NUM_SOCKETS];            // bytes read out of each socket's RX buffer
+        unsigned long                   tx_bytes[W5100_NUM_SOCKETS];            // bytes written to each socket's TX buffer
+        unsigned long                   cmd_waits;                              // CR reads that found a command not yet taken
+        unsigned int                    cmd_timeouts;                           // commands not taken by their deadline
+        unsigned long                   send_waits;                             // Send() calls that had to wait for TX space
+        unsigned int                    send_timeouts;                          // Send() calls that gave up
+        unsigned long                   connections;                            // TCP connections accepted or made
+}  W5100_STATS;
+
+
+#ifdef  W5100_USE_STATS
+extern  W5100_STATS                     W51_stats;
+#define  W51_COUNT(field, n)            (W51_stats.field += (n))
+
+/*
+ *  W51_get_stats      copy the performance counters to pstats
+ *  W51_clear_stats    zero the performance counters
+ *
+ *  Only present when the library is built with W5100_USE_STATS.
+ */
+void                                    W51_get_stats(W5100_STATS  *pstats);
+void                                    W51_clear_stats(void);
+#else
+#define  W51_COUNT(field, n)            do { } while (0)
+#endif
+
+
 #endif
@@ -0,0 +1,3 @@
+fetch("/status.json")
+	.then(function (r) { return r.json(); })
+	.then(function (s) { document.title = s.device; });